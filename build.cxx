@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <string>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <cpp4scripts.hpp>
 
@@ -27,6 +28,36 @@ do_hash(uint64_t salt)
     return 0;
 }
 
+// -------------------------------------------------------------------------------------------------
+BUILD_STATUS
+build_bench(bool debug)
+//! Builds the load, replay, stat and trace tools, the sample application and the micro-benchmarks.
+{
+    const char* programs[] = { "fcgiload",   "echo_app",  "fcgireplay",
+                               "fcgistat",   "fcgitrace", "microbench" };
+    BUILD_STATUS rv = BUILD_STATUS::OK;
+    for (const char* prog : programs) {
+        path_list sources;
+        sources.add(path(string("./test/") + prog + ".cxx"));
+        builder_gcc make(&sources, prog, &cout);
+        make.set(BUILD::BIN);
+        make.add(debug ? BUILD::DEB : BUILD::REL);
+        if (args.is_set("-V"))
+            make.add(BUILD::VERBOSE);
+        make.add_comp("-fno-rtti -Wall -Wno-reorder -Wnon-virtual-dtor "
+                      "-I/usr/local/include/cpp4scripts");
+        make.add_comp(debug ? "-DC4S_LOG_LEVEL=2" : "-DC4S_LOG_LEVEL=3");
+        make.add_link(debug ? "-L./debug" : "-L./release");
+        make.add_link("-lfcgi -lc4s -pthread");
+        if (!strcmp(prog, "microbench"))
+            make.add_link("-lhoedown");
+        rv = make.build();
+        if (rv != BUILD_STATUS::OK)
+            break;
+    }
+    return rv;
+}
+
 // -------------------------------------------------------------------------------------------------
 int
 main(int argc, char** argv)
@@ -44,6 +75,9 @@ main(int argc, char** argv)
     args += argument("-V", false, "Enable verbose build");
     args += argument("-clean", false, "Clean build directories and files.");
     args += argument("-hash", true, "Calculate hash value for the given string.");
+    args += argument("-bench", false,
+                     "Build also benchmark and tool programs fcgiload, echo_app, fcgireplay, "
+                     "fcgistat, fcgitrace and microbench (needs -lhoedown).");
     try {
         args.initialize(argc, argv, 1);
         ps.push(args.exe);
@@ -87,6 +121,8 @@ main(int argc, char** argv)
         else
             make->add_comp("-DC4S_LOG_LEVEL=3");
         rv = make->build();
+        if (rv == BUILD_STATUS::OK && args.is_set("-bench"))
+            rv = build_bench(args.is_set("-deb"));
         if (rv == BUILD_STATUS::OK && args.is_set("-export")) {
             path host("/Volumes/menacon/vshare/base7/libfcgi/");
             make->export_prj(args.get_value("-export"), args.exe, host);
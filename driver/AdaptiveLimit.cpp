@@ -0,0 +1,117 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <math.h>
+
+#include "AdaptiveLimit.hpp"
+
+namespace fcgi_driver {
+
+// Baseline creeps towards higher latencies by 1 / AL_DRIFT of the difference per window so that
+// a permanent change in the backend is eventually accepted as the new normal.
+const double AL_DRIFT = 1000;
+
+// -------------------------------------------------------------------------------------------------
+AdaptiveLimit::AdaptiveLimit(uint32_t _min, uint32_t _max, uint32_t initial)
+/*! \param _min Limit never goes below this.
+  \param _max Limit never goes above this, e.g. the number of requests.
+  \param initial Starting limit. 0 = half way between min and max.
+ */
+{
+    min_limit = _min ? _min : 1;
+    max_limit = _max < min_limit ? min_limit : _max;
+    if (!initial)
+        initial = (min_limit + max_limit) / 2;
+    limit = initial < min_limit ? min_limit : initial > max_limit ? max_limit : initial;
+    limit_f = limit;
+    rtt_long = 0;
+    rtt_short = 0;
+    tolerance = 1.5;
+    smoothing = 0.2;
+    window = 100000;
+    min_samples = 10;
+    win_start = 0;
+    win_sum = 0;
+    win_count = 0;
+    win_inflight = 0;
+    last_inflight = 0;
+    samples = 0;
+    updates = 0;
+}
+// -------------------------------------------------------------------------------------------------
+void
+AdaptiveLimit::setWindow(uint64_t window_us, uint32_t _min_samples)
+/*! \param window_us Min time between limit updates.
+  \param _min_samples Min number of samples between limit updates.
+ */
+{
+    window = window_us;
+    min_samples = _min_samples ? _min_samples : 1;
+}
+// -------------------------------------------------------------------------------------------------
+void
+AdaptiveLimit::sample(uint64_t rtt_us, uint32_t inflight, uint64_t now_us)
+/*! Adds one request latency.
+  \param rtt_us Time from the beginning of the request until its response was sent.
+  \param inflight Number of requests in progress when this one completed.
+  \param now_us Current time from monotonic clock.
+ */
+{
+    if (!win_count)
+        win_start = now_us;
+    win_sum += rtt_us;
+    win_count++;
+    if (inflight > win_inflight)
+        win_inflight = inflight;
+    samples++;
+    if (win_count >= min_samples && now_us - win_start >= window)
+        update();
+}
+// -------------------------------------------------------------------------------------------------
+void
+AdaptiveLimit::update()
+{
+    rtt_short = win_sum / win_count;
+    last_inflight = win_inflight;
+    win_sum = 0;
+    win_count = 0;
+    win_inflight = 0;
+    updates++;
+    if (!rtt_short)
+        rtt_short = 1;
+    if (rtt_long == 0 || rtt_short < rtt_long)
+        rtt_long = rtt_short;
+    else
+        rtt_long += (rtt_short - rtt_long) / AL_DRIFT;
+    // Application is not using the limit. No evidence that more would work.
+    if (last_inflight < limit / 2)
+        return;
+    double gradient = tolerance * rtt_long / rtt_short;
+    if (gradient > 1.0)
+        gradient = 1.0;
+    else if (gradient < 0.5)
+        gradient = 0.5;
+    double target = limit_f * gradient + sqrt(limit_f);
+    limit_f = limit_f * (1 - smoothing) + target * smoothing;
+    if (limit_f < min_limit)
+        limit_f = min_limit;
+    else if (limit_f > max_limit)
+        limit_f = max_limit;
+    limit = (uint32_t)limit_f;
+}
+// -------------------------------------------------------------------------------------------------
+void
+AdaptiveLimit::getStats(LimitStats* st) const
+{
+    st->limit = limit;
+    st->inflight = last_inflight;
+    st->rtt_short = rtt_short;
+    st->rtt_long = (uint64_t)rtt_long;
+    st->samples = samples;
+    st->updates = updates;
+}
+
+} // namespace fcgi_driver
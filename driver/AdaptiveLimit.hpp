@@ -0,0 +1,62 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_ADAPTIVELIMIT_HPP
+#define FCGI_ADAPTIVELIMIT_HPP
+
+#include <stdint.h>
+
+namespace fcgi_driver {
+
+//! Snapshot of the limiter state for statistics. Times are in microseconds.
+struct LimitStats
+{
+    uint32_t limit;     // Currently admitted concurrency.
+    uint32_t inflight;  // Max requests in progress during the last window.
+    uint64_t rtt_short; // Average latency of the last window.
+    uint64_t rtt_long;  // Latency baseline, i.e. latency without queuing.
+    uint64_t samples;   // Latency samples taken.
+    uint64_t updates;   // Limit recalculations.
+};
+
+/*! Adjusts the number of requests served at once from measured latency. Samples are averaged
+  over a window and compared to the baseline, the lowest window average seen. When the window
+  latency rises above baseline * tolerance the limit shrinks in proportion; otherwise the limit
+  grows by roughly its square root per window. Limit does not grow while less than half of it is
+  in use.
+ */
+class AdaptiveLimit
+{
+  public:
+    AdaptiveLimit(uint32_t min_limit, uint32_t max_limit, uint32_t initial = 0);
+
+    void sample(uint64_t rtt_us, uint32_t inflight, uint64_t now_us);
+    void setWindow(uint64_t window_us, uint32_t min_samples);
+    void setTolerance(double ratio) { tolerance = ratio; }
+    uint32_t getLimit() const { return limit; }
+    void getStats(LimitStats*) const;
+
+  protected:
+    void update();
+
+    uint32_t min_limit, max_limit;
+    uint32_t limit;
+    double limit_f;       // Limit before rounding.
+    double rtt_long;      // Baseline latency.
+    uint64_t rtt_short;   // Latest window average latency.
+    double tolerance;     // Latency increase that is accepted before limit shrinks.
+    double smoothing;     // How much one window can move the limit.
+    uint64_t window;      // Min window length (us).
+    uint32_t min_samples; // Min samples in window.
+    uint64_t win_start, win_sum;
+    uint32_t win_count, win_inflight;
+    uint32_t last_inflight; // win_inflight of the previous window.
+    uint64_t samples, updates;
+};
+
+} // namespace fcgi_driver
+
+#endif
@@ -0,0 +1,120 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "Arena.hpp"
+
+namespace fcgi_driver {
+
+// -------------------------------------------------------------------------------------------------
+Arena::Arena(size_t _chunk_size, uint32_t _keep)
+/*! First chunk is allocated at first alloc so that idle requests do not hold memory.
+  \param _chunk_size Size of regular chunks. Larger allocations get a chunk of their own.
+  \param _keep Max number of regular chunks kept over reset.
+ */
+  : chunks(0)
+  , spare(0)
+  , pos(0)
+  , end(0)
+  , chunk_size(_chunk_size < 256 ? 256 : _chunk_size)
+  , keep(_keep)
+  , spare_count(0)
+  , used_bytes(0)
+  , chunk_allocs(0)
+{}
+// -------------------------------------------------------------------------------------------------
+Arena::~Arena()
+{
+    reset();
+    while (spare) {
+        Chunk* next = spare->next;
+        free(spare);
+        spare = next;
+    }
+}
+// -------------------------------------------------------------------------------------------------
+void*
+Arena::alloc(size_t size, size_t align)
+/*! \param align Power of two.
+  \retval void* Memory that stays valid until reset. Throws std::bad_alloc if out of memory.
+ */
+{
+    uintptr_t ptr = ((uintptr_t)pos + align - 1) & ~(uintptr_t)(align - 1);
+    if (!pos || ptr + size > (uintptr_t)end) {
+        grow(size + align);
+        ptr = ((uintptr_t)pos + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    pos = (char*)ptr + size;
+    used_bytes += size;
+    return (void*)ptr;
+}
+// -------------------------------------------------------------------------------------------------
+char*
+Arena::strdup(const char* str, size_t len)
+//! Copies len bytes and adds terminating zero.
+{
+    char* copy = (char*)alloc(len + 1, 1);
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    return copy;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Arena::grow(size_t need)
+{
+    Chunk* chunk;
+    need += sizeof(Chunk);
+    if (need <= chunk_size && spare) {
+        chunk = spare;
+        spare = spare->next;
+        spare_count--;
+    } else {
+        size_t size = need > chunk_size ? need : chunk_size;
+        chunk = (Chunk*)malloc(size);
+        if (!chunk)
+            throw std::bad_alloc();
+        chunk->size = size;
+        chunk_allocs++;
+    }
+    chunk->next = chunks;
+    chunks = chunk;
+    pos = (char*)(chunk + 1);
+    end = (char*)chunk + chunk->size;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Arena::reset()
+//! Releases all allocations. Regular chunks are kept for reuse up to the keep limit.
+{
+    while (chunks) {
+        Chunk* next = chunks->next;
+        if (chunks->size == chunk_size && spare_count < keep) {
+            chunks->next = spare;
+            spare = chunks;
+            spare_count++;
+        } else
+            free(chunks);
+        chunks = next;
+    }
+    pos = 0;
+    end = 0;
+    used_bytes = 0;
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+Arena::reserved() const
+{
+    size_t total = 0;
+    for (Chunk* ch = chunks; ch; ch = ch->next)
+        total += ch->size;
+    for (Chunk* ch = spare; ch; ch = ch->next)
+        total += ch->size;
+    return total;
+}
+
+} // namespace fcgi_driver
@@ -0,0 +1,113 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_ARENA_HPP
+#define FCGI_ARENA_HPP
+
+#include <new>
+#include <string>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fcgi_driver {
+
+const size_t ARENA_CHUNK = 0x4000; // Default chunk size.
+const uint32_t ARENA_KEEP = 4;     // Chunks kept for reuse over reset.
+
+/*! Monotonic memory for the life time of one request. Memory is taken from chunks in order and
+  released all at once with reset(), which keeps a few chunks for the next request. Nothing is
+  freed individually and destructors are not called: objects with resources must be destroyed
+  by their owner before reset.
+ */
+class Arena
+{
+  public:
+    explicit Arena(size_t chunk_size = ARENA_CHUNK, uint32_t keep = ARENA_KEEP);
+    ~Arena();
+
+    void* alloc(size_t size, size_t align = alignof(max_align_t));
+    char* strdup(const char* str, size_t len);
+    void reset();
+
+    template <class T, class... Args>
+    T* make(Args&&... args)
+    {
+        return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+    template <class T>
+    void destroy(T* obj)
+    {
+        if (obj)
+            obj->~T();
+    }
+
+    size_t used() const { return used_bytes; } //!< Bytes allocated since last reset.
+    size_t reserved() const;                   //!< Bytes held in chunks.
+    uint64_t getChunkAllocs() const { return chunk_allocs; }
+
+  protected:
+    struct Chunk
+    {
+        Chunk* next;
+        size_t size; // Including this header.
+    };
+    void grow(size_t need);
+
+    Chunk* chunks; // Chunks in use, newest first.
+    Chunk* spare;  // Chunks kept by reset.
+    char* pos;
+    char* end;
+    size_t chunk_size;
+    uint32_t keep, spare_count;
+    size_t used_bytes;
+    uint64_t chunk_allocs; // Number of chunks taken from the heap.
+
+  private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+};
+
+/*! Standard allocator on top of an Arena. Deallocate does nothing; memory returns to the arena at
+  reset. E.g. std::vector<int, ArenaAllocator<int>> vec(ArenaAllocator<int>(req->getArena()));
+ */
+template <class T>
+class ArenaAllocator
+{
+  public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena& a)
+      : arena(&a)
+    {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other)
+      : arena(other.arena)
+    {}
+    T* allocate(size_t n) { return (T*)arena->alloc(n * sizeof(T), alignof(T)); }
+    void deallocate(T*, size_t) {}
+
+    Arena* arena;
+};
+
+template <class T, class U>
+bool
+operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return a.arena == b.arena;
+}
+template <class T, class U>
+bool
+operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+    return a.arena != b.arena;
+}
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+} // namespace fcgi_driver
+
+#endif
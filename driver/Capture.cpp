@@ -0,0 +1,186 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <cpp4scripts.hpp>
+
+#include "fcgidriver.hpp"
+#include "Capture.hpp"
+
+namespace fcgi_driver {
+
+static const char CAP_MAGIC[8] = "FCGICAP";
+
+// -------------------------------------------------------------------------------------------------
+Capture::Capture(uint32_t _slots)
+  : fs(0)
+  , slots(_slots)
+  , sample(1)
+  , seen(0)
+  , conn_count(0)
+  , conn_max(CAP_CONN_MAX)
+  , file_max(CAP_FILE_MAX)
+  , file_size(0)
+{
+    conn_id = new uint32_t[slots];
+    conn_bytes = new size_t[slots];
+    memset(conn_id, 0, sizeof(uint32_t) * slots);
+    memset(conn_bytes, 0, sizeof(size_t) * slots);
+}
+// -------------------------------------------------------------------------------------------------
+Capture::~Capture()
+{
+    close();
+    delete[] conn_id;
+    delete[] conn_bytes;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Capture::open(const char* fname, uint32_t _sample, size_t _conn_max, size_t _file_max)
+/*! Starts a new capture. Existing file is overwritten.
+  \param fname Path to capture file.
+  \param _sample Capture every n:th connection. 1 = all.
+  \param _conn_max Max bytes from single connection. Longer connections are marked truncated.
+  \param _file_max Capture stops when the file would grow over this.
+ */
+{
+    close();
+    fs = fopen(fname, "w");
+    if (!fs) {
+        CS_VAPRT_ERRO("Capture::open - unable to create %s; errno %d", fname, errno);
+        return false;
+    }
+    setvbuf(fs, 0, _IOFBF, 0x10000);
+    sample = _sample ? _sample : 1;
+    conn_max = _conn_max;
+    file_max = _file_max;
+    seen = 0;
+    conn_count = 0;
+    memset(conn_id, 0, sizeof(uint32_t) * slots);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    CaptureFileHeader hdr;
+    memcpy(hdr.magic, CAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = CAP_VERSION;
+    hdr.sample = sample;
+    hdr.start_sec = time(0);
+    file_size = fwrite(&hdr, 1, sizeof(hdr), fs);
+    return file_size == sizeof(hdr);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Capture::close()
+{
+    if (!fs)
+        return;
+    fclose(fs);
+    fs = 0;
+    memset(conn_id, 0, sizeof(uint32_t) * slots);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Capture::put(uint32_t conn, cap_type_t type, const char* data, size_t len)
+{
+    if (file_size + sizeof(CaptureRecord) + len > file_max) {
+        CS_VAPRT_WARN("Capture::put - file limit reached after %u connections.", conn_count);
+        close();
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    CaptureRecord rec;
+    rec.time_us =
+        (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+    rec.conn = conn;
+    rec.len = len;
+    rec.type = type;
+    fwrite(&rec, sizeof(rec), 1, fs);
+    if (len)
+        fwrite(data, 1, len, fs);
+    file_size += sizeof(rec) + len;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Capture::begin(uint32_t slot)
+//! Called when a connection is given to request slot. Decides if the connection is sampled.
+{
+    if (!fs || slot >= slots)
+        return;
+    conn_id[slot] = 0;
+    conn_bytes[slot] = 0;
+    if (seen++ % sample)
+        return;
+    conn_id[slot] = ++conn_count;
+    put(conn_id[slot], CAP_OPEN, 0, 0);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Capture::data(uint32_t slot, RingBuffer& rb, size_t len)
+/*! Captures the last len bytes written into the ring buffer.
+  \param slot Request slot of the connection.
+  \param rb Input buffer of the request.
+  \param len Number of bytes just read into rb.
+ */
+{
+    if (!fs || slot >= slots || !conn_id[slot] || conn_bytes[slot] > conn_max)
+        return;
+    if (conn_bytes[slot] + len > conn_max) {
+        conn_bytes[slot] = conn_max + 1;
+        put(conn_id[slot], CAP_TRUNC, 0, 0);
+        return;
+    }
+    conn_bytes[slot] += len;
+    const char* span;
+    size_t size = rb.size();
+    if (rb.peek_span(&span, size) < size) {
+        // Heap mode buffer with wrapped data.
+        scratch.resize(size);
+        rb.peek(scratch.data(), size);
+        span = scratch.data();
+    }
+    put(conn_id[slot], CAP_DATA, span + size - len, len);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Capture::end(uint32_t slot)
+{
+    if (!fs || slot >= slots || !conn_id[slot])
+        return;
+    put(conn_id[slot], CAP_CLOSE, 0, 0);
+    conn_id[slot] = 0;
+}
+// -------------------------------------------------------------------------------------------------
+FILE*
+Capture::openRead(const char* fname, CaptureFileHeader* hdr)
+/*! Opens capture file for reading and reads its header.
+  \retval FILE* Positioned at the first record or null if the file is not a capture.
+ */
+{
+    FILE* in = fopen(fname, "r");
+    if (!in)
+        return 0;
+    if (fread(hdr, sizeof(CaptureFileHeader), 1, in) != 1 ||
+        memcmp(hdr->magic, CAP_MAGIC, sizeof(CAP_MAGIC)) || hdr->version != CAP_VERSION) {
+        fclose(in);
+        return 0;
+    }
+    return in;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Capture::readRecord(FILE* in, CaptureRecord* rec, std::vector<char>& data)
+//! Reads next record and its data. Returns false at the end of file or on truncated record.
+{
+    if (fread(rec, sizeof(CaptureRecord), 1, in) != 1)
+        return false;
+    data.resize(rec->len);
+    return !rec->len || fread(data.data(), 1, rec->len, in) == rec->len;
+}
+
+} // namespace fcgi_driver
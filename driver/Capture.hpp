@@ -0,0 +1,97 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_CAPTURE_HPP
+#define FCGI_CAPTURE_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+
+#include "RingBuffer.hpp"
+
+namespace fcgi_driver {
+
+const size_t CAP_CONN_MAX = 0x100000;  // Default max bytes captured from one connection.
+const size_t CAP_FILE_MAX = 0x10000000; // Default max size of the capture file.
+const uint32_t CAP_VERSION = 1;
+
+enum cap_type_t
+{
+    CAP_OPEN,  // Connection was given to a request.
+    CAP_DATA,  // Bytes read from the connection.
+    CAP_TRUNC, // Connection went over the byte limit. Rest of its data is not in the file.
+    CAP_CLOSE  // Driver closed the connection.
+};
+
+#pragma pack(push, 1)
+struct CaptureFileHeader
+{
+    char magic[8];      // "FCGICAP\0"
+    uint32_t version;   // CAP_VERSION
+    uint32_t sample;    // Every n:th connection was captured.
+    uint64_t start_sec; // Wall clock time at the start of capture.
+};
+
+struct CaptureRecord
+{
+    uint64_t time_us; // Since the start of capture (monotonic).
+    uint32_t conn;    // Connection number, starts from 1.
+    uint32_t len;     // Number of data bytes that follow the record.
+    uint8_t type;     // cap_type_t
+};
+#pragma pack(pop)
+
+/*! Records the raw inbound FastCGI bytes of sampled connections so that the traffic can be
+  replayed later, see test/fcgireplay.cxx. Captures contain everything the web server sends,
+  cookies and passwords included; treat the files accordingly. Data is written through a stdio
+  buffer, so the last few kilobytes are lost if the process is killed.
+ */
+class Capture
+{
+  public:
+    explicit Capture(uint32_t slots);
+    ~Capture();
+
+    bool open(const char* fname, uint32_t sample, size_t conn_max, size_t file_max);
+    void close();
+    bool isOpen() { return fs != 0; }
+
+    void begin(uint32_t slot);
+    void data(uint32_t slot, RingBuffer& rb, size_t len);
+    void end(uint32_t slot);
+
+    uint32_t getConnCount() { return conn_count; }
+    uint64_t getFileSize() { return file_size; }
+
+    static FILE* openRead(const char* fname, CaptureFileHeader* hdr);
+    static bool readRecord(FILE*, CaptureRecord* rec, std::vector<char>& data);
+
+  protected:
+    void put(uint32_t conn, cap_type_t type, const char* data, size_t len);
+
+    FILE* fs;
+    uint32_t slots;
+    uint32_t* conn_id;  // Connection number of each request slot, 0 = not captured.
+    size_t* conn_bytes; // Bytes captured from each slot's connection.
+    uint32_t sample;
+    uint32_t seen;       // Connections since start, captured or not.
+    uint32_t conn_count; // Captured connections.
+    size_t conn_max;
+    size_t file_max;
+    uint64_t file_size;
+    struct timespec start;
+    std::vector<char> scratch; // For wrapped ring buffer data.
+
+  private:
+    Capture(const Capture&);
+    Capture& operator=(const Capture&);
+};
+
+} // namespace fcgi_driver
+
+#endif
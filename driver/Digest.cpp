@@ -0,0 +1,356 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIGEST_X86
+#endif
+
+#include "Digest.hpp"
+
+namespace fcgi_driver {
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// -------------------------------------------------------------------------------------------------
+static void
+sha256_soft(uint32_t* state, const uint8_t* data, size_t count)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+
+    while (count--) {
+        for (int ndx = 0; ndx < 16; ndx++, data += 4)
+            w[ndx] = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 |
+                     data[3];
+        for (int ndx = 16; ndx < 64; ndx++) {
+            uint32_t s0 = ROTR(w[ndx - 15], 7) ^ ROTR(w[ndx - 15], 18) ^ (w[ndx - 15] >> 3);
+            uint32_t s1 = ROTR(w[ndx - 2], 17) ^ ROTR(w[ndx - 2], 19) ^ (w[ndx - 2] >> 10);
+            w[ndx] = w[ndx - 16] + s0 + w[ndx - 7] + s1;
+        }
+        a = state[0], b = state[1], c = state[2], d = state[3];
+        e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int ndx = 0; ndx < 64; ndx++) {
+            t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                 sha256_k[ndx] + w[ndx];
+            t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g, g = f, f = e, e = d + t1;
+            d = c, c = b, b = a, a = t1 + t2;
+        }
+        state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+        state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+    }
+}
+
+#ifdef DIGEST_X86
+// -------------------------------------------------------------------------------------------------
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+sha256_shani(uint32_t* state, const uint8_t* data, size_t count)
+//! SHA-256 with the x86 SHA extensions. Four rounds per step, message schedule with msg1/msg2.
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i st0, st1, tmp, msg, w[4], abef, cdgh;
+
+    tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+    st1 = _mm_loadu_si128((const __m128i*)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);       // CDAB
+    st1 = _mm_shuffle_epi32(st1, 0x1B);       // EFGH
+    st0 = _mm_alignr_epi8(tmp, st1, 8);       // ABEF
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);    // CDGH
+
+    while (count--) {
+        abef = st0;
+        cdgh = st1;
+        for (int ndx = 0; ndx < 16; ndx++) {
+            __m128i& cur = w[ndx & 3];
+            if (ndx < 4) {
+                cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + ndx * 16)), bswap);
+            } else {
+                // W[i] = msg2(msg1(W[i-4], W[i-3]) + W[i-1..i-2 aligned], W[i-1])
+                tmp = _mm_alignr_epi8(w[(ndx - 1) & 3], w[(ndx - 2) & 3], 4);
+                cur = _mm_sha256msg1_epu32(cur, w[(ndx - 3) & 3]);
+                cur = _mm_sha256msg2_epu32(_mm_add_epi32(cur, tmp), w[(ndx - 1) & 3]);
+            }
+            msg = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i*)&sha256_k[ndx * 4]));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, msg);
+        }
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+        data += 64;
+    }
+    tmp = _mm_shuffle_epi32(st0, 0x1B);       // FEBA
+    st1 = _mm_shuffle_epi32(st1, 0xB1);       // DCHG
+    st0 = _mm_blend_epi16(tmp, st1, 0xF0);    // DCBA
+    st1 = _mm_alignr_epi8(st1, tmp, 8);       // HGFE
+    _mm_storeu_si128((__m128i*)&state[0], st0);
+    _mm_storeu_si128((__m128i*)&state[4], st1);
+}
+#endif
+
+// -------------------------------------------------------------------------------------------------
+bool
+Sha256::hasHardware()
+{
+#ifdef DIGEST_X86
+    static const bool hw = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+    return hw;
+#else
+    return false;
+#endif
+}
+// -------------------------------------------------------------------------------------------------
+void
+Sha256::init()
+{
+    static const uint32_t initial[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(state, initial, sizeof(state));
+    total = 0;
+    buflen = 0;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Sha256::transform(const uint8_t* blocks, size_t count)
+{
+#ifdef DIGEST_X86
+    if (hasHardware()) {
+        sha256_shani(state, blocks, count);
+        return;
+    }
+#endif
+    sha256_soft(state, blocks, count);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Sha256::update(const void* data, size_t len)
+{
+    const uint8_t* ptr = (const uint8_t*)data;
+    total += len;
+    if (buflen) {
+        size_t fill = 64 - buflen < len ? 64 - buflen : len;
+        memcpy(buffer + buflen, ptr, fill);
+        buflen += fill;
+        ptr += fill;
+        len -= fill;
+        if (buflen < 64)
+            return;
+        transform(buffer, 1);
+        buflen = 0;
+    }
+    // Full blocks straight from the caller's data.
+    if (len >= 64) {
+        transform(ptr, len / 64);
+        ptr += len & ~(size_t)63;
+        len &= 63;
+    }
+    if (len) {
+        memcpy(buffer, ptr, len);
+        buflen = len;
+    }
+}
+// -------------------------------------------------------------------------------------------------
+void
+Sha256::final(uint8_t* digest)
+/*! Completes the hash and writes the SHA256_SIZE byte result into digest. Object has to be
+  initialized again before reuse.
+ */
+{
+    uint64_t bits = total * 8;
+    buffer[buflen++] = 0x80;
+    if (buflen > 56) {
+        memset(buffer + buflen, 0, 64 - buflen);
+        transform(buffer, 1);
+        buflen = 0;
+    }
+    memset(buffer + buflen, 0, 56 - buflen);
+    for (int ndx = 0; ndx < 8; ndx++)
+        buffer[56 + ndx] = (uint8_t)(bits >> (56 - ndx * 8));
+    transform(buffer, 1);
+    for (int ndx = 0; ndx < 8; ndx++) {
+        digest[ndx * 4] = (uint8_t)(state[ndx] >> 24);
+        digest[ndx * 4 + 1] = (uint8_t)(state[ndx] >> 16);
+        digest[ndx * 4 + 2] = (uint8_t)(state[ndx] >> 8);
+        digest[ndx * 4 + 3] = (uint8_t)state[ndx];
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+static uint32_t crc32c_table[8][256];
+
+static bool
+crc32c_init()
+{
+    for (uint32_t ndx = 0; ndx < 256; ndx++) {
+        uint32_t crc = ndx;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        crc32c_table[0][ndx] = crc;
+    }
+    for (uint32_t ndx = 0; ndx < 256; ndx++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t prev = crc32c_table[slice - 1][ndx];
+            crc32c_table[slice][ndx] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+static uint32_t
+crc32c_soft(uint32_t crc, const uint8_t* ptr, size_t len)
+//! Slicing-by-8 software CRC32C.
+{
+    static const bool ready = crc32c_init();
+    (void)ready;
+    while (len && ((uintptr_t)ptr & 7)) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *ptr++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | (uint32_t)ptr[2] << 16 |
+                             (uint32_t)ptr[3] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][ptr[4]] ^ crc32c_table[2][ptr[5]] ^ crc32c_table[1][ptr[6]] ^
+              crc32c_table[0][ptr[7]];
+        ptr += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *ptr++) & 0xff];
+    return crc;
+}
+
+#ifdef DIGEST_X86
+// -------------------------------------------------------------------------------------------------
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t* ptr, size_t len)
+{
+    while (len && ((uintptr_t)ptr & 7)) {
+        crc = _mm_crc32_u8(crc, *ptr++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t val;
+        memcpy(&val, ptr, 8);
+        crc64 = _mm_crc32_u64(crc64, val);
+        ptr += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len >= 4) {
+        uint32_t val;
+        memcpy(&val, ptr, 4);
+        crc = _mm_crc32_u32(crc, val);
+        ptr += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *ptr++);
+    return crc;
+}
+#endif
+
+// -------------------------------------------------------------------------------------------------
+bool
+crc32c_hardware()
+{
+#ifdef DIGEST_X86
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    return hw;
+#else
+    return false;
+#endif
+}
+// -------------------------------------------------------------------------------------------------
+uint32_t
+crc32c_update(uint32_t crc, const void* data, size_t len)
+/*! Continues CRC32C (Castagnoli) calculation.
+  \param crc Result of the previous call, 0 for the first.
+ */
+{
+    crc = ~crc;
+#ifdef DIGEST_X86
+    if (crc32c_hardware())
+        return ~crc32c_sse42(crc, (const uint8_t*)data, len);
+#endif
+    return ~crc32c_soft(crc, (const uint8_t*)data, len);
+}
+
+// -------------------------------------------------------------------------------------------------
+Digest::Digest()
+{
+    algos = DIGEST_NONE;
+    done = false;
+    crc32c = 0;
+    memset(sha256, 0, sizeof(sha256));
+}
+// -------------------------------------------------------------------------------------------------
+void
+Digest::begin(int _algos)
+{
+    algos = _algos;
+    done = false;
+    crc32c = 0;
+    memset(sha256, 0, sizeof(sha256));
+    if (algos & DIGEST_SHA256)
+        sha.init();
+}
+// -------------------------------------------------------------------------------------------------
+void
+Digest::update(const void* data, size_t len)
+{
+    if (done || !len)
+        return;
+    if (algos & DIGEST_SHA256)
+        sha.update(data, len);
+    if (algos & DIGEST_CRC32C)
+        crc32c = crc32c_update(crc32c, data, len);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Digest::end()
+{
+    if (done)
+        return;
+    if (algos & DIGEST_SHA256)
+        sha.final(sha256);
+    done = true;
+}
+// -------------------------------------------------------------------------------------------------
+std::string
+Digest::sha256Hex() const
+//! \retval std::string SHA-256 as lower case hex or empty string if it has not been calculated.
+{
+    static const char hexchr[] = "0123456789abcdef";
+    std::string hex;
+    if (!has(DIGEST_SHA256))
+        return hex;
+    hex.reserve(SHA256_SIZE * 2);
+    for (size_t ndx = 0; ndx < SHA256_SIZE; ndx++) {
+        hex += hexchr[sha256[ndx] >> 4];
+        hex += hexchr[sha256[ndx] & 0xf];
+    }
+    return hex;
+}
+
+} // namespace fcgi_driver
@@ -0,0 +1,69 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_DIGEST_HPP
+#define FCGI_DIGEST_HPP
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace fcgi_driver {
+
+//! Digest algorithms. Values can be combined.
+enum digest_t
+{
+    DIGEST_NONE = 0,
+    DIGEST_SHA256 = 0x01,
+    DIGEST_CRC32C = 0x02
+};
+const size_t SHA256_SIZE = 32;
+
+/*! Incremental SHA-256. Uses the x86 SHA extensions when the processor has them.
+ */
+class Sha256
+{
+  public:
+    Sha256() { init(); }
+    void init();
+    void update(const void* data, size_t len);
+    void final(uint8_t* digest);
+    static bool hasHardware();
+
+  protected:
+    void transform(const uint8_t* blocks, size_t count);
+
+    uint32_t state[8];
+    uint64_t total;
+    uint8_t buffer[64];
+    size_t buflen;
+};
+
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t len);
+bool crc32c_hardware();
+
+/*! Digests of a single data stream. Algorithms are selected with begin() and the results are
+  available after end().
+ */
+struct Digest
+{
+    Digest();
+    void begin(int algos);
+    void update(const void* data, size_t len);
+    void end();
+    bool has(digest_t dt) const { return done && (algos & dt); }
+    std::string sha256Hex() const;
+
+    int algos;       // Combination of digest_t values.
+    bool done;       // Results are final.
+    uint32_t crc32c; // CRC32C (Castagnoli) of the data.
+    uint8_t sha256[SHA256_SIZE];
+    Sha256 sha;
+};
+
+} // namespace fcgi_driver
+
+#endif
@@ -0,0 +1,285 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <cpp4scripts.hpp>
+
+#include "fcgidriver.hpp"
+#include "DiskWriter.hpp"
+#include "Trace.hpp"
+
+extern FILE* trace;
+
+namespace fcgi_driver {
+
+// -------------------------------------------------------------------------------------------------
+DiskWriter::DiskWriter(size_t _block_size, uint32_t _block_count, dw_sync_t _sync)
+  : block_size(_block_size)
+  , block_count(_block_count)
+  , sync(_sync)
+{
+    blocks = new Block[block_count];
+    pool = new char[block_size * block_count];
+    free_list = new uint32_t[block_count];
+    queue = new uint32_t[block_count];
+    for (uint32_t ndx = 0; ndx < block_count; ndx++) {
+        blocks[ndx].owner = 0;
+        blocks[ndx].fd = -1;
+        blocks[ndx].offset = 0;
+        blocks[ndx].len = 0;
+        blocks[ndx].data = pool + ndx * block_size;
+        free_list[ndx] = ndx;
+    }
+    free_count = block_count;
+    q_head = 0;
+    q_count = 0;
+    running = false;
+    pthread_mutex_init(&mtx, NULL);
+    pthread_cond_init(&cond_work, NULL);
+    pthread_cond_init(&cond_done, NULL);
+}
+// -------------------------------------------------------------------------------------------------
+DiskWriter::~DiskWriter()
+{
+    stop();
+    pthread_mutex_destroy(&mtx);
+    pthread_cond_destroy(&cond_work);
+    pthread_cond_destroy(&cond_done);
+    delete[] queue;
+    delete[] free_list;
+    delete[] pool;
+    delete[] blocks;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+DiskWriter::start()
+{
+    if (running)
+        return true;
+    running = true;
+    if (pthread_create(&thread, NULL, DiskWriter::run, this)) {
+        CS_VAPRT_ERRO("DiskWriter::start - unable to create writer thread. Errno %d", errno);
+        running = false;
+        return false;
+    }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+void
+DiskWriter::stop()
+//! Writes the queued blocks and stops the writer thread.
+{
+    if (!running)
+        return;
+    pthread_mutex_lock(&mtx);
+    running = false;
+    pthread_cond_signal(&cond_work);
+    pthread_mutex_unlock(&mtx);
+    pthread_join(thread, NULL);
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+DiskWriter::write(DWTicket* owner, int fd, off_t offset, const char* data, size_t len)
+/*! Queues data for writing at given file offset. The caller must not close the fd while owner has
+  pending blocks. See cancel().
+  \retval size_t Number of bytes queued or written.
+ */
+{
+    size_t total = len, room;
+    Block* blk;
+
+    if (!running)
+        return writeDirect(owner, fd, offset, data, len);
+    pthread_mutex_lock(&mtx);
+    while (len) {
+        // Coalesce with the last queued block if this continues it.
+        blk = q_count ? &blocks[queue[(q_head + q_count - 1) % block_count]] : 0;
+        if (blk && blk->owner == owner && blk->fd == fd && blk->offset + (off_t)blk->len == offset &&
+            blk->len < block_size) {
+            room = block_size - blk->len;
+        } else if (free_count) {
+            uint32_t bx = free_list[--free_count];
+            blk = &blocks[bx];
+            blk->owner = owner;
+            blk->fd = fd;
+            blk->offset = offset;
+            blk->len = 0;
+            queue[(q_head + q_count) % block_count] = bx;
+            q_count++;
+            owner->pending++;
+            room = block_size;
+        } else {
+            // Pool exhausted. Rather than blocking the caller, write the rest directly.
+            pthread_cond_signal(&cond_work);
+            pthread_mutex_unlock(&mtx);
+            TRACE("DiskWriter::write - pool full, writing %ld bytes directly\n", len);
+            return total - len + writeDirect(owner, fd, offset, data, len);
+        }
+        if (room > len)
+            room = len;
+        memcpy(blk->data + blk->len, data, room);
+        blk->len += room;
+        data += room;
+        offset += room;
+        len -= room;
+    }
+    pthread_cond_signal(&cond_work);
+    pthread_mutex_unlock(&mtx);
+    return total;
+}
+// -------------------------------------------------------------------------------------------------
+void
+DiskWriter::cancel(DWTicket* owner)
+/*! Drops owner's queued blocks and waits until blocks that are being written have completed.
+  After this the owner may close its files.
+ */
+{
+    if (!owner->pending)
+        return;
+    pthread_mutex_lock(&mtx);
+    uint32_t kept = 0;
+    for (uint32_t ndx = 0; ndx < q_count; ndx++) {
+        uint32_t bx = queue[(q_head + ndx) % block_count];
+        if (blocks[bx].owner == owner) {
+            blocks[bx].owner = 0;
+            free_list[free_count++] = bx;
+            owner->pending--;
+        } else {
+            queue[(q_head + kept) % block_count] = bx;
+            kept++;
+        }
+    }
+    q_count = kept;
+    while (owner->pending)
+        pthread_cond_wait(&cond_done, &mtx);
+    pthread_mutex_unlock(&mtx);
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+DiskWriter::writeDirect(DWTicket* owner, int fd, off_t offset, const char* data, size_t len)
+{
+    size_t left = len;
+    while (left) {
+        ssize_t bw = pwrite(fd, data, left, offset);
+        if (bw == -1) {
+            if (errno == EINTR)
+                continue;
+            if (!owner->error)
+                owner->error = errno;
+            break;
+        }
+        data += bw;
+        offset += bw;
+        left -= bw;
+    }
+    return len - left;
+}
+// -------------------------------------------------------------------------------------------------
+void*
+DiskWriter::run(void* arg)
+{
+    ((DiskWriter*)arg)->process();
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------
+void
+DiskWriter::process()
+{
+    uint32_t* batch = new uint32_t[block_count];
+    uint32_t count;
+
+    pthread_mutex_lock(&mtx);
+    for (;;) {
+        while (!q_count && running)
+            pthread_cond_wait(&cond_work, &mtx);
+        if (!q_count && !running)
+            break;
+        // Take everything queued so far.
+        count = 0;
+        while (q_count) {
+            batch[count++] = queue[q_head];
+            q_head = (q_head + 1) % block_count;
+            q_count--;
+        }
+        pthread_mutex_unlock(&mtx);
+        TRACE_EVENT(TE_DISK, -1, RQS_WAIT, TRACE_NO_SLOT, count, 0);
+        writeBatch(batch, count);
+        TRACE_EVENT(TE_DISK_END, -1, RQS_WAIT, TRACE_NO_SLOT, count, 0);
+        pthread_mutex_lock(&mtx);
+        for (uint32_t ndx = 0; ndx < count; ndx++) {
+            Block* blk = &blocks[batch[ndx]];
+            blk->owner->pending--;
+            blk->owner = 0;
+            free_list[free_count++] = batch[ndx];
+        }
+        pthread_cond_broadcast(&cond_done);
+    }
+    pthread_mutex_unlock(&mtx);
+    delete[] batch;
+}
+// -------------------------------------------------------------------------------------------------
+void
+DiskWriter::writeBatch(uint32_t* batch, uint32_t count)
+//! Writes blocks that continue each other in the same file with one pwritev call.
+{
+    struct iovec iov[IOV_MAX < 64 ? IOV_MAX : 64];
+    uint32_t first = 0, last;
+    int iovcnt;
+
+    while (first < count) {
+        Block* head = &blocks[batch[first]];
+        off_t next = head->offset + head->len;
+        iov[0].iov_base = head->data;
+        iov[0].iov_len = head->len;
+        iovcnt = 1;
+        size_t total = head->len;
+        for (last = first + 1; last < count && iovcnt < (int)(sizeof(iov) / sizeof(iovec));
+             last++) {
+            Block* blk = &blocks[batch[last]];
+            if (blk->fd != head->fd || blk->offset != next)
+                break;
+            iov[iovcnt].iov_base = blk->data;
+            iov[iovcnt].iov_len = blk->len;
+            iovcnt++;
+            next += blk->len;
+            total += blk->len;
+        }
+        ssize_t bw = pwritev(head->fd, iov, iovcnt, head->offset);
+        if (bw == -1 && errno == EINTR)
+            continue;
+        if (bw >= 0 && (size_t)bw < total) {
+            // Partial write. Write the rest block by block.
+            size_t done = bw;
+            for (uint32_t ndx = first; ndx < last; ndx++) {
+                Block* blk = &blocks[batch[ndx]];
+                if (done >= blk->len) {
+                    done -= blk->len;
+                    continue;
+                }
+                writeDirect(blk->owner, blk->fd, blk->offset + done, blk->data + done,
+                            blk->len - done);
+                done = 0;
+            }
+        } else if (bw == -1) {
+            TRACE("DiskWriter::writeBatch - pwritev failed for fd %d; errno %d\n", head->fd, errno);
+            for (uint32_t ndx = first; ndx < last; ndx++) {
+                if (!blocks[batch[ndx]].owner->error)
+                    blocks[batch[ndx]].owner->error = errno;
+            }
+        }
+        if (sync == DW_SYNC_BATCH)
+            fdatasync(head->fd);
+        first = last;
+    }
+}
+
+} // namespace fcgi_driver
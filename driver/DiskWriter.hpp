@@ -0,0 +1,92 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_DISKWRITER_HPP
+#define FCGI_DISKWRITER_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace fcgi_driver {
+
+const size_t DW_BLOCK_SIZE = 0x10000;
+const uint32_t DW_BLOCK_COUNT = 64;
+
+enum dw_sync_t
+{
+    DW_SYNC_NONE, // Leave flushing to the kernel.
+    DW_SYNC_BATCH // fdatasync each file after a batch has been written to it.
+};
+
+//! Owner's (request's) view to its writes.
+struct DWTicket
+{
+    DWTicket()
+      : pending(0)
+      , error(0)
+    {}
+    std::atomic<uint32_t> pending; // Number of queued blocks.
+    std::atomic<int> error;        // errno of the first failed write.
+};
+
+/*! Writes file data in a separate thread so that slow disks do not stall the scheduler. Data is
+  copied into a bounded pool of blocks. Consecutive blocks to same file are written with single
+  pwritev. When the pool is exhausted the data is written directly by the caller.
+ */
+class DiskWriter
+{
+  public:
+    DiskWriter(size_t block_size = DW_BLOCK_SIZE,
+               uint32_t block_count = DW_BLOCK_COUNT,
+               dw_sync_t sync = DW_SYNC_NONE);
+    ~DiskWriter();
+
+    bool start();
+    void stop();
+    size_t write(DWTicket*, int fd, off_t offset, const char* data, size_t len);
+    void cancel(DWTicket*);
+    bool isRunning() const { return running; }
+
+  protected:
+    struct Block
+    {
+        DWTicket* owner;
+        int fd;
+        off_t offset;
+        size_t len;
+        char* data;
+    };
+    static void* run(void*);
+    void process();
+    size_t writeDirect(DWTicket*, int fd, off_t offset, const char* data, size_t len);
+    void writeBatch(uint32_t* batch, uint32_t count);
+
+    size_t block_size;
+    uint32_t block_count;
+    dw_sync_t sync;
+    Block* blocks;
+    char* pool;
+    uint32_t* free_list; // Stack of free block indices.
+    uint32_t free_count;
+    uint32_t* queue; // FIFO of block indices waiting for writing.
+    uint32_t q_head, q_count;
+
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond_work;
+    pthread_cond_t cond_done;
+    bool running;
+
+  private:
+    DiskWriter(const DiskWriter&);
+    DiskWriter& operator=(const DiskWriter&);
+};
+
+} // namespace fcgi_driver
+
+#endif
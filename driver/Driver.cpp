@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -48,31 +49,41 @@ NameValue::NameValue()
     size = 0;
 }
 
-void
-NameValue::init()
+bool
+NameValue::parse(const uint8_t* data, size_t len)
+//! Decodes the length prefix of a name-value pair. Returns false if data is too short for it.
 {
     size = 0;
     name_len = 0;
     value_len = 0;
-    if (byte[0] >> 7 == 0) {
-        name_len = byte[0];
+    if (!len)
+        return false;
+    if (data[0] >> 7 == 0) {
+        name_len = data[0];
         size++;
     } else {
-        name_len |= (byte[0] & 0x7f) << 24;
-        name_len |= byte[1] << 16;
-        name_len |= byte[2] << 8;
-        name_len |= byte[3];
+        if (len < 5)
+            return false;
+        name_len |= (data[0] & 0x7f) << 24;
+        name_len |= data[1] << 16;
+        name_len |= data[2] << 8;
+        name_len |= data[3];
         size += 4;
     }
-    if (byte[size] >> 7 == 0) {
-        value_len = byte[size];
+    if (len <= size)
+        return false;
+    if (data[size] >> 7 == 0) {
+        value_len = data[size];
         size++;
     } else {
-        value_len |= (byte[size++] & 0x7f) << 24;
-        value_len |= byte[size++] << 16;
-        value_len |= byte[size++] << 8;
-        value_len |= byte[size++];
+        if (len < size + 4)
+            return false;
+        value_len |= (data[size++] & 0x7f) << 24;
+        value_len |= data[size++] << 16;
+        value_len |= data[size++] << 8;
+        value_len |= data[size++];
     }
+    return true;
 }
 
 // void NameValue::dump(std::ostream &os)
@@ -84,19 +95,187 @@ NameValue::init()
 //    total="<<name_len+value_len+size<<'\n';
 //}
 
+// -------------------------------------------------------------------------------------------------
+const Header*
+RecordReader::header()
+//! Returns the header at read position without consuming it, or null if it is not all in yet.
+{
+    if (rb.size() < sizeof(Header))
+        return 0;
+    const Header* hp = (const Header*)rb.view(sizeof(Header));
+    if (hp)
+        return hp;
+    rb.peek(&copy, sizeof(Header));
+    return &copy;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+RecordReader::nameValue(NameValue* nv)
+//! Decodes the length prefix of the next name-value pair without consuming it.
+{
+    const char* ptr;
+    size_t len = rb.peek_span(&ptr, sizeof(nv->byte));
+    if (len < sizeof(nv->byte) && len < rb.size()) {
+        len = rb.peek(nv->byte, sizeof(nv->byte));
+        ptr = (const char*)nv->byte;
+    }
+    return nv->parse((const uint8_t*)ptr, len);
+}
+// -------------------------------------------------------------------------------------------------
+const char*
+RecordReader::name(const NameValue& nv, char* buf)
+/*! Consumes the name of the pair. Name is returned in place, or copied into buf when it wraps in
+  heap mode. Pointer is valid until the next write into the buffer.
+ */
+{
+    const char* ptr = rb.view(nv.name_len);
+    if (ptr) {
+        rb.discard(nv.name_len);
+        return ptr;
+    }
+    rb.read(buf, nv.name_len);
+    return buf;
+}
+// -------------------------------------------------------------------------------------------------
+// Bounds for DriverLimits. Input buffer must hold the largest record (header, 64k content and
+// padding) so that records are always contiguous and can be parsed in place. Output is sent as
+// single record, i.e. it must fit 16-bit content length.
+const uint32_t DL_REQUESTS_MAX = 4096;
+const uint32_t DL_PARAM_KEYS_MIN = 16;
+const uint32_t DL_PARAM_KEYS_MAX = 4096;
+const size_t DL_PARAM_SIZE_MIN = 0x400;
+const size_t DL_INPUT_MIN = 0x11000;
+const size_t DL_INPUT_MAX = 0x1000000;
+const size_t DL_OUTPUT_MIN = 0x1000;
+const size_t DL_OUTPUT_MAX = 0xFFF0;
+const size_t DL_MEMSTDIN_MIN = 64;
+const size_t DL_FIELD_MIN = 0x400;
+const size_t DL_FIELD_MAX = 0x1000000;
+
+DriverLimits::DriverLimits()
+{
+    requests = DRIVER_POLL_FD;
+    param_keys = DRIVER_PARAMKEYS;
+    param_size = 0x2000;
+    input_size = DL_INPUT_MIN;
+    output_size = REQ_MAX_OUT;
+    mem_stdin = REQ_MAX_MEMSTDIN;
+    spool_mem = REQ_SPOOL_MEM_DEFAULT;
+    field_data = REQ_MAX_FLDDATA;
+}
+// -------------------------------------------------------------------------------------------------
+template <typename T>
+static bool
+clampLimit(const char* name, T& value, T min, T max)
+{
+    if (value >= min && value <= max)
+        return true;
+    T fixed = value < min ? min : max;
+    CS_VAPRT_WARN("DriverLimits - %s %lu out of bounds [%lu, %lu]. Using %lu.", name,
+                  (unsigned long)value, (unsigned long)min, (unsigned long)max,
+                  (unsigned long)fixed);
+    value = fixed;
+    return false;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+DriverLimits::validate()
+//! Forces the values within their bounds. Returns false if something had to be changed.
+{
+    bool ok = clampLimit<uint32_t>("MaxRequests", requests, 1, DL_REQUESTS_MAX);
+    ok &= clampLimit<uint32_t>("ParamKeys", param_keys, DL_PARAM_KEYS_MIN, DL_PARAM_KEYS_MAX);
+    ok &= clampLimit<size_t>("ParamSize", param_size, DL_PARAM_SIZE_MIN, DL_INPUT_MAX);
+    ok &= clampLimit<size_t>("InputSize", input_size, DL_INPUT_MIN, DL_INPUT_MAX);
+    ok &= clampLimit<size_t>("OutputSize", output_size, DL_OUTPUT_MIN, DL_OUTPUT_MAX);
+    ok &= clampLimit<size_t>("MemStdin", mem_stdin, DL_MEMSTDIN_MIN, DL_INPUT_MAX);
+    ok &= clampLimit<size_t>("SpoolMemLimit", spool_mem, 0, DL_INPUT_MAX * 64);
+    ok &= clampLimit<size_t>("FieldData", field_data, DL_FIELD_MIN, DL_FIELD_MAX);
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+DriverLimits::load(c4s::configuration* conf)
+/*! Reads the limits present in LibFCGI section of configuration. Missing values keep their
+  current values.
+  \retval bool False if some value was out of bounds and had to be adjusted.
+ */
+{
+    uint64_t val;
+    if (conf->get_value("LibFCGI", "MaxRequests", val))
+        requests = val > DL_REQUESTS_MAX ? DL_REQUESTS_MAX + 1 : (uint32_t)val;
+    if (conf->get_value("LibFCGI", "ParamKeys", val))
+        param_keys = val > DL_PARAM_KEYS_MAX ? DL_PARAM_KEYS_MAX + 1 : (uint32_t)val;
+    if (conf->get_value("LibFCGI", "ParamSize", val))
+        param_size = val;
+    if (conf->get_value("LibFCGI", "InputSize", val))
+        input_size = val;
+    if (conf->get_value("LibFCGI", "OutputSize", val))
+        output_size = val;
+    if (conf->get_value("LibFCGI", "MemStdin", val))
+        mem_stdin = val;
+    if (conf->get_value("LibFCGI", "SpoolMemLimit", val))
+        spool_mem = val;
+    if (conf->get_value("LibFCGI", "FieldData", val))
+        field_data = val;
+    return validate();
+}
 // -------------------------------------------------------------------------------------------------
 Driver::Driver(PageArbiter* _arb, size_t paramsize, uint32_t _req_count)
   : arbiter(_arb)
 {
+    DriverLimits dl;
+    dl.param_size = paramsize;
+    dl.requests = _req_count > DRIVER_POLL_FD ? DRIVER_POLL_FD : _req_count;
+    init(dl);
+}
+// -------------------------------------------------------------------------------------------------
+Driver::Driver(PageArbiter* _arb, const DriverLimits& dl)
+  : arbiter(_arb)
+{
+    init(dl);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::init(const DriverLimits& dl)
+{
+    limits = dl;
+    limits.validate();
     plimit_hash_list = 0;
-    Request::input_size = 0x11000; // Currently this is forced to high enough value.
-    Request::param_size = paramsize;
+    writer = 0;
+    capture = 0;
+    stats = 0;
+    shm = 0;
+    shm_wait = SHM_STAT_INTERVAL;
+    shm_next = 0;
+    blob_gc_wait = 0;
+    blob_gc_next = 0;
+    // Records are always contiguous in input buffer and can be parsed in place.
+    Request::input_size = limits.input_size;
+    Request::input_mode = RB_MIRROR;
+    Request::param_size = limits.param_size;
+    Request::param_keys = limits.param_keys;
+    Request::output_size = limits.output_size;
+    Request::memstdin_size = limits.mem_stdin;
+    Request::spool_limit = limits.spool_mem;
+    Request::field_size = limits.field_data;
     Request::driver = this;
-    req_count = _req_count > DRIVER_POLL_FD ? DRIVER_POLL_FD : _req_count;
+    req_count = limits.requests;
+    eof_pfd = new pollfd[req_count];
+    eof_reqs = new Request*[req_count];
     requests = new Request*[req_count];
+    slots = new ReqSlot[req_count];
     for (uint32_t ndx = 0; ndx < req_count; ndx++)
-        requests[ndx] = new Request();
+        requests[ndx] = new Request(&slots[ndx]);
+    ready = new uint32_t[req_count];
+    ready_head = 0;
+    ready_count = 0;
     served_count = 0;
+    admit_max = 0;
+    admit_wait = 0;
+    reject_status = 0;
+    rejected_count = 0;
+    prio_cookie = "sid";
+    limiter = 0;
     clock_gettime(CLOCK_REALTIME, &start_time);
 #ifdef UNIT_TEST
     char trname[28];
@@ -112,9 +291,28 @@ Driver::Driver(PageArbiter* _arb, size_t paramsize, uint32_t _req_count)
 // -------------------------------------------------------------------------------------------------
 Driver::~Driver()
 {
+    for (const AdmitWait& aw : admit_queue)
+        close(aw.fd);
     for (uint32_t ndx = 0; ndx < req_count; ndx++)
         delete requests[ndx];
     delete[] requests;
+    delete[] slots;
+    delete[] ready;
+    delete[] eof_pfd;
+    delete[] eof_reqs;
+    // Requests cancel their writes when deleted. Writer goes after them.
+    if (writer)
+        delete writer;
+    if (limiter)
+        delete limiter;
+    if (capture)
+        delete capture;
+    if (shm)
+        delete shm;
+    if (stats) {
+        Request::stats = 0;
+        delete stats;
+    }
     if (upload_log.is_open())
         upload_log.close();
 #ifdef UNIT_TEST
@@ -124,6 +322,162 @@ Driver::~Driver()
 }
 // -------------------------------------------------------------------------------------------------
 bool
+Driver::enableDiskWriter(size_t block_size, uint32_t block_count, dw_sync_t sync)
+/*! Moves spool and upload file writes into a separate writer thread. Call before the scheduler
+  is started.
+  \param block_size Size of single write buffer.
+  \param block_count Number of buffers. When all are in use the data is written directly.
+  \param sync DW_SYNC_BATCH syncs the file data after each write batch.
+ */
+{
+    if (writer)
+        return true;
+    writer = new DiskWriter(block_size, block_count, sync);
+    if (!writer->start()) {
+        delete writer;
+        writer = 0;
+        return false;
+    }
+    upstore.setWriter(writer);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Driver::enableCapture(const char* fname, uint32_t sample, size_t conn_max, size_t file_max)
+/*! Starts to record the raw input of connections into a file for fcgireplay. Connections that
+  are already in progress are not captured.
+  \param fname Capture file. Existing file is overwritten.
+  \param sample Capture every n:th connection.
+  \param conn_max Max bytes per connection. Longer connections are marked truncated.
+  \param file_max Capture stops when the file reaches this size.
+ */
+{
+    if (!capture)
+        capture = new Capture(req_count);
+    return capture->open(fname, sample, conn_max, file_max);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::disableCapture()
+{
+    if (capture)
+        capture->close();
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::enableStats(const char* page_uri, bool local_only)
+/*! Starts to collect request lifecycle statistics and serves them at page_uri. Text is the
+  default; query format=prometheus gives Prometheus exposition format. Costs a clock read at each
+  lifecycle mark of a request.
+  \param page_uri Path of the statistics page. Null or empty = statistics without the page.
+  \param local_only Serve the page only when REMOTE_ADDR is loopback or not given.
+ */
+{
+    if (stats)
+        delete stats;
+    stats = new Stats(this, page_uri, local_only);
+    Request::stats = stats;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::setUploadDedup(bool on, time_t gc_interval)
+/*! Turns content addressed upload storage on or off.
+  \param gc_interval Blobs without references are collected at most this often (seconds) while
+  the scheduler is idle. Only blobs older than the interval are removed. 0 = collect only with
+  collectUploadBlobs.
+ */
+{
+    upstore.setContentAddressed(on);
+    blob_gc_wait = gc_interval;
+    blob_gc_next = time(0) + gc_interval;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::collectIdle()
+//! Scheduler calls this when there are no open connections.
+{
+    if (!blob_gc_wait || !upstore.isContentAddressed())
+        return;
+    time_t now = time(0);
+    if (now < blob_gc_next)
+        return;
+    blob_gc_next = now + blob_gc_wait;
+    size_t removed = upstore.collect(blob_gc_wait);
+    if (removed)
+        CS_VAPRT_INFO("Driver::collectIdle - removed %ld upload blobs.", removed);
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Driver::enableShmStats(const char* prefix, uint64_t interval_us)
+/*! Publishes slot states, queue depths and counters into shared memory segment
+  /dev/shm/<prefix>.<pid> for test/fcgistat. Scheduler updates it at most once per interval.
+  Enables the lifecycle statistics without the page if they are not on yet, since byte and
+  error counters come from there. In prefork deployments call this in each child.
+  \param prefix Segment name prefix.
+  \param interval_us Min time between updates in microseconds.
+ */
+{
+    if (!shm)
+        shm = new ShmStats();
+    if (!shm->open(prefix)) {
+        delete shm;
+        shm = 0;
+        return false;
+    }
+    if (!stats)
+        enableStats(0);
+    shm_wait = interval_us;
+    updateShm(0, true);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::updateShm(const SchedCounters* sc, bool force)
+//! Takes a snapshot into the shared memory segment unless the last one is recent enough.
+{
+    uint64_t now = stat_clock();
+    if (now < shm_next && !force)
+        return;
+    shm_next = now + shm_wait;
+    ShmStatData data;
+    memset(&data, 0, sizeof(data));
+    data.update_us = now;
+    data.served = served_count;
+    data.rejected = rejected_count;
+    data.requests = req_count;
+    for (uint32_t ndx = 0; ndx < req_count; ndx++) {
+        if (slots[ndx].state < SHM_STAT_STATES)
+            data.state[slots[ndx].state]++;
+    }
+    data.admit_waiting = admit_queue.size();
+    data.ready = ready_count;
+    data.limit = limiter ? limiter->getLimit() : 0;
+    if (stats)
+        data.counters = stats->counters;
+    if (sc)
+        data.sched = *sc;
+    shm->publish(data);
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Driver::setResumeDir(const char* dest_dir)
+/*! Sets the directory for resumable upload spools. Upload directory is used if this is not set.
+  Spools have to survive restarts, i.e. tmpfs is not a good choice.
+  \param dest_dir Full path to directory.
+ */
+{
+    resume_path = dest_dir;
+    if (resume_path.empty() || *resume_path.rbegin() != '/')
+        resume_path += '/';
+    if (resume_path.size() > REQ_MAX_URI - REQ_MAX_FILENAME) {
+        resume_path.clear();
+        CS_PRINT_ERRO("Driver::setResumeDir - resume path too long.");
+        return false;
+    }
+    return access(resume_path.c_str(), W_OK) == 0;
+}
+// -------------------------------------------------------------------------------------------------
+bool
 Driver::setFileDir(const char* dest_dir)
 /*! We need to have a place to store the uploaded files.
   \param dest_dir Full path to destination directory.
@@ -136,9 +490,11 @@ Driver::setFileDir(const char* dest_dir)
         upload_path += '/';
     if (upload_path.size() > REQ_MAX_URI - REQ_MAX_FILENAME) {
         upload_path = "./";
+        upstore.setPath(upload_path);
         CS_PRINT_ERRO("Driver::setFileDir - upload path too long.");
         return false;
     }
+    upstore.setPath(upload_path);
     std::string logname(upload_path);
     logname += "fcgi-upload.log";
     // We test the write permissions by opening upload log into this dir.
@@ -152,7 +508,7 @@ Driver::getFreeRequestCount()
     int count = 0;
     uint32_t ndx;
     for (ndx = 0; ndx < req_count; ndx++) {
-        if (requests[ndx]->getState() == RQS_WAIT) {
+        if (slots[ndx].state == RQS_WAIT) {
             count++;
         }
     }
@@ -160,13 +516,35 @@ Driver::getFreeRequestCount()
 }
 // -------------------------------------------------------------------------------------------------
 void
-Driver::createRequest(pollfd* newfd)
+Driver::setAdmission(uint32_t queue_max, uint32_t wait_ms, uint16_t status)
+/*! Sets the admission control for connections that arrive when all requests are in use.
+  \param queue_max Max number of connections waiting for a free request. 0 = reject at once.
+  \param wait_ms Max time a connection can wait before it is rejected.
+  \param status HTTP status sent to rejected connections (e.g. 503). 0 = FastCGI OVERLOADED.
+ */
 {
-    uint32_t ndx;
-    // Check whether we have open request with this fd.
-    for (ndx = 0; ndx < req_count; ndx++) {
-        if (requests[ndx]->getState() == RQS_WAIT) {
+    admit_max = queue_max;
+    admit_wait = wait_ms;
+    reject_status = status;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Driver::startRequest(pollfd* newfd, const struct timespec* since)
+/*! \param since Time the connection was accepted if it has waited in admit queue. */
+{
+    if (limiter && countActive() >= limiter->getLimit())
+        return false;
+    for (uint32_t ndx = 0; ndx < req_count; ndx++) {
+        if (slots[ndx].state == RQS_WAIT) {
             requests[ndx]->setPollFd(newfd); // => RQS_PARAMS
+            requests[ndx]->traceEvent(TE_START);
+            if (capture)
+                capture->begin(ndx);
+            if (stats) {
+                requests[ndx]->marks[SM_ACCEPT] =
+                    since ? since->tv_sec * 1000000UL + since->tv_nsec / 1000 : stat_clock();
+                requests[ndx]->mark(SM_START);
+            }
 #ifdef UNIT_TEST
             char tbuf[128];
             time_t now = time(0);
@@ -174,11 +552,221 @@ Driver::createRequest(pollfd* newfd)
             strftime(tbuf, sizeof(tbuf), "--\nDriver::createRequest - %F %T\n", tm);
             fputs(tbuf, trace);
 #endif
-            return;
+            return true;
         }
     }
-    TRACE("Driver::createRequest - Out of requests (%d / %d)!\n", ndx, req_count);
-    CS_PRINT_CRIT("Driver::createRequest - Out of requests!!");
+    return false;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::enableAdaptiveLimit(uint32_t min_limit, uint32_t max_limit)
+/*! Starts to limit the number of requests in progress by their measured latency. Connections
+  over the limit are handled by the admission control, see setAdmission.
+  \param min_limit Limit never goes below this.
+  \param max_limit Limit never goes above this. 0 = number of requests.
+ */
+{
+    if (!max_limit || max_limit > req_count)
+        max_limit = req_count;
+    if (limiter)
+        delete limiter;
+    limiter = new AdaptiveLimit(min_limit, max_limit);
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Driver::getLimitStats(LimitStats* st)
+//! Returns false if adaptive limit is not in use.
+{
+    if (!limiter)
+        return false;
+    limiter->getStats(st);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+uint32_t
+Driver::countActive()
+//! Requests that have been started and are not yet at EOF.
+{
+    uint32_t count = 0;
+    for (uint32_t ndx = 0; ndx < req_count; ndx++) {
+        if (slots[ndx].state != RQS_WAIT && slots[ndx].state != RQS_EOF)
+            count++;
+    }
+    return count;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::requestDone(Request* req)
+//! Request has sent its response. Feeds the latency to the adaptive limit.
+{
+    req->mark(SM_EOF);
+    req->traceEvent(TE_EOF);
+    if (!limiter || !req->begin_time.tv_sec)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_us = now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+    uint64_t begin_us = req->begin_time.tv_sec * 1000000UL + req->begin_time.tv_nsec / 1000;
+    limiter->sample(now_us - begin_us, countActive() + 1, now_us);
+    req->begin_time.tv_sec = 0;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::createRequest(pollfd* newfd)
+/*! Starts a request for new connection. If all requests are in use the connection waits in admit
+  queue or, when the queue is full, it is rejected.
+ */
+{
+    if (admit_queue.empty() && startRequest(newfd))
+        return;
+    if (stats)
+        stats->counters.out_of_slot++;
+    if (admit_queue.size() >= admit_max) {
+        TRACE("Driver::createRequest - Out of requests (%d), rejecting fd %d\n", req_count,
+              newfd->fd);
+        TRACE_EVENT(TE_REJECT, newfd->fd, RQS_WAIT, TRACE_NO_SLOT, 0, admit_queue.size());
+        rejectConnection(newfd->fd);
+        return;
+    }
+    AdmitWait aw;
+    aw.fd = newfd->fd;
+    clock_gettime(CLOCK_MONOTONIC, &aw.since);
+    aw.prio = peekPriority(aw.fd);
+    admit_queue.push_back(aw);
+    TRACE("Driver::createRequest - fd %d waits, queue %ld\n", aw.fd, admit_queue.size());
+    TRACE_EVENT(TE_QUEUE, aw.fd, RQS_WAIT, TRACE_NO_SLOT, aw.prio, admit_queue.size());
+    admitWaiting();
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::admitWaiting()
+/*! Rejects the connections that have waited too long and starts requests for the rest as long as
+  there are free requests. Connections with session cookie go before anonymous ones.
+ */
+{
+    if (admit_queue.empty())
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (auto aw = admit_queue.begin(); aw != admit_queue.end();) {
+        long waited = (now.tv_sec - aw->since.tv_sec) * 1000 +
+                      (now.tv_nsec - aw->since.tv_nsec) / 1000000;
+        if (waited >= (long)admit_wait) {
+            TRACE("Driver::admitWaiting - fd %d waited %ld ms\n", aw->fd, waited);
+            rejectConnection(aw->fd);
+            aw = admit_queue.erase(aw);
+            continue;
+        }
+        if (aw->prio < 0)
+            aw->prio = peekPriority(aw->fd);
+        aw++;
+    }
+    pollfd newfd;
+    newfd.events = POLLIN;
+    newfd.revents = 0;
+    while (!admit_queue.empty()) {
+        auto next = admit_queue.begin();
+        for (auto aw = admit_queue.begin(); aw != admit_queue.end(); aw++) {
+            if (aw->prio > 0) {
+                next = aw;
+                break;
+            }
+        }
+        newfd.fd = next->fd;
+        if (!startRequest(&newfd, &next->since))
+            break;
+        admit_queue.erase(next);
+    }
+}
+// -------------------------------------------------------------------------------------------------
+int
+Driver::peekPriority(int fd)
+/*! Looks at the parameters web server has already sent without consuming them.
+  \retval int 1 if the request carries the priority cookie or LIBFCGI_SID, 0 if it does not and -1
+  if the parameters have not arrived yet.
+ */
+{
+    char buf[4096];
+    ssize_t rb = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    if (rb <= 0)
+        return -1;
+    // Parameters are complete when the empty PARAMS record is in.
+    bool complete = false;
+    for (ssize_t pos = 0; pos + (ssize_t)sizeof(Header) <= rb;) {
+        Header* hp = (Header*)(buf + pos);
+        if (hp->type == TYPE_PARAMS && hp->content_length.get() == 0) {
+            complete = true;
+            break;
+        }
+        pos += sizeof(Header) + hp->content_length.get() + hp->padding_length;
+    }
+    if (!complete && rb < (ssize_t)sizeof(buf))
+        return -1;
+    // Name-value pairs: name length (1 byte, short names), value length (1 or 4 bytes), name, value.
+    const char* end = buf + rb;
+    const char* name = (const char*)memmem(buf, rb, "LIBFCGI_SID", 11);
+    if (name && name - buf >= 2 && name[-2] == 11 && name[-1] != 0)
+        return 1;
+    name = (const char*)memmem(buf, rb, "HTTP_COOKIE", 11);
+    if (!name || name - buf < 2 || prio_cookie.empty())
+        return 0;
+    size_t vlen;
+    if (name[-2] == 11 && !(name[-1] & 0x80))
+        vlen = (uint8_t)name[-1];
+    else if (name - buf >= 5 && name[-5] == 11 && (name[-4] & 0x80))
+        vlen = ((uint8_t)name[-4] & 0x7f) << 24 | (uint8_t)name[-3] << 16 |
+               (uint8_t)name[-2] << 8 | (uint8_t)name[-1];
+    else
+        return 0;
+    const char* value = name + 11;
+    if (vlen > (size_t)(end - value))
+        vlen = end - value;
+    for (const char* ptr = value; ptr + prio_cookie.size() < value + vlen; ptr++) {
+        if ((ptr == value || ptr[-1] == ' ' || ptr[-1] == ';') &&
+            !strncmp(ptr, prio_cookie.c_str(), prio_cookie.size()) &&
+            ptr[prio_cookie.size()] == '=')
+            return 1;
+    }
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::rejectConnection(int fd)
+/*! Answers a connection that did not get a request and closes it. Reply is END_REQUEST with
+  OVERLOADED status or, if reject status has been set, a response with that HTTP status.
+ */
+{
+    char buf[4096];
+    uint16_t id = 1;
+    ssize_t rb = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (rb >= (ssize_t)sizeof(Header) && ((Header*)buf)->type == TYPE_BEGIN_REQUEST)
+        id = ((Header*)buf)->request_id.get();
+    // Drain what has arrived so that close does not reset the connection before web server has
+    // read the reply.
+    for (int rounds = 0; rb > 0 && rounds < 16; rounds++)
+        rb = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+    size_t len = 0;
+    if (reject_status) {
+        char* body = buf + sizeof(Header);
+        int blen = sprintf(body, "Status: %d\r\nContent-Type: text/plain\r\nRetry-After: 1\r\n\r\n",
+                           reject_status);
+        Header stdout_hdr(TYPE_STDOUT, id, blen);
+        memcpy(buf, &stdout_hdr, sizeof(Header));
+        len = sizeof(Header) + blen;
+        Header eos(TYPE_STDOUT, id, 0);
+        memcpy(buf + len, &eos, sizeof(Header));
+        len += sizeof(Header);
+    }
+    EndRequestMsg erm(id, reject_status, reject_status ? REQUEST_COMPLETE : OVERLOADED);
+    memcpy(buf + len, &erm, sizeof(EndRequestMsg));
+    len += sizeof(EndRequestMsg);
+    if (::write(fd, buf, len) != (ssize_t)len) {
+        TRACE("Driver::rejectConnection - write to fd %d failed.\n", fd);
+    }
+    shutdown(fd, SHUT_WR);
+    close(fd);
+    rejected_count++;
 }
 // -------------------------------------------------------------------------------------------------
 Request*
@@ -187,7 +775,7 @@ Driver::findRequest(uint32_t fd)
     // Get the request for this FD
     uint32_t ndx;
     for (ndx = 0; ndx < req_count; ndx++) {
-        if (requests[ndx]->getFd() == fd)
+        if ((uint32_t)slots[ndx].pfd.fd == fd)
             break;
     }
     if (ndx == req_count) {
@@ -203,8 +791,8 @@ Driver::fillPollFd(pollfd* pfd, size_t max)
 {
     size_t px = 0;
     for (uint32_t ndx = 0; ndx < req_count && ndx < max; ndx++) {
-        if (requests[ndx]->isRead() || requests[ndx]->isWrite()) {
-            memcpy(&pfd[px++], &requests[ndx]->pfd, sizeof(pollfd));
+        if (slots[ndx].isRead() || slots[ndx].isWrite()) {
+            memcpy(&pfd[px++], &slots[ndx].pfd, sizeof(pollfd));
         }
     }
     return px;
@@ -229,18 +817,22 @@ Driver::dumpHex(void* data, size_t len, std::ostream& stm)
 }
 
 // -------------------------------------------------------------------------------------------------
-// Returns true when at whole message has been read in.
 void
 Driver::read(Request* req)
+/*! Reads only as much as there is room in request's input buffer. When the buffer fills above
+  high water mark the request stops polling for input until work() has drained it.
+ */
 {
-    static char copybuf[0x11000];
     ssize_t rb;
-    size_t wb;
 
     // Read the request fd
     size_t rbcap = req->rbin.capacity();
-    ssize_t max = (ssize_t)(rbcap < sizeof(copybuf) ? rbcap : sizeof(copybuf));
-    rb = ::read(req->getFd(), copybuf, max);
+    if (!rbcap) {
+        req->holdInput();
+        return;
+    }
+    // Data goes straight into the input buffer.
+    rb = req->rbin.read_from(req->getFd(), rbcap);
     if (rb == -1) {
         if (errno != EAGAIN) {
             TRACE("Driver::read %d - read error: %s", req->getFd(), strerror(errno));
@@ -249,101 +841,211 @@ Driver::read(Request* req)
     }
     if (!rb)
         return;
-    wb = req->rbin.write(copybuf, rb);
-    if (wb != (size_t)rb) {
-        TRACE("Driver::read(%d) - unable to store required bytes: rbcap=%ld; rb=%ld; wb=%ld",
-              req->getFd(), rbcap, rb, wb);
-        req->end(500);
-    }
+    if (capture)
+        capture->data(req->hot - slots, req->rbin, rb);
+    if (stats)
+        stats->counters.bytes_in += rb;
+    req->traceEvent(TE_READ, rb);
+    req->hot->in_bytes = req->rbin.size();
+    if (req->hot->in_bytes >= DRIVER_RB_HIGHWATER)
+        req->holdInput();
+    schedule(req);
     TRACE("Driver::read(%d) - raw data %ld bytes\n", req->getFd(), rb);
 }
 
+// -------------------------------------------------------------------------------------------------
+void
+Driver::schedule(Request* req)
+//! Puts the request into ready queue so that the next work() processes it.
+{
+    if (req->hot >= slots && req->hot < slots + req_count)
+        schedule((uint32_t)(req->hot - slots));
+}
+// -------------------------------------------------------------------------------------------------
+void
+Driver::schedule(uint32_t ndx)
+{
+    if (ndx >= req_count || slots[ndx].queued)
+        return;
+    slots[ndx].queued = true;
+    ready[(ready_head + ready_count) % req_count] = ndx;
+    ready_count++;
+}
 // -------------------------------------------------------------------------------------------------
 void
 Driver::work()
+/*! Processes the requests in ready queue. Each request drains its complete records until it runs
+  out of them or has used DRIVER_WORK_BUDGET bytes. Requests that still have work are queued again
+  and get their next turn after the others.
+ */
 {
-    Header hp;
+    uint32_t turn = ready_count;
+    if (!turn)
+        return;
+    TRACE_EVENT(TE_WORK, -1, RQS_WAIT, TRACE_NO_SLOT, turn, 0);
+    while (turn--) {
+        uint32_t ndx = ready[ready_head];
+        ready_head = (ready_head + 1) % req_count;
+        ready_count--;
+        ReqSlot& slot = slots[ndx];
+        slot.queued = false;
+        Request* req = requests[ndx];
+
+        size_t budget = DRIVER_WORK_BUDGET;
+        size_t before = req->rbin.size();
+        bool more;
+        while ((more = processRecord(req))) {
+            size_t used = before - req->rbin.size();
+            if (used >= budget)
+                break;
+            budget -= used;
+            before = req->rbin.size();
+        }
+        slot.in_bytes = req->rbin.size();
+        if (slot.flags.is(FLAG_DISKWAIT) && !req->diskPending())
+            req->finishInput();
+        if (slot.flags.is(FLAG_INHOLD) && slot.in_bytes < req->rbin.max_size() / 2)
+            req->releaseInput();
+        if (more || slot.flags.is(FLAG_DISKWAIT) || slot.flags.is(FLAG_ROUTEWAIT))
+            schedule(ndx);
+    }
+    TRACE_EVENT(TE_WORK_END, -1, RQS_WAIT, TRACE_NO_SLOT, ready_count, 0);
+}
+
+// -------------------------------------------------------------------------------------------------
+bool
+Driver::processRecord(Request* req)
+//! Processes one record from request input. Returns true if there might be more to process.
+{
+    RecordReader reader(req->rbin);
+    const Header* hp;
     uint32_t msg_total;
     uint16_t msg_len;
+    uint8_t type, padding;
 
-    // for requests
-    for (uint32_t ndx = 0; ndx < req_count; ndx++) {
-        // We must be in reading mode
-        if (requests[ndx]->state != RQS_PARAMS && requests[ndx]->state != RQS_STDIN)
-            continue;
-        // Bail out if we do not have the header yet, read some more.
-        if (requests[ndx]->rbin.size() < sizeof(Header))
-            continue;
-        // Peek the header and check it
-        requests[ndx]->rbin.peek(&hp, sizeof(Header));
-        if (hp.version != 1) {
-            TRACE("Driver::work(%d) - Warning: unsupported protocol version %d\n",
-                  requests[ndx]->getFd(), hp.version);
-            requests[ndx]->end(501);
-            continue;
-        }
-        msg_total = sizeof(Header) + hp.content_length.get() + hp.padding_length;
-        msg_len = hp.content_length.get();
-        requests[ndx]->id = hp.request_id.get();
-        TRACE("driver::read - header version=%d; type=%d; id=%d; padding=%d; length=%d; "
-              "rbin.size=%ld\n",
-              hp.version, hp.type, requests[ndx]->id, hp.padding_length, msg_len,
-              requests[ndx]->rbin.size());
-        if (msg_total > requests[ndx]->rbin.size()) {
-            continue; // Message data is not completely in yet. Wait for some more.
-        }
-        // Process the message.
-        try {
-            requests[ndx]->rbin.discard(sizeof(Header));
-            switch (hp.type) {
-            case TYPE_BEGIN_REQUEST:
-                requests[ndx]->processBeginRequest(served_count);
-                served_count++;
-                break;
+    // We must be in reading mode
+    if (req->state != RQS_PARAMS && req->state != RQS_STDIN)
+        return false;
+    // Handler has asked to hold the body stream.
+    if (req->isPaused())
+        return false;
+    // Handler is at its concurrency limit. Body waits until exec has been called.
+    if (req->is(FLAG_ROUTEWAIT) && !retryHandler(req))
+        return false;
+    // Bail out if we do not have the header yet, read some more.
+    hp = reader.header();
+    if (!hp)
+        return false;
+    if (hp->version != 1) {
+        TRACE("Driver::work(%d) - Warning: unsupported protocol version %d\n", req->getFd(),
+              hp->version);
+        req->end(501);
+        return false;
+    }
+    // Header is used in place; keep what is needed after it has been consumed.
+    type = hp->type;
+    padding = hp->padding_length;
+    msg_len = hp->content_length.get();
+    msg_total = sizeof(Header) + msg_len + padding;
+    req->id = hp->request_id.get();
+    TRACE("driver::read - header version=%d; type=%d; id=%d; padding=%d; length=%d; "
+          "rbin.size=%ld\n",
+          hp->version, type, req->id, padding, msg_len, req->rbin.size());
+    if (msg_total > req->rbin.size()) {
+        return false; // Message data is not completely in yet. Wait for some more.
+    }
+    req->traceEvent(TE_RECORD, type, msg_len);
+    // Process the message.
+    try {
+        req->rbin.discard(sizeof(Header));
+        switch (type) {
+        case TYPE_BEGIN_REQUEST:
+            req->processBeginRequest(served_count);
+            req->traceEvent(TE_BEGIN, served_count);
+            served_count++;
+            break;
 
-            case TYPE_ABORT_REQUEST:
-                requests[ndx]->abort();
-                break;
+        case TYPE_ABORT_REQUEST:
+            req->abort();
+            break;
 
-            case TYPE_PARAMS:
-                if (msg_len == 0) {
-                    TRACE("Driver::work(%d) - calling exec\n", requests[ndx]->getFd());
-                    arbiter->matchPage(requests[ndx]);
-                    if (requests[ndx]->handler)
-                        requests[ndx]->handler->exec(requests[ndx]);
-                    else {
-                        TRACE("Request::process_params - Arbiter was not able to find handler for "
-                              "this request.\n");
-                        requests[ndx]->end(400);
-                    }
+        case TYPE_PARAMS:
+            req->mark(SM_PARAMS);
+            if (msg_len == 0) {
+                req->mark(SM_EXEC);
+                if (!stats || !stats->match(req))
+                    arbiter->matchPage(req);
+                if (!req->handler) {
+                    TRACE("Request::process_params - Arbiter was not able to find handler for "
+                          "this request.\n");
+                    req->reject(400);
+                } else if (req->enterHandler()) {
+                    TRACE("Driver::work(%d) - calling exec\n", req->getFd());
+                    req->traceEvent(TE_EXEC);
+                    req->handler->exec(req);
+                    req->traceEvent(TE_EXEC_END);
+                } else if (req->handler->max_wait) {
+                    TRACE("Driver::work(%d) - handler is full, waiting\n", req->getFd());
+                    req->traceEvent(TE_EXEC_WAIT);
+                    req->flags.set(FLAG_ROUTEWAIT);
+                    clock_gettime(CLOCK_MONOTONIC, &req->route_since);
+                } else {
+                    req->handler->limit_rejects++;
+                    req->reject(503);
                 }
-                requests[ndx]->processParams(plimit_hash_list, msg_len);
-                break;
+            }
+            req->processParams(plimit_hash_list, msg_len);
+            break;
 
-            case TYPE_DATA:
-                TRACE("Driver::work - Req type DATA not supported by responder. Ignored. fd=%d\n",
-                      requests[ndx]->getFd());
-                requests[ndx]->rbin.discard(msg_len);
-                break;
+        case TYPE_DATA:
+            TRACE("Driver::work - Req type DATA not supported by responder. Ignored. fd=%d\n",
+                  req->getFd());
+            req->rbin.discard(msg_len);
+            break;
 
-            case TYPE_STDIN:
-                requests[ndx]->processStdin(msg_len);
-                break;
+        case TYPE_STDIN:
+            req->processStdin(msg_len);
+            break;
 
-            default:
-                TRACE("Driver::work(%d) - unknown package of type:%d\n", requests[ndx]->getFd(),
-                      hp.type);
-                requests[ndx]->rbin.discard(msg_len);
-            }
-            if (hp.padding_length) {
-                requests[ndx]->rbin.discard(hp.padding_length);
-            }
-        } catch (const std::runtime_error& re) {
-            TRACE("driver::work - runtime exception: %s\n", re.what());
-        } catch (...) {
-            TRACE("driver::work(%d) - unknown exception\n", requests[ndx]->getFd());
+        default:
+            TRACE("Driver::work(%d) - unknown package of type:%d\n", req->getFd(), type);
+            req->rbin.discard(msg_len);
         }
+        if (padding) {
+            req->rbin.discard(padding);
+        }
+    } catch (const std::runtime_error& re) {
+        TRACE("driver::work - runtime exception: %s\n", re.what());
+    } catch (...) {
+        TRACE("driver::work(%d) - unknown exception\n", req->getFd());
+    }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Driver::retryHandler(Request* req)
+/*! Calls exec for a request that has waited for its handler's turn or rejects the request when
+  it has waited too long.
+  \retval bool True if exec was called.
+ */
+{
+    if (req->enterHandler()) {
+        req->flags.clear(FLAG_ROUTEWAIT);
+        TRACE("Driver::retryHandler(%d) - calling exec\n", req->getFd());
+        req->traceEvent(TE_EXEC);
+        req->handler->exec(req);
+        req->traceEvent(TE_EXEC_END);
+        return true;
     }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long waited = (now.tv_sec - req->route_since.tv_sec) * 1000 +
+                  (now.tv_nsec - req->route_since.tv_nsec) / 1000000;
+    if (waited >= (long)req->handler->max_wait) {
+        req->handler->limit_rejects++;
+        req->reject(503);
+    }
+    return false;
 }
 // -------------------------------------------------------------------------------------------------
 void
@@ -352,33 +1054,40 @@ Driver::freeDormantRequests()
     uint32_t count = 0, closed = 0;
     uint32_t ndx;
     size_t left;
-    pollfd pfdarray[DRIVER_POLL_FD];
-    Request* eof_reqs[DRIVER_POLL_FD];
 
     // Collect all requests that could be closed
     for (ndx = 0; ndx < req_count; ndx++) {
-        if (requests[ndx]->getState() == RQS_EOF) {
+        if (slots[ndx].state == RQS_EOF) {
             left = requests[ndx]->getOutPending();
             if (left > 0) {
                 TRACE("Driver::freeDormantRequests - At eof and %ld bytes pending.\n", left);
             }
-            pfdarray[count].fd = requests[ndx]->pfd.fd;
-            pfdarray[count].events = POLLOUT;
-            pfdarray[count].revents = 0;
+            eof_pfd[count].fd = slots[ndx].pfd.fd;
+            eof_pfd[count].events = POLLOUT;
+            eof_pfd[count].revents = 0;
             eof_reqs[count] = requests[ndx];
             count++;
         }
     }
     // check if we are ready to perform output => all bytes sent. Can be closed.
-    if (!count)
+    if (!count) {
+        admitWaiting();
         return;
-    int rc = poll(pfdarray, count, 0); // timeout 0 =>  return immediately.
+    }
+    int rc = poll(eof_pfd, count, 0); // timeout 0 =>  return immediately.
     if (rc == -1) {
         TRACE("Driver::freeDormantRequests - poll failed:%s.\n", strerror(errno));
         return;
     }
     for (ndx = 0; ndx < count; ndx++) {
-        if ((pfdarray[ndx].revents & POLLOUT) > 0) {
+        if ((eof_pfd[ndx].revents & POLLOUT) > 0) {
+            if (capture)
+                capture->end(eof_reqs[ndx]->hot - slots);
+            if (stats) {
+                eof_reqs[ndx]->mark(SM_CLOSE);
+                stats->record(eof_reqs[ndx]->marks, eof_reqs[ndx]->handler);
+            }
+            eof_reqs[ndx]->traceEvent(TE_CLOSE);
             eof_reqs[ndx]->setPollFd(0);
             closed++;
         }
@@ -386,6 +1095,7 @@ Driver::freeDormantRequests()
     if (count) {
         TRACE("Driver::freeDormantRequests - at eof %d, closed %d\n", count, closed);
     }
+    admitWaiting();
 }
 
 } // namespace fcgi_driver
\ No newline at end of file
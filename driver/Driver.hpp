@@ -11,6 +11,7 @@
 #define FCGI_DRIVERDRIVER_HPP
 
 #include <map>
+#include <deque>
 #include <queue>
 #include <vector>
 #include <string>
@@ -22,11 +23,26 @@
 #include <string.h>
 
 #include "RingBuffer.hpp"
+#include "AdaptiveLimit.hpp"
+#include "Capture.hpp"
+#include "Stats.hpp"
+#include "ShmStats.hpp"
 #include "Request.hpp"
+#include "UploadStore.hpp"
+
+namespace c4s {
+class configuration;
+}
 
 namespace fcgi_driver {
 
 uint8_t const FLAG_KEEP_CONN = 1;
+// Input flow control: request stops reading when its input buffer has this much data. With the
+// largest possible record in buffer work() can always proceed. Reading continues below half full.
+size_t const DRIVER_RB_HIGHWATER = 8 + 0xFFFF + 0xFF;
+// Input bytes work() processes for one request before moving to the next ready request. Must be
+// larger than the largest record.
+size_t const DRIVER_WORK_BUDGET = 0x40000;
 
 #pragma pack(push, 1)
 struct B4Num
@@ -140,13 +156,61 @@ struct EndRequestMsg : public Header
 struct NameValue
 {
     NameValue();
-    void init();
+    void init() { parse(byte, sizeof(byte)); }
+    bool parse(const uint8_t* data, size_t len);
     uint8_t byte[8];
     uint32_t name_len;
     uint32_t value_len;
     size_t size;
 };
 
+/*! Reads FastCGI records from request input in place. Record header, length prefixes of name-value
+  pairs and names are used straight from the ring buffer when they are contiguous, which is always
+  the case in RB_MIRROR mode. In heap mode the bytes that wrap are copied first. Values and STDIN
+  payload are left to the caller (peek_span, push_to or read into their final storage).
+ */
+class RecordReader
+{
+  public:
+    explicit RecordReader(RingBuffer& in)
+      : rb(in)
+    {}
+    const Header* header();
+    bool nameValue(NameValue*);
+    const char* name(const NameValue&, char* buf);
+
+  protected:
+    RingBuffer& rb;
+    Header copy; // Header that wraps in heap mode.
+};
+
+/*! Memory and capacity limits of the driver. Defaults come from fcgisettings.h and Request.hpp.
+  Values can be read from the LibFCGI section of the configuration; names are in parenthesis.
+ */
+struct DriverLimits
+{
+    DriverLimits();
+    bool load(c4s::configuration*);
+    bool validate();
+
+    uint32_t requests;   // Max concurrent requests (MaxRequests).
+    uint32_t param_keys; // Max parameters per request (ParamKeys).
+    size_t param_size;   // Initial size of parameter value buffer (ParamSize).
+    size_t input_size;   // Input buffer per request (InputSize).
+    size_t output_size;  // Output buffer per request (OutputSize).
+    size_t mem_stdin;    // Initial size of memory spool (MemStdin).
+    size_t spool_mem;    // Max memory spool before body goes to file (SpoolMemLimit).
+    size_t field_data;   // Max multipart form field value (FieldData).
+};
+
+//! Accepted connection waiting for a free request slot.
+struct AdmitWait
+{
+    int fd;
+    struct timespec since; // CLOCK_MONOTONIC
+    int prio;              // 1 = has session, 0 = anonymous, -1 = parameters not in yet.
+};
+
 struct PageArbiter
 {
     virtual ~PageArbiter() = default;
@@ -157,6 +221,7 @@ class Driver
 {
   public:
     Driver(PageArbiter* arb_, size_t ps, uint32_t reqcount);
+    Driver(PageArbiter* arb_, const DriverLimits&);
     ~Driver();
 
     void createRequest(pollfd*);
@@ -170,11 +235,43 @@ class Driver
     void limitParameters(uint64_t* plist) { plimit_hash_list = plist; }
     bool setFileDir(const char* dest_dir);
     void setCacheDir(const char* dest_dir) { cache_path = dest_dir; }
+    bool setResumeDir(const char* dest_dir);
+    void setUploadMemLimit(size_t limit) { upstore.setMemLimit(limit); }
+    void setUploadDigests(int algos) { upstore.setDigests(algos); }
+    void setUploadDedup(bool on, time_t gc_interval = 3600);
+    size_t collectUploadBlobs(time_t min_age = 3600) { return upstore.collect(min_age); }
+    void collectIdle();
+    void setSpoolMemLimit(size_t limit) { Request::spool_limit = limit; }
+    void setAdmission(uint32_t queue_max, uint32_t wait_ms, uint16_t reject_status = 0);
+    void setPriorityCookie(const char* name) { prio_cookie = name; }
+    uint32_t getRejectedCount() { return rejected_count; }
+    void enableAdaptiveLimit(uint32_t min_limit = 4, uint32_t max_limit = 0);
+    bool getLimitStats(LimitStats*);
+    size_t getWaitingCount() { return admit_queue.size(); }
+    bool enableDiskWriter(size_t block_size = DW_BLOCK_SIZE,
+                          uint32_t block_count = DW_BLOCK_COUNT,
+                          dw_sync_t sync = DW_SYNC_NONE);
+    bool enableCapture(const char* fname,
+                       uint32_t sample = 1,
+                       size_t conn_max = CAP_CONN_MAX,
+                       size_t file_max = CAP_FILE_MAX);
+    void disableCapture();
+    void enableStats(const char* page_uri = "/fcgi-stats", bool local_only = true);
+    Stats* getStats() { return stats; }
+    bool enableShmStats(const char* prefix = SHM_STAT_PREFIX,
+                        uint64_t interval_us = SHM_STAT_INTERVAL);
+    void publishStats(const SchedCounters* sc = 0, bool force = false)
+    {
+        if (shm)
+            updateShm(sc, force);
+    }
 
     static void dumpHex(void*, size_t, std::ostream&);
     int getFreeRequestCount();
     void freeDormantRequests();
     uint32_t getServedCount() { return served_count; }
+    uint32_t getRequestCount() { return req_count; }
+    const DriverLimits& getLimits() { return limits; }
     static const char* version();
 
   protected:
@@ -184,19 +281,55 @@ class Driver
     // don't copy me
     Driver(Driver const&);
     Driver& operator=(Driver const&);
+    bool processRecord(Request*);
+    void init(const DriverLimits&);
+    bool retryHandler(Request*);
+    bool startRequest(pollfd*, const struct timespec* since = 0);
+    uint32_t countActive();
+    void requestDone(Request*);
+    void admitWaiting();
+    void rejectConnection(int fd);
+    int peekPriority(int fd);
+    void schedule(Request*);
+    void schedule(uint32_t ndx);
+    void updateShm(const SchedCounters*, bool force);
     // void process_begin_request(Request *req);
     // void process_params(Request*);
     // void process_stdin(Request*);
     // void process_unknown(Request *);
     // void process_multipart(Request *req, uint16_t len);
 
+    DriverLimits limits;
     Request** requests;
+    ReqSlot* slots;  // Hot scheduling fields of requests, same index as requests.
+    uint32_t* ready; // FIFO of slot indexes that have input or pending work.
+    uint32_t ready_head;
+    uint32_t ready_count;
     uint32_t req_count;
     uint32_t served_count; // number of requests handled.
+    pollfd* eof_pfd;       // Work arrays of freeDormantRequests.
+    Request** eof_reqs;
+    std::deque<AdmitWait> admit_queue; // Connections waiting for a free slot.
+    uint32_t admit_max;                // Max length of admit_queue. 0 = reject at once.
+    uint32_t admit_wait;               // Max time in admit_queue (ms).
+    uint16_t reject_status;            // HTTP status for rejects. 0 = END_REQUEST OVERLOADED.
+    uint32_t rejected_count;
+    std::string prio_cookie; // Cookie that moves the connection ahead in admit_queue.
+    AdaptiveLimit* limiter; // Latency driven concurrency limit. Null = all requests in use.
     PageArbiter* arbiter;
     uint64_t* plimit_hash_list;
     std::string upload_path;
+    UploadStore upstore;
+    DiskWriter* writer; // Asynchronous writer for spool and upload files. Null = synchronous.
+    Capture* capture;   // Inbound traffic recorder. Null = not capturing.
+    Stats* stats;       // Lifecycle statistics. Null = not collected.
+    ShmStats* shm;      // Counters for external tools. Null = not published.
+    uint64_t shm_wait;  // Min time between shm updates (us).
+    uint64_t shm_next;  // Earliest time of the next update.
+    time_t blob_gc_wait; // Seconds between idle time blob collections, 0 = never.
+    time_t blob_gc_next; // Earliest time of the next collection.
     std::string cache_path;
+    std::string resume_path;
     std::ofstream upload_log;
     struct timespec start_time;
 };
@@ -0,0 +1,151 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <string.h>
+
+#include "Histogram.hpp"
+
+namespace fcgi_driver {
+
+// -------------------------------------------------------------------------------------------------
+Histogram::Histogram(uint64_t max_value, uint32_t _sub_bits)
+/*! \param max_value Largest value that is recorded with full precision.
+  \param _sub_bits Precision, log2 of steps per power of two (1-16).
+ */
+{
+    sub_bits = _sub_bits < 1 ? 1 : (_sub_bits > 16 ? 16 : _sub_bits);
+    range = max_value < (2UL << sub_bits) ? (2UL << sub_bits) : max_value;
+    size = index(range) + 1;
+    counts = new uint64_t[size];
+    reset();
+}
+Histogram::Histogram(const Histogram& orig)
+  : sub_bits(orig.sub_bits)
+  , range(orig.range)
+{
+    size = orig.size;
+    counts = new uint64_t[size];
+    reset();
+    add(orig);
+}
+// -------------------------------------------------------------------------------------------------
+Histogram::~Histogram()
+{
+    delete[] counts;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Histogram::reset()
+{
+    memset(counts, 0, size * sizeof(uint64_t));
+    total = 0;
+    sum = 0;
+    min_value = UINT64_MAX;
+    max_value = 0;
+}
+// -------------------------------------------------------------------------------------------------
+uint32_t
+Histogram::index(uint64_t value) const
+{
+    if (value < (1UL << sub_bits))
+        return value;
+    uint32_t shift = 63 - __builtin_clzl(value) - sub_bits;
+    return ((shift + 1) << sub_bits) + (value >> shift) - (1UL << sub_bits);
+}
+// -------------------------------------------------------------------------------------------------
+uint64_t
+Histogram::highest(uint32_t ndx) const
+//! Largest value that maps into the bucket.
+{
+    int shift = (ndx >> sub_bits) - 1;
+    if (shift <= 0)
+        return ndx;
+    uint64_t low = ((ndx & ((1UL << sub_bits) - 1)) + (1UL << sub_bits)) << shift;
+    return low + (1UL << shift) - 1;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Histogram::record(uint64_t value, uint64_t count)
+{
+    counts[value > range ? size - 1 : index(value)] += count;
+    total += count;
+    sum += value * count;
+    if (value < min_value)
+        min_value = value;
+    if (value > max_value)
+        max_value = value;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Histogram::recordCorrected(uint64_t value, uint64_t interval)
+/*! Records value and fills in the samples a stalled closed-loop client failed to send: when value
+  exceeds the expected interval between requests, values decreasing by interval are added as well.
+  Not needed when latency is measured from the intended send time.
+ */
+{
+    record(value);
+    if (!interval)
+        return;
+    for (uint64_t missed = value > interval ? value - interval : 0; missed >= interval;
+         missed -= interval)
+        record(missed);
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Histogram::add(const Histogram& other)
+//! Adds counts from histogram with the same range and precision.
+{
+    if (other.size != size || other.sub_bits != sub_bits)
+        return false;
+    for (uint32_t ndx = 0; ndx < size; ndx++)
+        counts[ndx] += other.counts[ndx];
+    total += other.total;
+    sum += other.sum;
+    if (other.total && other.min_value < min_value)
+        min_value = other.min_value;
+    if (other.max_value > max_value)
+        max_value = other.max_value;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+uint64_t
+Histogram::percentile(double pct) const
+/*! \param pct Percentile 0-100.
+  \retval uint64_t Highest value equivalent to the percentile, i.e. the value is within precision.
+ */
+{
+    if (!total)
+        return 0;
+    if (pct >= 100)
+        return max_value;
+    uint64_t target = (uint64_t)(pct / 100 * total + 0.5);
+    if (target < 1)
+        target = 1;
+    uint64_t seen = 0;
+    for (uint32_t ndx = 0; ndx < size; ndx++) {
+        seen += counts[ndx];
+        if (seen >= target) {
+            uint64_t val = highest(ndx);
+            return val > max_value ? max_value : val;
+        }
+    }
+    return max_value;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Histogram::print(FILE* out, const char* unit, double scale) const
+/*! Prints count, mean and the usual percentiles.
+  \param scale Divisor for printed values, e.g. 1000 to print microseconds as milliseconds.
+ */
+{
+    static const double pcts[] = { 50, 75, 90, 99, 99.9, 99.99, 100 };
+    fprintf(out, "  count %lu, min %.1f, mean %.1f, max %.1f %s\n", total, getMin() / scale,
+            getMean() / scale, max_value / scale, unit);
+    for (double pct : pcts)
+        fprintf(out, "  %7.3f%% %12.1f %s\n", pct, percentile(pct) / scale, unit);
+}
+
+} // namespace fcgi_driver
@@ -0,0 +1,60 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_HISTOGRAM_HPP
+#define FCGI_HISTOGRAM_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace fcgi_driver {
+
+const uint64_t HIST_MAX = 3600000000UL; // Default range: one hour in microseconds.
+const uint32_t HIST_SUB_BITS = 7;       // 128 linear steps per power of two, < 1% error.
+
+/*! Log-linear latency histogram in the style of HdrHistogram. Values below 2^sub_bits are kept
+  exactly; above that each power of two is split into 2^sub_bits equal steps so that the relative
+  error stays below 2^-sub_bits. Recording is a few shifts and an increment. Values beyond the
+  max are counted in the last bucket but max value is kept exact.
+ */
+class Histogram
+{
+  public:
+    explicit Histogram(uint64_t max_value = HIST_MAX, uint32_t sub_bits = HIST_SUB_BITS);
+    Histogram(const Histogram&);
+    ~Histogram();
+
+    void record(uint64_t value, uint64_t count = 1);
+    void recordCorrected(uint64_t value, uint64_t interval);
+    bool add(const Histogram&);
+    void reset();
+
+    uint64_t percentile(double pct) const;
+    uint64_t getCount() const { return total; }
+    uint64_t getMin() const { return total ? min_value : 0; }
+    uint64_t getMax() const { return max_value; }
+    double getMean() const { return total ? (double)sum / total : 0; }
+    void print(FILE*, const char* unit = "us", double scale = 1) const;
+
+  protected:
+    uint32_t index(uint64_t value) const;
+    uint64_t highest(uint32_t ndx) const;
+
+    uint64_t* counts;
+    uint32_t size;
+    uint32_t sub_bits;
+    uint64_t range;
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min_value, max_value;
+
+  private:
+    Histogram& operator=(const Histogram&);
+};
+
+} // namespace fcgi_driver
+
+#endif
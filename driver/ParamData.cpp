@@ -23,8 +23,11 @@ using namespace c4s;
 namespace fcgi_driver {
 
 // -------------------------------------------------------------------------------------------------
-ParamData::ParamData(size_t initial_size)
+ParamData::ParamData(size_t initial_size, size_t max_keys)
 {
+    key_max = max_keys;
+    key_array = new uint64_t[key_max];
+    value_ptr = new const char*[key_max];
     value_buffer = new char[initial_size];
     size_max = initial_size;
     memset(value_buffer, 0, size_max);
@@ -37,6 +40,8 @@ ParamData::ParamData(size_t initial_size)
 ParamData::~ParamData()
 {
     delete[] value_buffer;
+    delete[] key_array;
+    delete[] value_ptr;
 }
 // -------------------------------------------------------------------------------------------------
 void
@@ -44,8 +49,9 @@ ParamData::clear()
 {
     key_count = 0;
     value_end = value_buffer;
-    memset(key_array, 0, sizeof(key_array));
-    memset(value_ptr, 0, sizeof(value_ptr));
+    value_start = 0;
+    memset(key_array, 0, key_max * sizeof(uint64_t));
+    memset(value_ptr, 0, key_max * sizeof(const char*));
     callback_state = IDLE;
 }
 // -------------------------------------------------------------------------------------------------
@@ -55,13 +61,23 @@ ParamData::resize(size_t add_size)
     size_t current = value_end - value_buffer;
     if (current + add_size < size_max)
         return;
-    size_max = current + add_size + 1;
-    size_max += size_max % 32;
+    // Grow geometrically. The buffer is kept over clear so a steady load stops allocating.
+    size_t need = current + add_size + 1;
+    size_max = size_max * 2 > need ? size_max * 2 : need;
+    size_max += 31;
+    size_max &= ~(size_t)31;
     // if(size_max > FCGIMOD_MAX_PARAMDATA)
     //    throw std::runtime_error("ParamData::set - Max data size exceeded.");
     char* newbuffer = new char[size_max];
     memcpy(newbuffer, value_buffer, current);
     memset(newbuffer + current, 0, size_max - current);
+    // Values already stored point into the old buffer.
+    for (size_t ndx = 0; ndx < key_count; ndx++) {
+        if (value_ptr[ndx])
+            value_ptr[ndx] = newbuffer + (value_ptr[ndx] - value_buffer);
+    }
+    if (value_start)
+        value_start = newbuffer + (value_start - value_buffer);
     delete[] value_buffer;
     value_buffer = newbuffer;
     value_end = value_buffer + current;
@@ -131,7 +147,7 @@ ParamData::end_push()
         callback_state = IDLE;
         throw runtime_error("ParamData::end_push - Syntax error.");
     }
-    if (key_count >= DRIVER_PARAMKEYS) {
+    if (key_count >= key_max) {
         CS_PRINT_ERRO("ParamData::end_push - Max key count reached.");
         throw runtime_error("ParamData::end_push - No more room.");
     }
@@ -151,7 +167,7 @@ ParamData::end_push()
 uint64_t
 ParamData::add(const char* key, size_t keysize, const char* value)
 {
-    if (!key || !keysize || key_count >= DRIVER_PARAMKEYS)
+    if (!key || !keysize || key_count >= key_max)
         return false;
     uint64_t k64 = fnv_64bit_hash(key, keysize);
     return add(k64, value);
@@ -160,7 +176,7 @@ ParamData::add(const char* key, size_t keysize, const char* value)
 char*
 ParamData::add(uint64_t hash, size_t valsize)
 {
-    if (!valsize || key_count >= DRIVER_PARAMKEYS)
+    if (!valsize || key_count >= key_max)
         return 0;
     // Reserve space for value
     resize(valsize);
@@ -170,7 +186,7 @@ ParamData::add(uint64_t hash, size_t valsize)
     // Store the key
     key_array[key_count] = hash;
     key_count++;
-    if (key_count >= DRIVER_PARAMKEYS)
+    if (key_count >= key_max)
         CS_PRINT_WARN("WARNING: ParamData::add - Max key count reached.");
     return rv;
 }
@@ -178,7 +194,7 @@ ParamData::add(uint64_t hash, size_t valsize)
 uint64_t
 ParamData::add(uint64_t key, const char* value)
 {
-    if (!key || !value || key_count >= DRIVER_PARAMKEYS)
+    if (!key || !value || key_count >= key_max)
         return 0;
     size_t add_size = strlen(value);
     resize(add_size);
@@ -189,7 +205,7 @@ ParamData::add(uint64_t key, const char* value)
     // Store the new key
     key_array[key_count] = key;
     key_count++;
-    if (key_count >= DRIVER_PARAMKEYS)
+    if (key_count >= key_max)
         CS_PRINT_WARN("WARNING: ParamData::add - Max key count reached.");
     return key;
 }
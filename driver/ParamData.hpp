@@ -19,7 +19,7 @@ namespace fcgi_driver {
 class ParamData : public RBCallBack
 {
   public:
-    ParamData(size_t initial_size);
+    ParamData(size_t initial_size, size_t max_keys = DRIVER_PARAMKEYS);
     ~ParamData();
     // Adding parameters into the list.
     uint64_t add(const char* key, size_t keysize, const char* value);
@@ -66,8 +66,9 @@ class ParamData : public RBCallBack
     char* value_buffer; //!< Always points to beginning of value buffer.
     char* value_end;    //!< Points to a place where new value can be added to
     size_t size_max;    //!< Size of the current value buffer.
-    uint64_t key_array[DRIVER_PARAMKEYS];
-    const char* value_ptr[DRIVER_PARAMKEYS];
+    uint64_t* key_array;
+    const char** value_ptr;
+    size_t key_max;
     size_t key_count;
     char dummy;
 
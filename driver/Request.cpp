@@ -10,9 +10,15 @@
 #include <iostream>
 #include <fstream>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <cpp4scripts.hpp>
 
@@ -25,6 +31,7 @@ const uint64_t t64_POST = 0x54534f50;
 const uint64_t t64_PUT = 0x545550;
 const uint64_t t64_PATCH = 0x4843544150;
 const uint64_t t64_DELETE = 0x4554454c4544;
+const uint64_t t64_HEAD = 0x44414548;
 
 extern FILE* trace;
 
@@ -35,7 +42,15 @@ namespace fcgi_driver {
 
 size_t Request::input_size = 0;
 size_t Request::param_size = 0;
+size_t Request::spool_limit = REQ_SPOOL_MEM_DEFAULT;
+size_t Request::output_size = REQ_MAX_OUT;
+size_t Request::memstdin_size = REQ_MAX_MEMSTDIN;
+size_t Request::field_size = REQ_MAX_FLDDATA;
+uint32_t Request::param_keys = DRIVER_PARAMKEYS;
+RB_MODE Request::input_mode = RB_HEAP;
 Driver* Request::driver = 0;
+Stats* Request::stats = 0;
+static UploadStore local_store; // Used when request runs without driver (unit tests).
 
 // -------------------------------------------------------------------------------------------------
 void
@@ -48,6 +63,29 @@ void Handler::event(HandlerEvent)
 {
     // We quietly ignore unimplemented event handlers.
 }
+// -------------------------------------------------------------------------------------------------
+void
+Handler::limitConcurrency(uint32_t max, uint32_t wait_ms)
+/*! Limits the number of requests this handler serves at once. Requests over the limit wait for
+  at most wait_ms for their turn and are then answered with 503 without calling exec.
+  \param max Max concurrent requests. 0 = no limit.
+  \param wait_ms Max wait time. 0 = reject at once.
+ */
+{
+    max_active = max;
+    max_wait = wait_ms;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Handler::onBodyChunk(Request*, const char*, size_t)
+/*! Receives the request body as it arrives when handler has called Request::streamBody in exec.
+  Chunks follow the order of the body. Return false to pause delivery after current record, i.e.
+  driver stops reading the connection until Request::resumeBody is called. done() is called after
+  the last chunk.
+ */
+{
+    return true;
+}
 
 // -------------------------------------------------------------------------------------------------
 void
@@ -56,28 +94,47 @@ Request::log(const char* str)
     TRACE(str);
 }
 // -------------------------------------------------------------------------------------------------
-Request::Request()
-  : rbin(Request::input_size)
-  , params(Request::param_size)
+Request::Request(ReqSlot* slot)
+/*! \param slot Scheduling fields from driver's slot array. Null = use request's own slot.
+ */
+  : rbin(Request::input_size, Request::input_mode)
+  , params(Request::param_size, Request::param_keys)
+  , hot(slot ? slot : &own_slot)
+  , flags(hot->flags)
+  , state(hot->state)
+  , pfd(hot->pfd)
 {
     role = RESPONDER;
     fd_spool = -1;
-    mp_count = 0;
+    fd_resume = -1;
+    rbout = new char[output_size];
+    stdin_buffer = new char[memstdin_size + 4];
+    stdin_cap = memstdin_size;
+    fld_buffer = 0;
     memset(uploads, 0, sizeof(uploads));
     upload_ndx = 0;
     clear();
 }
 Request::Request(const Request& orig)
-  : rbin(Request::input_size)
-  , params(Request::param_size)
+  : rbin(Request::input_size, Request::input_mode)
+  , params(Request::param_size, Request::param_keys)
+  , hot(&own_slot)
+  , flags(hot->flags)
+  , state(hot->state)
+  , pfd(hot->pfd)
 {
     int ndx;
     role = orig.role;
     fd_spool = -1;
-    clear();
+    fd_resume = -1;
+    rbout = new char[output_size];
+    stdin_buffer = new char[memstdin_size + 4];
+    stdin_cap = memstdin_size;
+    fld_buffer = 0;
     memset(uploads, 0, sizeof(uploads));
+    clear();
     for (ndx = 0; ndx < orig.upload_ndx; ndx++) {
-        uploads[ndx] = new UploadFile(*orig.uploads[ndx]);
+        uploads[ndx] = arena.make<UploadFile>(*orig.uploads[ndx]);
     }
     upload_ndx = ndx;
 }
@@ -87,6 +144,9 @@ Request::~Request()
 {
     // This will close the files if necessary
     clear();
+    delete[] stdin_buffer;
+    delete[] fld_buffer;
+    delete[] rbout;
 }
 // -------------------------------------------------------------------------------------------------
 void
@@ -97,6 +157,7 @@ Request::clear()
         TRACE("Request::clear - (%d) app_data is still defined. Forgot to cleanup?\n", id);
     }
 #endif
+    leaveHandler();
     memset(&pfd, 0, sizeof(pollfd));
     id = 0;
     handler = 0;
@@ -106,6 +167,7 @@ Request::clear()
     bound_len = 0;
     stdin_len = 0;
     spool_size = 0;
+    content_length = 0;
     app_status = 0;
     rbpos = rbout;
     rbsend = rbout;
@@ -113,18 +175,36 @@ Request::clear()
     flags.clear();
     memset(boundary, 0, sizeof(boundary));
     memset(uri, 0, sizeof(uri));
+    if (driver && driver->writer)
+        driver->writer->cancel(&dw_ticket);
+    dw_ticket.error = 0;
     if (fd_spool >= 0) {
         close(fd_spool);
         fd_spool = -1;
     }
+    if (fd_resume >= 0) {
+        close(fd_resume);
+        fd_resume = -1;
+    }
+    resume_size = 0;
+    upload_offset = -1;
+    upload_length = -1;
+    resume_status = 0;
+    memset(resume_id, 0, sizeof(resume_id));
+    begin_time.tv_sec = 0;
+    memset(marks, 0, sizeof(marks));
     rbin.clear();
+    hot->in_bytes = 0;
     params.clear();
     for (int ndx = 0; ndx < REQ_MAX_UPLOADS; ndx++) {
-        if (uploads[ndx])
-            delete uploads[ndx];
+        if (uploads[ndx]) {
+            getStore()->release(uploads[ndx]);
+            arena.destroy(uploads[ndx]);
+        }
         uploads[ndx] = 0;
     }
     upload_ndx = 0;
+    arena.reset();
 }
 // -------------------------------------------------------------------------------------------------
 void
@@ -150,7 +230,7 @@ Request::write(const char* data, uint16_t length)
     }
     if (length == 0)
         length = strlen(data);
-    uint16_t max = REQ_MAX_OUT - (rbpos - rbout);
+    uint16_t max = output_size - (rbpos - rbout);
     if (max < length) {
         TRACE("Request::write (%d) - Not enough room for %d bytes, %d max. Flushing!\n", id, length,
               max);
@@ -174,14 +254,14 @@ Request::writeFd(int fd)
     }
 #ifdef UNIT_TEST
     ssize_t original_max;
-    original_max = REQ_MAX_OUT - (rbpos - rbout);
+    original_max = output_size - (rbpos - rbout);
 #endif
     total = 0;
     do {
-        max = REQ_MAX_OUT - (rbpos - rbout);
+        max = output_size - (rbpos - rbout);
         if (max == 0) {
             flush();
-            max = REQ_MAX_OUT;
+            max = output_size;
         }
         br = ::read(fd, rbpos, max);
         if (br == -1) {
@@ -223,6 +303,11 @@ Request::flush()
         send();
         rounds++;
     }
+    if (rounds > 1) {
+        if (stats)
+            stats->counters.flush_stalls++;
+        traceEvent(TE_FLUSH, rounds);
+    }
     // rewind buffer
     clearRbOut();
     stdout_count = 0;
@@ -248,12 +333,15 @@ Request::send()
             rbpos += sizeof(erm);
             send_size = rbpos - rbout;
             state = RQS_END;
+            leaveHandler();
             pfd.events |= POLLOUT;
             TRACE("Request::send (%d) - END size=%ld\n", id, send_size);
         } else if (state == RQS_END) {
             TRACE("Request::send (%d) - All done, setting EOF 1.\n", id);
             pfd.events &= ~POLLOUT;
             state = RQS_EOF;
+            if (driver)
+                driver->requestDone(this);
             return;
         } else if (state == RQS_FLUSH) {
             pfd.events &= ~POLLOUT;
@@ -270,7 +358,7 @@ Request::send()
             char stat_line[64];
             size_t stat_len = sprintf(stat_line, "Status: %d\r\n", app_status);
             size_t now = rbpos - rbout;
-            if (now + stat_len < REQ_MAX_OUT) {
+            if (now + stat_len < output_size) {
                 memmove(rbout + stat_len, rbout, now);
                 memcpy(rbout, stat_line, stat_len);
                 send_size += stat_len;
@@ -293,6 +381,8 @@ Request::send()
             return; // try again
         }
         TRACE("Request::send (%d) - header=%ld data=%ld\n", id, sizeof(header), send_size);
+        if (stats)
+            stats->counters.bytes_out += bw;
     }
     bw = ::write(pfd.fd, rbsend, send_size);
     if (bw < 0) {
@@ -301,6 +391,8 @@ Request::send()
             TRACE("Request::send (%d) - write error 2. errno=%d\n", id, errno);
             if (state == RQS_END) {
                 state = RQS_EOF;
+                if (driver)
+                    driver->requestDone(this);
                 return;
             }
             clearRbOut();
@@ -317,6 +409,11 @@ Request::send()
     }
     stdout_count++;
     rbsend += bw;
+    traceEvent(TE_SEND, bw);
+    if (stats) {
+        stats->counters.bytes_out += bw;
+        mark(SM_STDOUT);
+    }
 }
 // -------------------------------------------------------------------------------------------------
 void
@@ -327,6 +424,9 @@ Request::end(uint32_t _app_status)
         return;
     }
     app_status = _app_status;
+    traceEvent(TE_END, app_status);
+    if (stats && app_status >= 500 && app_status < 600)
+        stats->counters.status_5xx++;
     if (stdout_count == 0 && rbout == rbpos) { // nothing to send
         TRACE("Request::end (%d) - status %d. Nothing to send!\n", id, app_status);
     } else {
@@ -336,6 +436,46 @@ Request::end(uint32_t _app_status)
 }
 // -------------------------------------------------------------------------------------------------
 void
+Request::reject(uint32_t _app_status)
+/*! Answers the request with given status without handler. Rest of the input is ignored.
+ */
+{
+    TRACE("Request::reject (%d) - status %d\n", id, _app_status);
+    leaveHandler();
+    handler = 0;
+    flags.clear(FLAG_ROUTEWAIT);
+    pfd.events &= ~POLLIN;
+    state = RQS_OPEN;
+    write("Content-Type: text/plain\r\n\r\n");
+    end(_app_status);
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Request::enterHandler()
+/*! Counts this request into handler's occupancy if the handler is below its concurrency limit.
+  \retval bool False if the handler is full.
+ */
+{
+    if (flags.is(FLAG_OCCUPY))
+        return true;
+    if (handler->max_active && handler->active >= handler->max_active)
+        return false;
+    handler->active++;
+    flags.set(FLAG_OCCUPY);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Request::leaveHandler()
+{
+    if (!flags.is(FLAG_OCCUPY))
+        return;
+    flags.clear(FLAG_OCCUPY);
+    if (handler && handler->active)
+        handler->active--;
+}
+// -------------------------------------------------------------------------------------------------
+void
 Request::processTestSpool()
 {
     processSpool();
@@ -344,25 +484,11 @@ Request::processTestSpool()
 bool
 Request::openMPSpool(const char* data, int len)
 {
-    char spool_name[30], spool_path[255];
-    // Open spool file
-    spool_path[0] = 0;
-    if (driver->cache_path.size())
-        strcpy(spool_path, driver->cache_path.c_str());
-    sprintf(spool_name, "req-spool_%d", id);
-    strcat(spool_path, spool_name);
-    fd_spool = open(spool_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fd_spool == -1) {
-        CS_VAPRT_ERRO(
-            "Request::openMPSpool - unable to open spool file for multipart imput. Errno %d.",
-            errno);
-        end(500);
-        return false;
-    }
     // Note! preceeding \r\n combination is counted into boundary even though it is not specified
-    // boundary line.  We add these bytes here manually.. and write the initial boundary to disk.
-    ::write(fd_spool, "\r\n", 2);
+    // boundary line.  We add these bytes here manually.. and write the initial boundary to spool.
     flags.set(FLAG_MULTIP | FLAG_SPOOLING);
+    spool_size = 0;
+    writeSpool(2, "\r\n");
     boundary[0] = '\r';
     boundary[1] = '\n';
     boundary[2] = '-';
@@ -370,59 +496,124 @@ Request::openMPSpool(const char* data, int len)
     strncpy(boundary + 4, data, len);
     bound_len = len + 4;
     boundary[bound_len] = 0;
-    spool_size = 0;
     TRACE("Request::openMPSpool - multipart boundary=%s\n", boundary + 2);
     return true;
 }
 // -------------------------------------------------------------------------------------------------
+int
+Request::openSpoolFile()
+/*! Opens anonymous spool file. O_TMPFILE is used in cache directory if one has been given,
+  otherwise the spool is memory file. Neither leaves anything behind when closed.
+ */
+{
+    int fd = -1;
+#ifdef O_TMPFILE
+    if (driver && driver->cache_path.size()) {
+        fd = open(driver->cache_path.c_str(), O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+        if (fd >= 0)
+            return fd;
+        TRACE("Request::openSpoolFile - O_TMPFILE failed in cache dir (%d)\n", errno);
+    }
+#endif
+    fd = memfd_create("fcgi-spool", MFD_CLOEXEC);
+    return fd;
+}
+// -------------------------------------------------------------------------------------------------
 void
 Request::writeSpool(uint16_t msg_len, const char* msg)
 {
     // If msg is null, rbin is used !
 
-    if (fd_spool > 0) {
+    if (fd_spool >= 0) {
         TRACE("Request::writeSpool (%d) - disc spool %d bytes\n", id, msg_len);
-        if (msg)
-            ::write(fd_spool, msg, msg_len);
-        else
-            rbin.read_into(fd_spool, msg_len);
-        spool_size += msg_len;
+        fileOut(fd_spool, spool_size, msg, msg_len);
         return;
     }
-    if (spool_size + msg_len < REQ_MAX_MEMSTDIN) {
+    if (spool_size + msg_len <= spool_limit) {
         TRACE("Request::writeSpool (%d) - memory spool %d bytes\n", id, msg_len);
+        if (spool_size + msg_len > stdin_cap) {
+            // Grow geometrically up to the limit.
+            size_t cap = stdin_cap * 2;
+            while (cap < spool_size + msg_len)
+                cap *= 2;
+            if (cap > spool_limit)
+                cap = spool_limit;
+            // Multipart parser peeks few bytes beyond the data. Hence the extra room.
+            char* nb = new char[cap + 4];
+            memcpy(nb, stdin_buffer, spool_size);
+            delete[] stdin_buffer;
+            stdin_buffer = nb;
+            stdin_cap = cap;
+        }
         if (msg)
-            strncpy(stdin_buffer + spool_size, msg, msg_len);
+            memcpy(stdin_buffer + spool_size, msg, msg_len);
         else
             rbin.read(stdin_buffer + spool_size, msg_len);
         spool_size += msg_len;
         return;
     }
-    // We have run out of memory buffer room. Open disk spool
-    char spool_name[30], spool_path[255];
-    spool_path[0] = 0;
-    if (driver->cache_path.size())
-        strcpy(spool_path, driver->cache_path.c_str());
-    sprintf(spool_name, "req-spool_%d_%d", id, mp_count);
-    strcat(spool_path, spool_name);
-    fd_spool = open(spool_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    // We have run out of memory buffer room. Open file spool
+    if (stats)
+        stats->counters.spool_disk++;
+    traceEvent(TE_SPOOL, msg_len);
+    fd_spool = openSpoolFile();
     if (fd_spool == -1) {
         CS_VAPRT_ERRO("Request::writeSpool - unable to open spool file for stdin imput. Errno %d.",
                       errno);
+        rbin.discard(msg_len);
         end(500);
         return;
     }
-    mp_count++;
-    ::write(fd_spool, stdin_buffer, spool_size);
-    if (msg)
-        ::write(fd_spool, msg, msg_len);
-    else
-        rbin.read_into(fd_spool, msg_len);
-    spool_size += msg_len;
-    TRACE("Request::writeSpool (%d) - moved memory spool to disk with %ld bytes total.\n", id,
+    size_t held = spool_size;
+    spool_size = 0;
+    fileOut(fd_spool, spool_size, stdin_buffer, held);
+    fileOut(fd_spool, spool_size, msg, msg_len);
+    TRACE("Request::writeSpool (%d) - moved memory spool to file with %ld bytes total.\n", id,
           spool_size);
 }
 // -------------------------------------------------------------------------------------------------
+void
+Request::fileOut(int fd, size_t& offset, const char* msg, size_t len)
+/*! Writes data into spool or resume file at offset and advances it. If msg is null, data is taken
+  from rbin. With the disk writer the data is queued and the input is not complete until dw_ticket
+  has no pending writes.
+ */
+{
+    DiskWriter* writer = driver ? driver->writer : 0;
+    const char* data;
+    size_t span;
+
+    while (len) {
+        if (msg)
+            data = msg, span = len;
+        else if (!(span = rbin.peek_span(&data, len)))
+            break;
+        if (writer) {
+            writer->write(&dw_ticket, fd, offset, data, span);
+        } else {
+            size_t left = span;
+            while (left) {
+                ssize_t bw = pwrite(fd, data + span - left, left, offset + span - left);
+                if (bw == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    TRACE("Request::fileOut (%d) - write error %d\n", id, errno);
+                    if (!dw_ticket.error)
+                        dw_ticket.error = errno;
+                    break;
+                }
+                left -= bw;
+            }
+        }
+        offset += span;
+        if (msg)
+            msg += span;
+        else
+            rbin.discard(span);
+        len -= span;
+    }
+}
+// -------------------------------------------------------------------------------------------------
 bool
 Request::processSpool()
 {
@@ -504,6 +695,7 @@ Request::processSpool()
         return false;
     }
     close(fd_spool);
+    fd_spool = -1;
     return true;
 }
 // -------------------------------------------------------------------------------------------------
@@ -617,8 +809,12 @@ Request::parseMultipart(char* data, size_t dlen, ParseData* pd)
             pd->mp_state = MP_BEGIN;
             break;
         }
-        // Open temporary transfer file for file data
+        // Open temporary transfer file for file data. Rest of the body is the upper limit for size.
         createXferFile(pd);
+        if (pd->upfile) {
+            size_t offset = pd->spool_offset + (ptr - data);
+            getStore()->open(pd->upfile, content_length > offset ? content_length - offset : 0);
+        }
         pd->mp_state = MP_FILEDATA;
         TRACE("  File data offset: %ld\n", pd->spool_offset + (ptr - data));
         break;
@@ -628,32 +824,37 @@ Request::parseMultipart(char* data, size_t dlen, ParseData* pd)
             break;
         fldbeg = (char*)memmem(ptr, dlen, boundary, bound_len);
         if (!fldbeg) {
-            bw = ::write(pd->fd_upload, ptr, dlen - bound_len + 1);
-            pd->upfile->bytes += bw;
+            bw = dlen - bound_len + 1;
+            if (pd->upfile)
+                getStore()->write(pd->upfile, ptr, bw);
             ptr += bw;
             break;
         }
         // Write the data
-        bw = ::write(pd->fd_upload, ptr, fldbeg - ptr);
-        ::close(pd->fd_upload);
-        pd->fd_upload = -1;
-        pd->upfile->bytes += bw;
-        TRACE("\n  final:%ld; total:%ld\n", bw, pd->upfile->bytes);
-        ptr += bw;
+        bw = fldbeg - ptr;
         pd->mp_state = MP_BEGIN;
+        if (!pd->upfile) {
+            ptr += bw;
+            break;
+        }
+        getStore()->write(pd->upfile, ptr, bw);
+        getStore()->finish(pd->upfile);
+        ptr += bw;
+        TRACE("\n  final:%ld; total:%ld\n", bw, pd->upfile->bytes);
         // If we happened to write empty file:
         if (pd->upfile->bytes == 0) {
-            unlink(pd->upfile->internal);
+            getStore()->release(pd->upfile);
             // TODO: remove parameter pd->fldname
             TRACE("  No content in uploaded file. Stump removed.\n");
         }
+        pd->upfile = 0;
         break;
 
     case MP_FLDDATA:
         TRACE("MP_FLDDATA: %ld\n", pd->spool_offset);
         if (dlen < bound_len)
             break;
-        max = sizeof(pd->flddata) - (pd->fldptr - pd->flddata);
+        max = pd->fld_max - (pd->fldptr - pd->flddata);
         if (!max) {
             ptr = end;
             TRACE("  Parameter data field full!\n");
@@ -710,13 +911,36 @@ Request::processMultipart()
     char* mp_ptr;
     ssize_t brmax;
     size_t br, used, read_max, carry_size = 0;
-    ParseData pd;
+    ParseData pd(fieldBuffer(), field_size);
 
 #ifdef UNIT_TEST
     TRACE("Request::processMultipart - parsing multipart %ld bytes\n", spool_size);
 #else
     CS_VAPRT_TRCE("Request::processMultipart - parsing multipart %ld bytes", spool_size);
 #endif
+    if (fd_spool == -1) {
+        // Memory spool is parsed in place.
+        memset(stdin_buffer + spool_size, 0, 4);
+        mp_ptr = stdin_buffer;
+        br = spool_size;
+        try {
+            while (br) {
+                used = parseMultipart(mp_ptr, br, &pd);
+                if (pd.mp_state == MP_FINISH || !used)
+                    break;
+                pd.spool_offset += used;
+                br -= used;
+                mp_ptr += used;
+            }
+        } catch (const runtime_error& re) {
+#ifdef UNIT_TEST
+            TRACE("Request::processMultipart - Syntax error: %s \n", re.what());
+#else
+            CS_PRINT_WARN("WARNING: Driver::process_multipart - Multipart syntax error.");
+#endif
+        }
+        goto processMultipart_DONE;
+    }
     // Rewind our spool file to the beginning
     if (lseek(fd_spool, 0, SEEK_SET) == -1) {
 #ifdef UNIT_TEST
@@ -774,30 +998,40 @@ Request::processMultipart()
 
 processMultipart_DONE:
     TRACE(" << parsing multipart done with %ld params.\n", params.size());
-    if (pd.fd_upload > 0) {
-        ::close(pd.fd_upload);
-        pd.fd_upload = -1;
+    if (pd.upfile) {
+        // Truncated body. Upload is not complete. Disk writer may still hold blocks of this and the
+        // earlier uploads so the file is closed in clear(), after the writer has been cancelled.
+        pd.upfile->error = true;
+        pd.upfile = 0;
+    }
+    if (fd_spool >= 0) {
+        ::close(fd_spool);
+        fd_spool = -1;
     }
-    ::close(fd_spool);
-    fd_spool = -1;
 }
 // -------------------------------------------------------------------------------------------------
 void
 Request::processBodyData()
 {
-    ParseData pd;
+    ParseData pd(fieldBuffer(), field_size);
 
     // Create temporary transfer file for body data
     strcpy(pd.fldname, "[body]");
-    strcpy(pd.extfilename, params.get(HASH_CONTENT_TYPE));
-    createXferFile(&pd);
+    strncpy(pd.extfilename, params.get(HASH_CONTENT_TYPE), REQ_MAX_FILENAME - 1);
+    pd.extfilename[REQ_MAX_FILENAME - 1] = 0;
+    if (!createXferFile(&pd)) {
+        end(500);
+        return;
+    }
+    UploadStore* store = getStore();
+    store->open(pd.upfile, spool_size);
 
     // Store the data
     if (fd_spool == -1) {
         // Store memory spool
-        ::write(pd.fd_upload, stdin_buffer, spool_size);
+        store->write(pd.upfile, stdin_buffer, spool_size);
+        store->finish(pd.upfile);
         spool_size = 0;
-        close(pd.fd_upload);
         return;
     }
     // Copy the spool file data into xfer file
@@ -821,45 +1055,38 @@ Request::processBodyData()
             TRACE("Request::processSpool - error %d reading stdin spool \n", errno);
             break;
         }
-        ::write(pd.fd_upload, buffer, br);
+        store->write(pd.upfile, buffer, br);
         spool_size -= br;
     }
     spool_size = 0;
-    close(pd.fd_upload);
+    store->finish(pd.upfile);
     close(fd_spool);
     fd_spool = -1;
 }
 // -------------------------------------------------------------------------------------------------
 bool
 Request::createXferFile(ParseData* pd)
+/*! Creates upload entry for the file data. Data is written with UploadStore that keeps small
+  files in memory and larger ones in anonymous file until the application claims them.
+ */
 {
     time_t now;
-    struct tm* nowtm;
+    struct tm nowtm;
     char datestamp[20];
     static size_t filendx = 1;
 
-    // Create temp file name
+    pd->upfile = 0;
+    // Create temp file name. Plain localtime would re-read the time zone on each call.
     now = time(0);
-    nowtm = localtime(&now);
-    strftime(datestamp, sizeof(datestamp), "%Y-%m-%d_%H%M", nowtm);
+    localtime_r(&now, &nowtm);
+    strftime(datestamp, sizeof(datestamp), "%Y-%m-%d_%H%M", &nowtm);
     // Record upload to internal log.
     if (driver && driver->upload_log.good()) {
         driver->upload_log << datestamp << '_' << filendx << '|';
         driver->upload_log << pd->fldname << '|';
         driver->upload_log << pd->extfilename << '\n';
     }
-    if (upload_ndx < REQ_MAX_UPLOADS) {
-        pd->upfile = new UploadFile();
-        uploads[upload_ndx] = pd->upfile;
-        strcpy(uploads[upload_ndx]->fldname, pd->fldname);
-        if (driver) {
-            sprintf(uploads[upload_ndx]->internal, "%supload%s_%ld", driver->upload_path.c_str(),
-                    datestamp, filendx++);
-        } else {
-            sprintf(uploads[upload_ndx]->internal, "upload%s_%ld", datestamp, filendx++);
-        }
-        strcpy(uploads[upload_ndx]->external, pd->extfilename);
-    } else {
+    if (upload_ndx >= REQ_MAX_UPLOADS) {
 #ifdef UNIT_TEST
         TRACE("Request::createXferFile - no space left for upload files.\n");
 #else
@@ -869,29 +1096,72 @@ Request::createXferFile(ParseData* pd)
             driver->upload_log << datestamp << " - uploads buffer full.\n";
         return false;
     }
-
-    pd->fd_upload = open(uploads[upload_ndx]->internal, O_WRONLY | O_CREAT | O_TRUNC,
-                         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    pd->upfile = arena.make<UploadFile>();
+    uploads[upload_ndx] = pd->upfile;
+    strcpy(pd->upfile->fldname, pd->fldname);
+    snprintf(pd->upfile->internal, sizeof(pd->upfile->internal), "%supload%s_%ld",
+             getStore()->getPath().c_str(), datestamp, filendx++);
+    strcpy(pd->upfile->external, pd->extfilename);
+    pd->upfile->ticket = &dw_ticket;
+    upload_ndx++;
 #ifdef UNIT_TEST
-    if (pd->fd_upload == -1) {
-        TRACE("  Unable to open upload file %s; errno %d\n", uploads[upload_ndx]->internal, errno);
-    } else {
-        TRACE("  Storing file: field %s - location %s\n", uploads[upload_ndx]->fldname,
-              uploads[upload_ndx]->internal);
-        upload_ndx++;
-    }
+    TRACE("  Storing file: field %s - location %s\n", pd->upfile->fldname, pd->upfile->internal);
 #else
-    if (pd->fd_upload == -1) {
-        CS_VAPRT_ERRO("Request::parseMultipart - Unable to create upload file %s; errno %d",
-                      uploads[upload_ndx]->internal, errno);
-    } else {
-        CS_VAPRT_TRCE("Request::createXferFile - storing file field %s into %s",
-                      uploads[upload_ndx]->fldname, uploads[upload_ndx]->internal);
-        upload_ndx++;
-    }
+    CS_VAPRT_TRCE("Request::createXferFile - storing file field %s into %s", pd->upfile->fldname,
+                  pd->upfile->internal);
 #endif
     return true;
 }
+// -------------------------------------------------------------------------------------------------
+char*
+Request::fieldBuffer()
+//! Buffer for multipart field values. Allocated at first multipart request and kept after that.
+{
+    if (!fld_buffer)
+        fld_buffer = new char[field_size];
+    return fld_buffer;
+}
+// -------------------------------------------------------------------------------------------------
+UploadStore*
+Request::getStore()
+{
+    return driver ? &driver->upstore : &local_store;
+}
+// -------------------------------------------------------------------------------------------------
+UploadFile*
+Request::findUpload(const char* fldname)
+{
+    if (!fldname)
+        return 0;
+    for (int ndx = 0; ndx < REQ_MAX_UPLOADS && uploads[ndx]; ndx++) {
+        if (!strcmp(uploads[ndx]->fldname, fldname))
+            return uploads[ndx];
+    }
+    return 0;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Request::moveUpload(UploadFile* up, const char* target)
+/*! Stores the upload permanently into target path. Uploads that are not moved before request is
+  cleared are removed.
+ */
+{
+    if (!up)
+        return false;
+    return getStore()->materialize(up, target);
+}
+// -------------------------------------------------------------------------------------------------
+ssize_t
+Request::readUpload(UploadFile* up, size_t offset, char* buf, size_t len)
+/*! Reads upload data in done, before or after moveUpload. Small uploads are held in memory and
+  large ones in anonymous files, so the data has no file name until it is moved.
+  \retval ssize_t Bytes read, 0 at the end of data, -1 on error.
+ */
+{
+    if (!up)
+        return -1;
+    return getStore()->read(up, offset, buf, len);
+}
 
 // -------------------------------------------------------------------------------------------------
 void
@@ -901,6 +1171,7 @@ Request::processBeginRequest(uint32_t ndx)
 
     id = ndx;
     TRACE("Request::processBeginRequest - %d; fd=%d\n", id, pfd.fd);
+    clock_gettime(CLOCK_MONOTONIC, &begin_time);
     rbin.read(&beg_req, sizeof(BeginRequestMsg));
     if ((beg_req.flags & FLAG_KEEP_CONN) > 0)
         flags.set(FLAG_KEEP);
@@ -942,6 +1213,9 @@ Request::parseRequestMethod(NameValue* nv)
     case t64_PATCH:
         html_type = HTML_PATCH;
         break;
+    case t64_HEAD:
+        html_type = HTML_HEAD;
+        break;
     default:
         // We should return 501 = not implemented in this case!
 #ifdef UNIT_TEST
@@ -966,6 +1240,7 @@ Request::processParams(uint64_t* plimit_hash_list, uint16_t msg_len)
     char name_buf[DRIVER_PARAMNAME], *valueptr;
     char content[REQ_MAX_BOUNDARY + 30];
     NameValue nv;
+    RecordReader reader(rbin);
     uint64_t paramhash;
     size_t max;
 
@@ -974,9 +1249,7 @@ Request::processParams(uint64_t* plimit_hash_list, uint16_t msg_len)
     // Process message.
     uint16_t processed = 0;
     while (processed < msg_len) {
-        rbin.peek(&nv, 8);
-        nv.init();
-        if (nv.name_len + nv.value_len >= rbin.size()) {
+        if (!reader.nameValue(&nv) || nv.name_len + nv.value_len >= rbin.size()) {
             TRACE("Request::process_params - more data needed. name=%d, value=%d, available=%ld\n",
                   nv.name_len, nv.value_len, rbin.size());
             return;
@@ -988,9 +1261,9 @@ Request::processParams(uint64_t* plimit_hash_list, uint16_t msg_len)
             rbin.discard(nv.name_len + nv.value_len + nv.size);
         } else {
             rbin.discard(nv.size);
-            rbin.read(name_buf, nv.name_len);
-            name_buf[nv.name_len] = 0;
-            paramhash = fnv_64bit_hash(name_buf, nv.name_len);
+            // Name is hashed in place when it is contiguous in the input buffer.
+            const char* name = reader.name(nv, name_buf);
+            paramhash = fnv_64bit_hash(name, nv.name_len);
             switch (paramhash) {
             case HASH_REQUEST_METHOD:
                 parseRequestMethod(&nv);
@@ -1057,6 +1330,37 @@ Request::processParams(uint64_t* plimit_hash_list, uint16_t msg_len)
                 }
                 break;
 
+            case HASH_CONTENT_LENGTH:
+                if (nv.value_len == 0)
+                    break;
+                if (nv.value_len < 21) {
+                    char length[21];
+                    rbin.read(length, nv.value_len);
+                    length[nv.value_len] = 0;
+                    content_length = strtoul(length, 0, 10);
+                    params.add(HASH_CONTENT_LENGTH, length);
+                    TRACE("Request::process_params - CONTENT_LENGTH: %ld\n", content_length);
+                } else
+                    rbin.discard(nv.value_len);
+                break;
+
+            case HASH_HTTP_UPLOAD_OFFSET:
+            case HASH_HTTP_UPLOAD_LENGTH:
+                if (nv.value_len == 0)
+                    break;
+                if (nv.value_len < 21) {
+                    char number[21];
+                    rbin.read(number, nv.value_len);
+                    number[nv.value_len] = 0;
+                    if (paramhash == HASH_HTTP_UPLOAD_OFFSET)
+                        upload_offset = strtoll(number, 0, 10);
+                    else
+                        upload_length = strtoll(number, 0, 10);
+                    params.add(paramhash, number);
+                } else
+                    rbin.discard(nv.value_len);
+                break;
+
             case HASH_REQUEST_URI:
                 max = nv.value_len >= REQ_MAX_URI ? REQ_MAX_URI - 1 : nv.value_len;
                 rbin.read(uri, max);
@@ -1101,13 +1405,15 @@ Request::processParams(uint64_t* plimit_hash_list, uint16_t msg_len)
                         valueptr = params.add(paramhash, nv.value_len);
                         rbin.read(valueptr, nv.value_len);
                         valueptr[nv.value_len] = 0;
-                        TRACE("Request::process_params - param: %s = %s\n", name_buf, valueptr);
+                        TRACE("Request::process_params - param: %.*s = %s\n", (int)nv.name_len,
+                              name, valueptr);
                     } else {
-                        TRACE("Request::process_params - ignored: %s\n", name_buf);
+                        TRACE("Request::process_params - ignored: %.*s\n", (int)nv.name_len, name);
                     }
                 }
                 if (!nv.value_len) {
-                    TRACE("Request::process_params - Empty parameter value! Name=%s\n", name_buf);
+                    TRACE("Request::process_params - Empty parameter value! Name=%.*s\n",
+                          (int)nv.name_len, name);
                 }
             }
         }
@@ -1127,21 +1433,294 @@ Request::processStdin(uint16_t msg_len)
     if (msg_len == 0) {
         // Input from server stopped. Do not poll anymore.
         pfd.events &= ~POLLIN;
-        if (processSpool()) {
-            // Notify the handler associated with this request.
-            TRACE("Request::process_stdin (%d) - Calling Done\n", id);
-            state = RQS_OPEN;
-            handler->done(this);
-        }
+        finishInput();
+        return;
+    }
+    if (flags.is(FLAG_RESUME)) {
+        resumeStdin(msg_len);
+        return;
+    }
+    if (flags.is(FLAG_STREAM)) {
+        streamStdin(msg_len);
         return;
     }
     writeSpool(msg_len);
 }
 // -------------------------------------------------------------------------------------------------
 void
+Request::finishInput()
+/*! Completes the input once all of it has been received. Spool is processed and the handler
+  notified only after the disk writer has written everything this request has queued. Until then
+  the request waits with FLAG_DISKWAIT and the driver calls this again.
+ */
+{
+    if (dw_ticket.pending) {
+        flags.set(FLAG_DISKWAIT);
+        return;
+    }
+    if (!flags.is(FLAG_STREAM) && !flags.is(FLAG_RESUME) && !flags.is(FLAG_SPOOLDONE)) {
+        flags.set(FLAG_SPOOLDONE);
+        if (dw_ticket.error) {
+            CS_VAPRT_ERRO("Request::finishInput - spool write failed. Errno %d.",
+                          (int)dw_ticket.error);
+            flags.clear(FLAG_DISKWAIT);
+            end(500);
+            return;
+        }
+        if (!processSpool())
+            return;
+        if (dw_ticket.pending) {
+            flags.set(FLAG_DISKWAIT);
+            return;
+        }
+    }
+    flags.clear(FLAG_DISKWAIT);
+    if (flags.is(FLAG_RESUME)) {
+        // Appended data has to survive a crash before the offset is reported to the client.
+        if (dw_ticket.error || fdatasync(fd_resume) == -1) {
+            CS_VAPRT_ERRO("Request::finishInput - resumable upload %s write failed.", resume_id);
+            resume_status = 500;
+        }
+    }
+    for (int ndx = 0; ndx < upload_ndx; ndx++) {
+        if (!uploads[ndx])
+            continue;
+        // Upload data could not be written.
+        if (dw_ticket.error)
+            uploads[ndx]->error = true;
+        getStore()->intern(uploads[ndx]);
+    }
+    // Notify the handler associated with this request.
+    TRACE("Request::process_stdin (%d) - Calling Done\n", id);
+    state = RQS_OPEN;
+    mark(SM_DONE);
+    traceEvent(TE_DONE);
+    handler->done(this);
+    traceEvent(TE_DONE_END);
+}
+// -------------------------------------------------------------------------------------------------
+uint16_t
+Request::traceSlot()
+//! Index of the request in driver's slots for the trace records.
+{
+    if (!driver || hot < driver->slots || hot >= driver->slots + driver->req_count)
+        return TRACE_NO_SLOT;
+    return hot - driver->slots;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Request::resumePath(char* path, size_t size, const char* ext)
+{
+    const char* dir = "";
+    if (driver)
+        dir = driver->resume_path.empty() ? driver->upload_path.c_str()
+                                          : driver->resume_path.c_str();
+    int len = snprintf(path, size, "%s%s%s", dir, resume_id, ext);
+    return len > 0 && (size_t)len < size;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Request::openResumable(const char* upload_id, bool create)
+/*! Handler calls this in exec to use resumable (tus style) upload. The body is appended into a
+  persistent spool '<id>.part' in the resume directory instead of being spooled and parsed.
+  - With create the upload is started from the beginning. Upload-Length header gives the total
+    size, it is stored into '<id>.len'.
+  - PATCH appends to the upload. Upload-Offset header must match the current size of the spool.
+  - Other methods only query the offset, see getResumeOffset.
+  Creating and appending requests hold an exclusive lock on the spool until the request is cleared;
+  a concurrent writer of the same upload fails with 423.
+  In done the handler reports getResumeOffset as Upload-Offset or getResumeStatus as error.
+  \param upload_id Upload identifier. Letters, numbers, '-' and '_' are accepted.
+  \retval bool True if the upload was opened. On failure getResumeStatus has the HTTP status.
+ */
+{
+    char path[REQ_MAX_URI + 8];
+    struct stat st;
+    FILE* lenfile;
+
+    if (state != RQS_PARAMS && state != RQS_STDIN) {
+        TRACE("Request::openResumable (%d) - body already read.\n", id);
+        resume_status = 500;
+        return false;
+    }
+    size_t idlen = strlen(upload_id);
+    bool valid = idlen > 0 && idlen < sizeof(resume_id);
+    for (size_t ndx = 0; valid && ndx < idlen; ndx++)
+        valid = isalnum(upload_id[ndx]) || upload_id[ndx] == '-' || upload_id[ndx] == '_';
+    if (!valid) {
+        resume_status = 400;
+        return false;
+    }
+    strcpy(resume_id, upload_id);
+    if (!resumePath(path, sizeof(path), ".part")) {
+        resume_status = 400;
+        return false;
+    }
+    // Spool is truncated only after the lock so that a running upload is not cut under its writer.
+    fd_resume = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0),
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd_resume == -1) {
+        resume_status = errno == ENOENT ? 404 : 500;
+        TRACE("Request::openResumable (%d) - unable to open %s; errno %d\n", id, path, errno);
+        return false;
+    }
+    if ((create || html_type == HTML_PATCH) && flock(fd_resume, LOCK_EX | LOCK_NB) == -1) {
+        resume_status = errno == EWOULDBLOCK ? 423 : 500;
+        TRACE("Request::openResumable (%d) - %s is in use; errno %d\n", id, path, errno);
+        return false;
+    }
+    if ((create && ftruncate(fd_resume, 0) == -1) || fstat(fd_resume, &st) == -1) {
+        resume_status = 500;
+        TRACE("Request::openResumable (%d) - unable to reset %s; errno %d\n", id, path, errno);
+        return false;
+    }
+    resume_size = st.st_size;
+    resumePath(path, sizeof(path), ".len");
+    if (create) {
+        if (upload_length >= 0 && (lenfile = fopen(path, "w")) != 0) {
+            fprintf(lenfile, "%jd\n", (intmax_t)upload_length);
+            fclose(lenfile);
+        }
+        flags.set(FLAG_RESUME);
+    } else {
+        if ((lenfile = fopen(path, "r")) != 0) {
+            intmax_t stored;
+            if (fscanf(lenfile, "%jd", &stored) == 1)
+                upload_length = stored;
+            fclose(lenfile);
+        }
+        if (html_type == HTML_PATCH) {
+            if (upload_offset != (int64_t)resume_size) {
+                TRACE("Request::openResumable (%d) - offset %jd does not match %ld\n", id,
+                      (intmax_t)upload_offset, resume_size);
+                resume_status = 409;
+                return false;
+            }
+            flags.set(FLAG_RESUME);
+        }
+    }
+    TRACE("Request::openResumable (%d) - %s at offset %ld\n", id, resume_id, resume_size);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Request::resumeStdin(uint16_t msg_len)
+{
+    if (!resume_status && upload_length >= 0 && resume_size + msg_len > (size_t)upload_length) {
+        TRACE("Request::resumeStdin (%d) - data exceeds upload length.\n", id);
+        resume_status = 413;
+    }
+    if (resume_status) {
+        rbin.discard(msg_len);
+        return;
+    }
+    fileOut(fd_resume, resume_size, 0, msg_len);
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Request::completeResumable(const char* target)
+/*! Moves completed resumable upload into target and removes its bookkeeping.
+  \param target Full path of the target file.
+ */
+{
+    char path[REQ_MAX_URI + 8];
+
+    if (fd_resume == -1 || !isResumeComplete() || resume_status)
+        return false;
+    resumePath(path, sizeof(path), ".part");
+    if (rename(path, target) == -1) {
+        CS_VAPRT_ERRO("Request::completeResumable - unable to move %s to %s; errno %d", path,
+                      target, errno);
+        return false;
+    }
+    resumePath(path, sizeof(path), ".len");
+    unlink(path);
+    close(fd_resume);
+    fd_resume = -1;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Request::streamStdin(uint16_t msg_len)
+{
+    const char* data;
+    size_t len;
+    bool more = true;
+
+    while (msg_len) {
+        len = rbin.peek_span(&data, msg_len);
+        if (!len)
+            break;
+        if (!handler->onBodyChunk(this, data, len))
+            more = false;
+        rbin.discard(len);
+        msg_len -= len;
+    }
+    if (!more)
+        pauseBody();
+}
+// -------------------------------------------------------------------------------------------------
+void
+Request::streamBody()
+/*! Handler calls this in exec to receive the body in onBodyChunk calls instead of the spooled and
+  parsed parameters.
+ */
+{
+    if (state != RQS_PARAMS && state != RQS_STDIN) {
+        TRACE("Request::streamBody (%d) - body already read.\n", id);
+        return;
+    }
+    flags.set(FLAG_STREAM);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Request::pauseBody()
+{
+    TRACE("Request::pauseBody (%d)\n", id);
+    flags.set(FLAG_PAUSED);
+    pfd.events &= ~POLLIN;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Request::resumeBody()
+{
+    if (!flags.is(FLAG_PAUSED))
+        return;
+    TRACE("Request::resumeBody (%d)\n", id);
+    flags.clear(FLAG_PAUSED);
+    if (state == RQS_STDIN && !flags.is(FLAG_INHOLD))
+        pfd.events |= POLLIN;
+    // Body that arrived while paused is still in input buffer.
+    if (driver)
+        driver->schedule(this);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Request::holdInput()
+{
+    if (flags.is(FLAG_INHOLD))
+        return;
+    TRACE("Request::holdInput (%d) - input buffer has %ld bytes\n", id, rbin.size());
+    flags.set(FLAG_INHOLD);
+    pfd.events &= ~POLLIN;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Request::releaseInput()
+{
+    TRACE("Request::releaseInput (%d) - input buffer has %ld bytes\n", id, rbin.size());
+    flags.clear(FLAG_INHOLD);
+    if (isRead() && !flags.is(FLAG_PAUSED))
+        pfd.events |= POLLIN;
+}
+// -------------------------------------------------------------------------------------------------
+void
 Request::abort()
 {
     TRACE("Request::abort (%d)\n", id);
+    if (stats)
+        stats->counters.aborts++;
+    traceEvent(TE_ABORT);
     if (handler)
         handler->abort(this);
     end(500);
@@ -14,55 +14,45 @@
 #include <cstring>
 #include <stdint.h>
 #include <poll.h>
+#include <time.h>
 
 #include "fcgidriver.hpp"
 #include "ParamData.hpp"
+#include "UploadStore.hpp"
+#include "Arena.hpp"
+#include "Stats.hpp"
+#include "Trace.hpp"
 
 namespace fcgi_driver {
 
-const uint16_t REQ_MAX_FILENAME = 96;
 const uint16_t REQ_MAX_BOUNDARY = 64;
-const uint16_t REQ_MAX_URI = 255;
-const uint16_t REQ_MAX_MEMSTDIN = 512;
+const uint16_t REQ_MAX_MEMSTDIN = 512;      // Default initial size of memory spool.
+const size_t REQ_SPOOL_MEM_DEFAULT = 0x10000; // Default limit for memory spool.
 const uint16_t REQ_MAX_OUT = 0xCFFF;
 const uint16_t REQ_MAX_UPLOADS = 16;
 const int REQ_MAX_FLDDATA = 0x10000;
 
 class NameValue;
 
-struct UploadFile
-{
-    UploadFile()
-    {
-        memset(fldname, 0, sizeof(fldname));
-        memset(internal, 0, sizeof(internal));
-        memset(external, 0, sizeof(external));
-        bytes = 0;
-    }
-    char fldname[DRIVER_MPFIELD];
-    char internal[REQ_MAX_FILENAME];
-    char external[REQ_MAX_FILENAME];
-    size_t bytes;
-};
-
 struct ParseData
 {
-    ParseData()
+    ParseData(char* field_buffer, size_t field_max)
     {
         mp_state = MP_BEGIN;
+        fld_max = field_max;
+        flddata = field_buffer;
         fldptr = flddata;
-        fd_upload = -1;
         upfile = 0;
         spool_offset = 0;
     }
     char fldname[DRIVER_MPFIELD];
     char extfilename[REQ_MAX_FILENAME];
     // Field data has no limit in specification. Since values are stored in memory we limit them to
-    // 65k.
-    char flddata[REQ_MAX_FLDDATA];
+    // Request::field_size (FieldData limit).
+    char* flddata;
+    size_t fld_max;
     char* fldptr;
     mp_state_t mp_state;
-    int fd_upload;
     UploadFile* upfile;
     size_t spool_offset;
 };
@@ -75,7 +65,15 @@ enum flag_t
     FLAG_MULTIP = 0x08,
     FLAG_SPOOLING = 0x10,
     FLAG_BODYDATA = 0x20,
-    FLAG_LIBFCGI_SID = 0x40
+    FLAG_LIBFCGI_SID = 0x40,
+    FLAG_STREAM = 0x80,      // Body is streamed to handler instead of spooling.
+    FLAG_PAUSED = 0x100,     // Handler has paused the body stream.
+    FLAG_INHOLD = 0x200,     // Input buffer is full, reading is on hold.
+    FLAG_DISKWAIT = 0x400,   // Waiting for disk writes to complete before processing.
+    FLAG_SPOOLDONE = 0x800,  // Spool has been processed.
+    FLAG_RESUME = 0x1000,    // Body is appended into resumable upload spool.
+    FLAG_ROUTEWAIT = 0x2000, // Handler is at its concurrency limit, exec has not been called.
+    FLAG_OCCUPY = 0x4000     // Request is counted into handler's occupancy.
 };
 
 // Hashes for Fcgi parameters (created with salt 0)
@@ -86,6 +84,9 @@ const uint64_t HASH_SCRIPT_NAME = 0xbce9f027ff93fbf5UL;
 const uint64_t HASH_REMOTE_ADDR = 0x16cdaa4fd46416acUL;
 const uint64_t HASH_REQUEST_URI = 0xffe3f74a97320ad4UL;
 const uint64_t HASH_CONTENT_TYPE = 0xd3a3629a62e484baUL;
+const uint64_t HASH_CONTENT_LENGTH = 0x466c63ab559e6b6eUL;
+const uint64_t HASH_HTTP_UPLOAD_OFFSET = 0x5c03e69a2fac8f6aUL;
+const uint64_t HASH_HTTP_UPLOAD_LENGTH = 0x64180062f94a8903UL;
 // const uint64_t HASH_USER_AGENT = 0xac017b9a0ec95c9fUL;
 const uint64_t HASH_SSL_CLIENT_DN = 0x56c4fa1dd3d1cf89UL;
 const uint64_t HASH_LIBFCGI_SID = 0x7791e62de33fce61UL;
@@ -98,13 +99,74 @@ enum class HandlerEvent
 
 class Handler
 {
+    friend class Driver;
+    friend class Request;
+
   public:
-    Handler() {}
+    Handler()
+      : max_active(0)
+      , max_wait(0)
+      , active(0)
+      , limit_rejects(0)
+      , name(0)
+    {}
     virtual ~Handler() {}
     virtual void exec(Request*) = 0;
     virtual void done(Request*) = 0;
     virtual void abort(Request*);
     virtual void event(HandlerEvent);
+    virtual bool onBodyChunk(Request*, const char* data, size_t len);
+
+    void limitConcurrency(uint32_t max, uint32_t wait_ms = 0);
+    uint32_t getActive() { return active; }
+    uint32_t getLimitRejects() { return limit_rejects; }
+    void setName(const char* _name) { name = _name; } //!< Shown in statistics. Not copied.
+    const char* getName() { return name; }
+
+  protected:
+    uint32_t max_active;    // Max requests served at once. 0 = no limit.
+    uint32_t max_wait;      // Max time (ms) a request waits for its turn before 503.
+    uint32_t active;        // Requests from exec until the response has been sent.
+    uint32_t limit_rejects; // Requests rejected because of the limit.
+    const char* name;
+};
+
+class ReqFlags
+{
+  public:
+    ReqFlags() { bits = 0; }
+    bool is(flag_t s) const { return (bits & s) > 0 ? true : false; }
+    bool is(int s) const { return (bits & s) == s ? true : false; }
+    void set(flag_t s) { bits |= s; }
+    void set(int s) { bits |= s; }
+    void clear(flag_t s) { bits &= ~s; }
+    void clear() { bits = 0; }
+
+  private:
+    int bits;
+};
+
+/*! Scheduling state of one request. Driver keeps these in a dense array so that the poll, work
+  and cleanup loops scan a few cache lines instead of touching every request object. Request
+  accesses the same fields through references.
+ */
+struct ReqSlot
+{
+    ReqSlot()
+    {
+        memset(&pfd, 0, sizeof(pollfd));
+        state = RQS_WAIT;
+        in_bytes = 0;
+        queued = false;
+    }
+    bool isRead() const { return state == RQS_PARAMS || state == RQS_STDIN; }
+    bool isWrite() const { return (pfd.events & POLLOUT) > 0; }
+
+    pollfd pfd;
+    req_state_t state;
+    ReqFlags flags;
+    uint32_t in_bytes; // Unprocessed bytes in input buffer as seen by driver.
+    bool queued;       // In driver's ready queue. Not reset by Request::clear.
 };
 
 class Request
@@ -117,7 +179,7 @@ class Request
     */
     // enum ostream_type_t { STDOUT , STDERR };
 
-    Request();
+    Request(ReqSlot* slot = 0);
     Request(const Request& orig);
     ~Request();
 
@@ -133,7 +195,12 @@ class Request
     bool writeFd(int fd);
     void flush(); // !USE SPARINGLY, BLOCKS THE SCHEDULER
     void end(uint32_t appStatus = 0);
+    void reject(uint32_t appStatus);
     void setStatus(uint32_t as) { app_status = as; }
+    void streamBody();
+    void pauseBody();
+    void resumeBody();
+    bool isPaused() { return flags.is(FLAG_PAUSED); }
     const char* getURI() { return uri; }
 
     int getUploadCount() { return upload_ndx; }
@@ -151,11 +218,24 @@ class Request
         }
         return 0;
     }
+    UploadFile* findUpload(const char* fldname);
+    bool moveUpload(UploadFile*, const char* target);
+    ssize_t readUpload(UploadFile*, size_t offset, char* buf, size_t len);
+    size_t getContentLength() { return content_length; }
+
+    bool openResumable(const char* upload_id, bool create = false);
+    bool completeResumable(const char* target);
+    int getResumeStatus() { return resume_status; }
+    size_t getResumeOffset() { return resume_size; }
+    int64_t getUploadOffset() { return upload_offset; }
+    int64_t getUploadLength() { return upload_length; }
+    bool isResumeComplete() { return upload_length >= 0 && resume_size == (size_t)upload_length; }
 
     size_t getOutReserved() { return rbpos - rbout; }
     size_t getOutPending() { return rbpos - rbsend; }
-    static uint16_t getOutCapacity() { return REQ_MAX_OUT; }
+    static uint16_t getOutCapacity() { return output_size; }
     char* getOutBuffer() { return rbout; } // Use ONLY with std::ostringstream !!
+    Arena& getArena() { return arena; }    //!< Scratch memory that lives until the request ends.
     void setOutPos(size_t pos) { rbpos = rbout + pos; }
 
     void log(const char* str);
@@ -172,20 +252,43 @@ class Request
 
     void processBeginRequest(uint32_t ndx);
     bool openMPSpool(const char* data, int len);
+    int openSpoolFile();
     void writeSpool(uint16_t msg_len, const char* msg = 0);
     bool processSpool();
     void processStdin(uint16_t msg_len);
+    void finishInput();
+    bool enterHandler();
+    void leaveHandler();
+    bool diskPending() { return dw_ticket.pending > 0; }
+    void fileOut(int fd, size_t& offset, const char* data, size_t len);
+    void holdInput();
+    void releaseInput();
+    void streamStdin(uint16_t msg_len);
+    void resumeStdin(uint16_t msg_len);
+    bool resumePath(char* path, size_t size, const char* ext);
     size_t parseMultipart(char* data, size_t dlen, ParseData* pd);
     void processMultipart();
     void processBodyData();
     void processParams(uint64_t* hash_list, uint16_t msg_len);
     bool createXferFile(ParseData*);
+    char* fieldBuffer();
+    UploadStore* getStore();
     void clearRbOut()
     {
         rbpos = rbout;
         rbsend = rbout;
     }
     void abort();
+    void mark(stat_mark_t sm)
+    {
+        if (stats && !marks[sm])
+            marks[sm] = stat_clock();
+    }
+    void traceEvent(trace_event_t ev, uint32_t arg = 0, uint32_t aux = 0)
+    {
+        TRACE_EVENT(ev, pfd.fd, state, traceSlot(), arg, aux);
+    }
+    uint16_t traceSlot();
 
     void send();
     void parseRequestMethod(NameValue*);
@@ -193,43 +296,48 @@ class Request
 #ifdef UNIT_TEST
     bool openMPSpool(const char* fname, const char* mptag, int taglen);
 #endif
-    class Flags
-    {
-      public:
-        Flags() { bits = 0; }
-        bool is(flag_t s) { return (bits & s) > 0 ? true : false; }
-        bool is(int s) { return (bits & s) == s ? true : false; }
-        void set(flag_t s) { bits |= s; }
-        void set(int s) { bits |= s; }
-        void clear(flag_t s) { bits &= ~s; }
-        void clear() { bits = 0; }
-
-      private:
-        int bits;
-    } flags;
-
+    ReqSlot own_slot; // Used when the request is not created by driver.
+    ReqSlot* hot;     // Scheduling fields. Points into driver's slot array.
+    ReqFlags& flags;
+    req_state_t& state;
+    pollfd& pfd;
     html_type_t html_type;
-    req_state_t state;
-    pollfd pfd;
     uint32_t id;
     role_t role;
-    char rbout[REQ_MAX_OUT];         // output buffer
+    char* rbout;                     // output buffer, output_size bytes
     char* rbpos;                     // Current output position (for write-function);
     char* rbsend;                    // Current output position (for send)
     char boundary[REQ_MAX_BOUNDARY]; // Stores the multipart formdata separator.
     char uri[REQ_MAX_URI];
-    char stdin_buffer[REQ_MAX_MEMSTDIN];
+    char* stdin_buffer;     // Memory spool, grows up to spool_limit.
+    char* fld_buffer;       // Multipart field values, field_size bytes. Kept once allocated.
+    size_t stdin_cap;       // Allocated size of stdin_buffer.
     uint16_t bound_len; // NUmber of actual bytes in boundary.
     uint16_t stdin_len; // Bytes in stdin part
     uint32_t app_status;
     size_t spool_size;
+    size_t content_length; // CONTENT_LENGTH parameter, 0 if not given.
     int fd_spool;          // Used by spooler and uploader in processing multipart forms
-    int mp_count;          // Multi-part count
+    DWTicket dw_ticket;    // Asynchronous disk writes of this request.
+    int fd_resume;         // Resumable upload spool, -1 if not in use.
+    size_t resume_size;    // Bytes in resumable upload spool, i.e. the next offset.
+    int64_t upload_offset; // Upload-Offset header, -1 if not given.
+    int64_t upload_length; // Upload-Length header or stored total of resumable upload, -1 = unknown.
+    int resume_status;     // HTTP status for resumable upload, 0 = OK.
+    char resume_id[REQ_MAX_FILENAME];
+    struct timespec route_since; // Waiting for handler's turn since.
+    struct timespec begin_time;  // BEGIN_REQUEST received, for latency.
+    uint64_t marks[SM_COUNT];    // Lifecycle times (us) when statistics are on.
     uint32_t stdout_count; // Number of times the rbout has been sent / single request
     UploadFile* uploads[REQ_MAX_UPLOADS]; // Request uploads.
     int upload_ndx;                       // Index of next upload.
+    Arena arena;                          // Per request memory, reset in clear.
     static Driver* driver;
-    static size_t input_size, param_size;
+    static Stats* stats; // Driver's statistics, null if not enabled.
+    static size_t input_size, param_size, spool_limit;
+    static size_t output_size, memstdin_size, field_size;
+    static uint32_t param_keys;
+    static RB_MODE input_mode;
 };
 
 } // namespace fcgi_driver
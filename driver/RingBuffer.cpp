@@ -7,6 +7,8 @@
 #include <unistd.h>
 #include <stdexcept>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "RingBuffer.hpp"
 
@@ -22,15 +24,18 @@ namespace fcgi_driver {
 
 // -------------------------------------------------------------------------------------------------
 #ifdef RB_THREAD_SAFE
-RingBuffer::RingBuffer(size_t max, bool wait_)
+RingBuffer::RingBuffer(size_t max, bool wait_, RB_MODE mode)
 #else
-RingBuffer::RingBuffer(size_t max)
+RingBuffer::RingBuffer(size_t max, RB_MODE mode)
 #endif
 {
     RBMAX = max;
     last_read = 0;
-    rb = new char[RBMAX];
-    memset(rb, 0, RBMAX);
+    mirror = mode == RB_MIRROR && map_mirror(max);
+    if (!mirror) {
+        rb = new char[RBMAX];
+        memset(rb, 0, RBMAX);
+    }
 
     reptr = rb;
     wrptr = rb;
@@ -57,7 +62,44 @@ RingBuffer::~RingBuffer()
         pthread_cond_destroy(&cond_read);
     }
 #endif
-    delete[] rb;
+    if (mirror)
+        munmap(rb, RBMAX * 2);
+    else
+        delete[] rb;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+RingBuffer::map_mirror(size_t max)
+/*! Maps memfd twice into consecutive addresses so that rb[RBMAX + n] is rb[n]. Size is rounded up
+  to page size. Returns false if the mapping is not possible, caller falls back to heap.
+ */
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (max + page - 1) / page * page;
+    int fd = memfd_create("fcgi-rb", MFD_CLOEXEC);
+    if (fd == -1)
+        return false;
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        return false;
+    }
+    // Reserve the address range first, then place both views over it.
+    char* base = (char*)mmap(0, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+            MAP_FAILED) {
+        munmap(base, size * 2);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    rb = base;
+    RBMAX = size;
+    return true;
 }
 
 // -------------------------------------------------------------------------------------------------
@@ -72,11 +114,11 @@ RingBuffer::write(const void* input, size_t slen)
         slen = maxwrite;
 
     size_t fp = end - wrptr;
-    if (slen < fp) {
+    if (mirror || slen < fp) {
         memcpy(wrptr, input, slen);
         wrptr += slen;
-        if (wrptr == end)
-            wrptr = rb;
+        if (wrptr >= end)
+            wrptr -= RBMAX;
     } else {
         memcpy(wrptr, input, fp);
         memcpy(rb, (char*)input + fp, slen - fp);
@@ -112,11 +154,11 @@ RingBuffer::read(void* store, size_t slen)
     if (slen > ss)
         slen = ss;
     size_t fp = end - reptr;
-    if (slen < fp) {
+    if (mirror || slen < fp) {
         memcpy(store, reptr, slen);
         reptr += slen;
-        if (reptr == end)
-            reptr = rb;
+        if (reptr >= end)
+            reptr -= RBMAX;
     } else {
         memcpy(store, reptr, fp);
         memcpy((char*)store + fp, rb, slen - fp);
@@ -130,6 +172,7 @@ RingBuffer::read(void* store, size_t slen)
 // -------------------------------------------------------------------------------------------------
 size_t
 RingBuffer::read_into(std::string& output)
+//! Appends all data into output.
 {
     RBLOCK;
     last_read = 0;
@@ -138,22 +181,32 @@ RingBuffer::read_into(std::string& output)
         RBUNLOCK;
         return 0;
     }
-    output.reserve(ss);
-    while (reptr != wrptr || eof) {
-        output.push_back(*reptr);
-        reptr++;
-        last_read++;
-        if (reptr == end)
-            reptr = rb;
-        eof = false;
+    size_t fp = end - reptr;
+    if (mirror || ss <= fp) {
+        output.append(reptr, ss);
+    } else {
+        output.reserve(output.size() + ss);
+        output.append(reptr, fp);
+        output.append(rb, ss - fp);
     }
+    reptr += ss;
+    if (reptr >= end)
+        reptr -= RBMAX;
+    eof = false;
+    last_read = ss;
     RBUNLOCK;
     return last_read;
 }
 // -------------------------------------------------------------------------------------------------
 size_t
 RingBuffer::read_into(int fd, size_t slen)
+/*! Writes data into fd. Both halves of wrapped data go with single writev.
+  \retval size_t Number of bytes written and removed from the buffer.
+ */
 {
+    struct iovec iov[2];
+    int iovcnt = 1;
+
     if (!slen || fd < 0) {
         return 0;
     }
@@ -167,20 +220,27 @@ RingBuffer::read_into(int fd, size_t slen)
     if (slen > ss)
         slen = ss;
     size_t fp = end - reptr;
-    if (slen < fp) {
-        ::write(fd, reptr, slen);
-        reptr += slen;
-        if (reptr == end)
-            reptr = rb;
-    } else {
-        ::write(fd, reptr, fp);
-        ::write(fd, rb, slen - fp);
-        reptr = rb + (slen - fp);
+    iov[0].iov_base = reptr;
+    iov[0].iov_len = slen;
+    if (!mirror && slen > fp) {
+        iov[0].iov_len = fp;
+        iov[1].iov_base = rb;
+        iov[1].iov_len = slen - fp;
+        iovcnt = 2;
+    }
+    ssize_t bw = writev(fd, iov, iovcnt);
+    if (bw <= 0) {
+        RBUNLOCK;
+        last_read = 0;
+        return 0;
     }
+    reptr += bw;
+    if (reptr >= end)
+        reptr -= RBMAX;
     eof = false;
     RBUNLOCK;
-    last_read = slen;
-    return slen;
+    last_read = bw;
+    return bw;
 }
 // -------------------------------------------------------------------------------------------------
 size_t
@@ -210,7 +270,7 @@ RingBuffer::peek(void* store, size_t slen)
     if (slen > ss)
         slen = ss;
     size_t fp = end - reptr;
-    if (slen < fp) {
+    if (mirror || slen < fp) {
         memcpy(store, reptr, slen);
     } else {
         memcpy(store, reptr, fp);
@@ -220,12 +280,86 @@ RingBuffer::peek(void* store, size_t slen)
     return slen;
 }
 
+// -------------------------------------------------------------------------------------------------
+size_t
+RingBuffer::peek_span(const char** ptr, size_t slen)
+/*! Gives direct access to data at the read position without copying it. Use discard to consume.
+  \param ptr Receives pointer to the data.
+  \param slen Max number of bytes needed.
+  \retval size_t Number of contiguous bytes available at ptr. Less than slen if data wraps.
+ */
+{
+    if (!slen || !ptr)
+        return 0;
+    RBLOCK;
+    size_t ss = size_internal();
+    if (slen > ss)
+        slen = ss;
+    size_t fp = end - reptr;
+    if (!mirror && slen > fp)
+        slen = fp;
+    *ptr = reptr;
+    RBUNLOCK;
+    return slen;
+}
+// -------------------------------------------------------------------------------------------------
+const char*
+RingBuffer::view(size_t slen)
+/*! Returns pointer to next slen bytes for parsing them in place, or null if there is not that
+  much data or (in heap mode) the data wraps. Pointer is valid until the next write.
+ */
+{
+    RBLOCK;
+    const char* ptr = reptr;
+    if (size_internal() < slen || (!mirror && (size_t)(end - reptr) < slen))
+        ptr = 0;
+    RBUNLOCK;
+    return ptr;
+}
+// -------------------------------------------------------------------------------------------------
+ssize_t
+RingBuffer::read_from(int fd, size_t max)
+/*! Reads from fd directly into the free space of the buffer.
+  \retval ssize_t Number of bytes read, -1 on error (see errno).
+ */
+{
+    struct iovec iov[2];
+    int iovcnt = 1;
+
+    RBLOCK;
+    size_t cap = capacity_internal();
+    if (max > cap)
+        max = cap;
+    if (!max) {
+        RBUNLOCK;
+        return 0;
+    }
+    size_t fp = end - wrptr;
+    iov[0].iov_base = wrptr;
+    iov[0].iov_len = max;
+    if (!mirror && max > fp) {
+        iov[0].iov_len = fp;
+        iov[1].iov_base = rb;
+        iov[1].iov_len = max - fp;
+        iovcnt = 2;
+    }
+    ssize_t br = readv(fd, iov, iovcnt);
+    if (br > 0) {
+        wrptr += br;
+        if (wrptr >= end)
+            wrptr -= RBMAX;
+        if (wrptr == reptr)
+            eof = true;
+    }
+    RBUNLOCK;
+    return br;
+}
+
 // -------------------------------------------------------------------------------------------------
 size_t
 RingBuffer::exp_as_text(std::ostream& os, size_t slen, EXP_TYPE type)
+//! Moves data into stream as is (TEXT) or as comma separated hex values (HEX).
 {
-    unsigned short int sich;
-    char ch;
     if (!slen) {
         return 0;
     }
@@ -238,22 +372,23 @@ RingBuffer::exp_as_text(std::ostream& os, size_t slen, EXP_TYPE type)
     }
     if (slen > ss)
         slen = ss;
-    if (type == HEX)
+    size_t fp = end - reptr;
+    size_t first = mirror || slen <= fp ? slen : fp;
+    if (type == TEXT) {
+        os.write(reptr, first);
+        if (first < slen)
+            os.write(rb, slen - first);
+    } else {
         os << std::hex;
-    while (reptr != wrptr && slen) {
-        ch = *reptr;
-        if (type == HEX) {
-            sich = 0xff & ((unsigned short)ch);
-            os << sich << ',';
-        } else
-            os << ch;
-        reptr++;
-        slen--;
-        if (reptr == end)
-            reptr = rb;
-    }
-    if (type == HEX)
+        for (size_t ndx = 0; ndx < slen; ndx++) {
+            char ch = ndx < first ? reptr[ndx] : rb[ndx - first];
+            os << (0xff & (unsigned short)ch) << ',';
+        }
         os << std::dec;
+    }
+    reptr += slen;
+    if (reptr >= end)
+        reptr -= RBMAX;
     eof = false;
     RBUNLOCK;
     last_read = slen;
@@ -262,6 +397,7 @@ RingBuffer::exp_as_text(std::ostream& os, size_t slen, EXP_TYPE type)
 // -------------------------------------------------------------------------------------------------
 size_t
 RingBuffer::discard(size_t slen)
+//! \retval size_t Number of bytes removed.
 {
     if (!slen) {
         return 0;
@@ -274,13 +410,10 @@ RingBuffer::discard(size_t slen)
     }
     if (slen > ss)
         slen = ss;
-    while ((reptr != wrptr || eof) && slen) {
-        reptr++;
-        slen--;
-        if (reptr == end)
-            reptr = rb;
-        eof = false;
-    }
+    reptr += slen;
+    if (reptr >= end)
+        reptr -= RBMAX;
+    eof = false;
     RBUNLOCK;
     return slen;
 }
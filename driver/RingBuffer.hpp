@@ -8,6 +8,7 @@
 #define FCGI_RINGBUFFER_HPP
 
 #include <iostream>
+#include <sys/types.h>
 #ifdef RB_THREAD_SAFE
 #include <pthread.h>
 #endif
@@ -24,13 +25,19 @@ class RBCallBack
     virtual void end_push() = 0;
 };
 
+enum RB_MODE
+{
+    RB_HEAP,  // Plain heap buffer. Data that wraps around the end is handled in two parts.
+    RB_MIRROR // Buffer is mapped twice back to back. Readable data is always contiguous.
+};
+
 class RingBuffer
 {
   public:
 #ifdef RB_THREAD_SAFE
-    RingBuffer(size_t max, bool wait);
+    RingBuffer(size_t max, bool wait, RB_MODE mode = RB_HEAP);
 #else
-    RingBuffer(size_t max);
+    RingBuffer(size_t max, RB_MODE mode = RB_HEAP);
 #endif
     ~RingBuffer();
 
@@ -40,7 +47,11 @@ class RingBuffer
     size_t read_into(int fd, size_t len);
     size_t read_max(void*, size_t, size_t, bool);
     size_t peek(void*, size_t);
+    size_t peek_span(const char**, size_t);
+    const char* view(size_t);
+    ssize_t read_from(int fd, size_t max);
     bool is_eof() { return eof; }
+    bool is_mirror() const { return mirror; }
 
 #ifdef RB_THREAD_SAFE
     size_t size();
@@ -73,6 +84,7 @@ class RingBuffer
   protected:
     size_t size_internal() const;
     size_t capacity_internal() const;
+    bool map_mirror(size_t);
 
 #ifdef RB_THREAD_SAFE
     pthread_mutex_t mtx_buffer;
@@ -87,6 +99,7 @@ class RingBuffer
     char* wrptr;
     char* end;
     bool eof;
+    bool mirror; // rb is followed by its own mapping, see RB_MODE.
 };
 
 } // namespace fcgi_driver
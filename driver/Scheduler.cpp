@@ -26,7 +26,6 @@
 #include "Scheduler.hpp"
 
 extern FILE* trace;
-pollfd pfdarray[DRIVER_POLL_FD];
 
 using namespace std;
 using namespace c4s;
@@ -37,9 +36,12 @@ namespace fcgi_driver {
 Scheduler::Scheduler(Driver* _driver, const char* sp, time_t _idle_period)
   : driver(_driver)
 {
+    pfd_max = driver ? driver->getRequestCount() : 0;
+    pfdarray = new pollfd[pfd_max ? pfd_max : 1];
     memset(socket_path, 0, sizeof(socket_path));
     idle_period = _idle_period;
     time(&idle_start);
+    memset(&counters, 0, sizeof(counters));
     if (sp) {
         struct sockaddr_un addr
         {};
@@ -81,6 +83,7 @@ Scheduler::~Scheduler()
 {
     if (poll_data.fd != 0)
         unlink(socket_path);
+    delete[] pfdarray;
 }
 // ------------------------------------------------------------------------------------------
 bool
@@ -90,13 +93,16 @@ Scheduler::run()
         CS_PRINT_CRIT("Scheduler::run - missing driver. Terminating.");
         return false;
     }
+    counters.loops++;
     // Listen for new connections first
     int rc = ppoll(&poll_data, 1, &next_conn_timeout, &sigmask);
     if (rc == -1) {
         if (errno == EINTR) {
             CS_PRINT_DEBU("Scheduler::run - Signal received while polling (a).");
+            counters.signals++;
             return true; // This is OK. the main program will check if we need to terminate or not.
         }
+        counters.poll_errors++;
         if (fail_counter++ < 10)
             return true;
         throw runtime_error("Scheduler::run - Too many poll failures.");
@@ -114,6 +120,8 @@ Scheduler::run()
             throw runtime_error(std::string("Scheduler::run - accept() failed: ") +
                                 strerror(errno));
         TRACE("Scheduler::run - New socked with fd:%d\n", socket);
+        counters.accepts++;
+        TRACE_EVENT(TE_ACCEPT, socket, RQS_WAIT, TRACE_NO_SLOT, 0, 0);
         newfd.fd = socket;
         newfd.events = POLLIN;
         newfd.revents = 0;
@@ -123,10 +131,15 @@ Scheduler::run()
     fflush(trace);
 #endif
     // Poll the open connections.
-    size_t count = driver->fillPollFd(pfdarray, DRIVER_POLL_FD);
+    size_t count = driver->fillPollFd(pfdarray, pfd_max);
     if (!count) {
-        next_conn_timeout.tv_sec = 3;
+        // Finished requests are freed here too so that waiting connections get admitted.
+        driver->freeDormantRequests();
+        driver->collectIdle();
+        next_conn_timeout.tv_sec = driver->getWaitingCount() ? 0 : 3;
         next_conn_timeout.tv_nsec = 0;
+        // Going to sleep: publish the idle state even if the last update was recent.
+        driver->publishStats(&counters, next_conn_timeout.tv_sec > 0);
         return true;
     }
     next_conn_timeout.tv_sec = 0;
@@ -135,8 +148,10 @@ Scheduler::run()
     if (rc == -1) {
         if (errno == EINTR) {
             CS_PRINT_DEBU("Scheduler::run - Signal received while polling (b).");
+            counters.signals++;
             return true;
         }
+        counters.poll_errors++;
         throw runtime_error(std::string("Scheduler::run - ppoll failed. Error: ") +
                             strerror(errno));
     }
@@ -163,6 +178,7 @@ Scheduler::run()
         }
     }
     driver->freeDormantRequests();
+    driver->publishStats(&counters);
     if (rw) {
         time(&idle_start);
     }
@@ -39,6 +39,7 @@ class Scheduler
     void use_accurate_poll_interval() { hard_poll_interval = -2; }
 
     void reset_idle_timer() { time(&idle_start); }
+    const SchedCounters& get_counters() const { return counters; }
 
   private:
     // Don't copy me!
@@ -47,6 +48,8 @@ class Scheduler
 
     Driver* driver;
     pollfd poll_data;
+    pollfd* pfdarray; // Request fds, one per driver's request.
+    size_t pfd_max;
     int hard_poll_interval;
     int fail_counter;
     // int next_conn_timeout;
@@ -55,6 +58,7 @@ class Scheduler
     char socket_path[108];
     time_t idle_period;
     time_t idle_start;
+    SchedCounters counters; // Published with Driver::publishStats.
 };
 
 } // namespace fcgi_driver
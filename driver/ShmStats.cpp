@@ -0,0 +1,157 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cpp4scripts.hpp>
+
+#include "ShmStats.hpp"
+
+namespace fcgi_driver {
+
+static const char SHM_MAGIC[8] = "FCGISHM";
+
+// -------------------------------------------------------------------------------------------------
+ShmStats::ShmStats()
+  : seg(0)
+{}
+// -------------------------------------------------------------------------------------------------
+ShmStats::~ShmStats()
+{
+    close();
+}
+// -------------------------------------------------------------------------------------------------
+bool
+ShmStats::open(const char* prefix)
+/*! Creates the segment /dev/shm/<prefix>.<pid>. Call in the process that runs the driver, i.e.
+  after fork in prefork deployments.
+  \param prefix Segment name prefix. Null = SHM_STAT_PREFIX.
+ */
+{
+    close();
+    char shm_name[128];
+    snprintf(shm_name, sizeof(shm_name), "/%s.%d", prefix ? prefix : SHM_STAT_PREFIX, getpid());
+    int fd = shm_open(shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1) {
+        CS_VAPRT_ERRO("ShmStats::open - unable to create %s; errno %d", shm_name, errno);
+        return false;
+    }
+    if (ftruncate(fd, sizeof(ShmStatSegment)) == -1) {
+        CS_VAPRT_ERRO("ShmStats::open - unable to size %s; errno %d", shm_name, errno);
+        ::close(fd);
+        shm_unlink(shm_name);
+        return false;
+    }
+    void* mem = mmap(0, sizeof(ShmStatSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        CS_VAPRT_ERRO("ShmStats::open - unable to map %s; errno %d", shm_name, errno);
+        shm_unlink(shm_name);
+        return false;
+    }
+    // Fresh segment is zero filled. Readers ignore it until the version is set.
+    seg = (ShmStatSegment*)mem;
+    seg->pid = getpid();
+    seg->start_sec = time(0);
+    seg->size = sizeof(ShmStatSegment);
+    memcpy(seg->magic, SHM_MAGIC, sizeof(seg->magic));
+    std::atomic_thread_fence(std::memory_order_release);
+    seg->version = SHM_STAT_VERSION;
+    name = shm_name;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+void
+ShmStats::close()
+//! Removes the segment. Readers that have it mapped keep the last values.
+{
+    if (!seg)
+        return;
+    munmap(seg, sizeof(ShmStatSegment));
+    shm_unlink(name.c_str());
+    seg = 0;
+    name.clear();
+}
+// -------------------------------------------------------------------------------------------------
+void
+ShmStats::publish(const ShmStatData& data)
+//! Copies the snapshot into the segment. Single writer only.
+{
+    if (!seg)
+        return;
+    const uint64_t* src = (const uint64_t*)&data;
+    uint64_t seq = seg->seq.load(std::memory_order_relaxed);
+    seg->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t ndx = 0; ndx < SHM_STAT_WORDS; ndx++)
+        seg->words[ndx].store(src[ndx], std::memory_order_relaxed);
+    seg->seq.store(seq + 2, std::memory_order_release);
+}
+// -------------------------------------------------------------------------------------------------
+ShmStatSegment*
+ShmStats::attach(const char* shm_name)
+/*! Maps an existing segment read only.
+  \param shm_name Segment name, e.g. "/fcgistat.1234".
+  \retval ShmStatSegment* Null if the segment does not exist or has different version.
+ */
+{
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != sizeof(ShmStatSegment)) {
+        ::close(fd);
+        return 0;
+    }
+    void* mem = mmap(0, sizeof(ShmStatSegment), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+        return 0;
+    ShmStatSegment* sseg = (ShmStatSegment*)mem;
+    if (sseg->version != SHM_STAT_VERSION || sseg->size != sizeof(ShmStatSegment) ||
+        memcmp(sseg->magic, SHM_MAGIC, sizeof(SHM_MAGIC))) {
+        munmap(mem, sizeof(ShmStatSegment));
+        return 0;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sseg;
+}
+// -------------------------------------------------------------------------------------------------
+void
+ShmStats::detach(ShmStatSegment* sseg)
+{
+    if (sseg)
+        munmap(sseg, sizeof(ShmStatSegment));
+}
+// -------------------------------------------------------------------------------------------------
+bool
+ShmStats::read(const ShmStatSegment* sseg, ShmStatData* data)
+/*! Takes a consistent copy of the segment's data.
+  \retval bool False if the writer kept updating during all retries.
+ */
+{
+    uint64_t* dst = (uint64_t*)data;
+    for (int retry = 0; retry < 1000; retry++) {
+        uint64_t seq = sseg->seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            continue;
+        for (size_t ndx = 0; ndx < SHM_STAT_WORDS; ndx++)
+            dst[ndx] = sseg->words[ndx].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sseg->seq.load(std::memory_order_relaxed) == seq)
+            return true;
+    }
+    return false;
+}
+
+} // namespace fcgi_driver
@@ -0,0 +1,96 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_SHMSTATS_HPP
+#define FCGI_SHMSTATS_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+#include "Stats.hpp"
+
+namespace fcgi_driver {
+
+const uint32_t SHM_STAT_VERSION = 1;
+const uint32_t SHM_STAT_STATES = 7;        // Number of req_state_t values.
+const uint64_t SHM_STAT_INTERVAL = 10000;  // Default min time between updates (us).
+const char SHM_STAT_PREFIX[] = "fcgistat"; // Segment is /dev/shm/<prefix>.<pid>
+
+//! Counters of the Scheduler loop.
+struct SchedCounters
+{
+    uint64_t loops;       // Calls to Scheduler::run.
+    uint64_t accepts;     // Accepted connections.
+    uint64_t poll_errors; // Failed polls, signals excluded.
+    uint64_t signals;     // Polls interrupted by a signal.
+};
+
+/*! Snapshot of one process. All fields are 64-bit so that the snapshot can be copied word by
+  word. Adding or moving a field requires new SHM_STAT_VERSION.
+ */
+struct ShmStatData
+{
+    uint64_t update_us; // stat_clock() of the update.
+    uint64_t served;
+    uint64_t rejected;
+    uint64_t requests;               // Request slots.
+    uint64_t state[SHM_STAT_STATES]; // Slots in each req_state_t.
+    uint64_t admit_waiting;          // Connections in admit queue.
+    uint64_t ready;                  // Requests in driver's ready queue.
+    uint64_t limit;                  // Adaptive concurrency limit, 0 = not in use.
+    StatCounters counters;
+    SchedCounters sched;
+};
+
+const size_t SHM_STAT_WORDS = sizeof(ShmStatData) / sizeof(uint64_t);
+static_assert(sizeof(ShmStatData) % sizeof(uint64_t) == 0, "ShmStatData must be 64-bit words");
+
+//! Shared memory layout. Header is written once when the segment is created.
+struct ShmStatSegment
+{
+    char magic[8]; // "FCGISHM\0"
+    uint32_t version;
+    uint32_t size; // sizeof(ShmStatSegment)
+    uint64_t pid;
+    uint64_t start_sec;        // Wall clock time at creation.
+    std::atomic<uint64_t> seq; // Odd while the writer is updating.
+    std::atomic<uint64_t> words[SHM_STAT_WORDS];
+};
+
+/*! Publishes driver and scheduler counters into a small POSIX shared memory segment so that
+  external tools (test/fcgistat.cxx) can follow every process of a pool without sending requests
+  to them. The driver is the single writer; updates are protected with a sequence lock, so readers
+  never block the writer and retry only if they hit an update in progress.
+ */
+class ShmStats
+{
+  public:
+    ShmStats();
+    ~ShmStats();
+
+    bool open(const char* prefix);
+    void close();
+    bool isOpen() { return seg != 0; }
+    void publish(const ShmStatData&);
+    const char* getName() { return name.c_str(); }
+
+    static ShmStatSegment* attach(const char* name);
+    static void detach(ShmStatSegment*);
+    static bool read(const ShmStatSegment*, ShmStatData*);
+
+  protected:
+    ShmStatSegment* seg;
+    std::string name;
+
+  private:
+    ShmStats(const ShmStats&);
+    ShmStats& operator=(const ShmStats&);
+};
+
+} // namespace fcgi_driver
+
+#endif
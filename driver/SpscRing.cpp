@@ -0,0 +1,219 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "SpscRing.hpp"
+
+namespace fcgi_driver {
+
+// -------------------------------------------------------------------------------------------------
+SpscRing::SpscRing(size_t capacity, bool wait)
+/*! \param capacity Buffer size. Rounded up to power of two.
+  \param wait Create eventfd for read_wait and event_fd.
+ */
+  : head(0)
+  , staged(0)
+  , tail_cache(0)
+  , tail(0)
+  , head_cache(0)
+  , waiting(false)
+  , closed(false)
+{
+    size_t size = SPSC_CACHE_LINE;
+    while (size < capacity)
+        size <<= 1;
+    buffer = new char[size];
+    mask = size - 1;
+    efd = wait ? eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) : -1;
+}
+// -------------------------------------------------------------------------------------------------
+SpscRing::~SpscRing()
+{
+    if (efd >= 0)
+        ::close(efd);
+    delete[] buffer;
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+SpscRing::write_span(char** ptr)
+/*! Producer: gives contiguous free space at write position. Fill it and call commit.
+  \retval size_t Number of bytes that can be written at ptr.
+ */
+{
+    size_t room = mask + 1 - (staged - tail_cache);
+    if (!room) {
+        tail_cache = tail.load(std::memory_order_acquire);
+        room = mask + 1 - (staged - tail_cache);
+    }
+    size_t pos = staged & mask;
+    if (room > mask + 1 - pos)
+        room = mask + 1 - pos;
+    *ptr = buffer + pos;
+    return room;
+}
+// -------------------------------------------------------------------------------------------------
+void
+SpscRing::commit(size_t len, bool pub)
+/*! Producer: adds len bytes written into the span.
+  \param pub Make the data visible to consumer now. Otherwise it waits for publish().
+ */
+{
+    staged += len;
+    if (pub)
+        publish();
+}
+// -------------------------------------------------------------------------------------------------
+void
+SpscRing::publish()
+{
+    head.store(staged, std::memory_order_release);
+    if (efd >= 0) {
+        // Pairs with the fence in read_wait. Either we see the waiting flag or consumer sees head.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed))
+            wake();
+    }
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+SpscRing::write(const void* data, size_t len)
+//! Producer: copies as much as fits and publishes it with single store.
+{
+    const char* src = (const char*)data;
+    size_t total = 0;
+    char* ptr;
+    while (len) {
+        size_t span = write_span(&ptr);
+        if (!span)
+            break;
+        if (span > len)
+            span = len;
+        memcpy(ptr, src, span);
+        commit(span, false);
+        src += span;
+        len -= span;
+        total += span;
+    }
+    if (total)
+        publish();
+    return total;
+}
+// -------------------------------------------------------------------------------------------------
+void
+SpscRing::close()
+//! Producer: no more data will follow. Wakes up the consumer.
+{
+    publish();
+    closed.store(true, std::memory_order_release);
+    if (efd >= 0)
+        wake();
+}
+// -------------------------------------------------------------------------------------------------
+void
+SpscRing::wake()
+{
+    uint64_t one = 1;
+    if (::write(efd, &one, sizeof(one)) == -1) {
+        // Counter is already signalled.
+    }
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+SpscRing::read_span(const char** ptr)
+/*! Consumer: gives contiguous published data at read position. Call consume when done with it.
+  \retval size_t Number of bytes at ptr.
+ */
+{
+    size_t pos = tail.load(std::memory_order_relaxed);
+    size_t avail = head_cache - pos;
+    if (!avail) {
+        head_cache = head.load(std::memory_order_acquire);
+        avail = head_cache - pos;
+    }
+    size_t off = pos & mask;
+    if (avail > mask + 1 - off)
+        avail = mask + 1 - off;
+    *ptr = buffer + off;
+    return avail;
+}
+// -------------------------------------------------------------------------------------------------
+void
+SpscRing::consume(size_t len)
+{
+    tail.store(tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+SpscRing::read(void* data, size_t len)
+//! Consumer: copies available data and releases the space with single store.
+{
+    char* dst = (char*)data;
+    size_t pos = tail.load(std::memory_order_relaxed);
+    size_t total = 0;
+    while (len) {
+        size_t avail = head_cache - pos;
+        if (!avail) {
+            head_cache = head.load(std::memory_order_acquire);
+            avail = head_cache - pos;
+            if (!avail)
+                break;
+        }
+        size_t off = pos & mask;
+        if (avail > mask + 1 - off)
+            avail = mask + 1 - off;
+        if (avail > len)
+            avail = len;
+        memcpy(dst, buffer + off, avail);
+        dst += avail;
+        pos += avail;
+        len -= avail;
+        total += avail;
+    }
+    if (total)
+        tail.store(pos, std::memory_order_release);
+    return total;
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+SpscRing::read_wait(void* data, size_t len, int timeout_ms)
+/*! Consumer: like read but sleeps until data is published, the ring is closed or the timeout
+  expires. Requires that the ring was created with wait.
+  \param timeout_ms Max wait, -1 = no limit.
+ */
+{
+    size_t rd = read(data, len);
+    if (rd || efd == -1 || is_closed())
+        return rd;
+    waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (head.load(std::memory_order_relaxed) == tail.load(std::memory_order_relaxed) &&
+        !is_closed()) {
+        pollfd pfd;
+        pfd.fd = efd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, timeout_ms);
+    }
+    uint64_t count;
+    if (::read(efd, &count, sizeof(count)) == -1) {
+        // Nothing was signalled.
+    }
+    waiting.store(false, std::memory_order_relaxed);
+    return read(data, len);
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+SpscRing::size() const
+{
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+} // namespace fcgi_driver
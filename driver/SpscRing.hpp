@@ -0,0 +1,72 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_SPSCRING_HPP
+#define FCGI_SPSCRING_HPP
+
+#include <atomic>
+#include <stddef.h>
+
+namespace fcgi_driver {
+
+const size_t SPSC_CACHE_LINE = 64;
+
+/*! Lock-free byte ring for exactly one producer thread and one consumer thread. Use this instead
+  of RingBuffer with RB_THREAD_SAFE when handing request data between a reactor thread and a
+  worker. Head and tail live on separate cache lines and each side keeps a cached copy of the
+  other's index so that the shared lines are touched only when the cached view runs out.
+  Producer can stage several writes with commit(len, false) and make them visible at once with
+  publish(). With wait enabled the consumer can block in read_wait on an eventfd.
+ */
+class SpscRing
+{
+  public:
+    SpscRing(size_t capacity, bool wait = false);
+    ~SpscRing();
+
+    // Producer side
+    size_t write(const void*, size_t);
+    size_t write_span(char** ptr);
+    void commit(size_t len, bool publish = true);
+    void publish();
+    void close();
+
+    // Consumer side
+    size_t read(void*, size_t);
+    size_t read_wait(void*, size_t, int timeout_ms);
+    size_t read_span(const char** ptr);
+    void consume(size_t len);
+    bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+    size_t size() const;
+    size_t max_size() const { return mask + 1; }
+    int event_fd() const { return efd; } //!< Readable when consumer should wake up. -1 if no wait.
+
+  protected:
+    void wake();
+
+    // Producer owned line.
+    alignas(SPSC_CACHE_LINE) std::atomic<size_t> head; // Published write position.
+    size_t staged;                                     // Written but not yet published.
+    size_t tail_cache;                                 // Producer's view of tail.
+    // Consumer owned line.
+    alignas(SPSC_CACHE_LINE) std::atomic<size_t> tail; // Read position.
+    size_t head_cache;                                 // Consumer's view of head.
+    std::atomic<bool> waiting;                         // Consumer is about to sleep.
+    // Read only after construction.
+    alignas(SPSC_CACHE_LINE) char* buffer;
+    size_t mask;
+    int efd;
+    std::atomic<bool> closed;
+
+  private:
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+};
+
+} // namespace fcgi_driver
+
+#endif
@@ -0,0 +1,300 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Driver.hpp"
+#include "Stats.hpp"
+
+namespace fcgi_driver {
+
+const char* Stats::phase_names[SP_COUNT] = { "admit",   "params_wait", "params", "body",
+                                             "handler", "output",      "close",  "total" };
+
+static const double stat_quantiles[] = { 50, 90, 99, 99.9 };
+
+static void
+appendf(std::string& out, const char* fmt, ...)
+{
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len > 0)
+        out.append(line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+}
+
+// -------------------------------------------------------------------------------------------------
+//# StatsPage
+
+//! Handler that answers the statistics page requests.
+class StatsPage : public Handler
+{
+  public:
+    explicit StatsPage(Stats* _stats)
+      : stats(_stats)
+    {
+        setName("fcgi-stats");
+    }
+    void exec(Request*) override {}
+    void done(Request* req) override
+    {
+        std::string out;
+        // Query string has been parsed into parameters.
+        const char* format = req->params.get("format", 6);
+        if (format && !strcmp(format, "prometheus")) {
+            req->write("Content-Type: text/plain; version=0.0.4\r\n"
+                       "Cache-Control: no-store\r\n\r\n");
+            stats->printPrometheus(out);
+        } else {
+            req->write("Content-Type: text/plain\r\nCache-Control: no-store\r\n\r\n");
+            stats->printText(out);
+        }
+        for (size_t pos = 0; pos < out.size(); pos += 0x1000) {
+            size_t len = out.size() - pos;
+            req->write(out.data() + pos, len > 0x1000 ? 0x1000 : len);
+        }
+        req->end();
+    }
+
+  protected:
+    Stats* stats;
+};
+
+// -------------------------------------------------------------------------------------------------
+//# Stats
+
+Stats::Stats(Driver* _driver, const char* page_uri, bool _local_only)
+/*! \param _driver Driver whose request counts are shown.
+  \param page_uri Path of the statistics page, e.g. "/fcgi-stats".
+  \param _local_only Answer only requests whose REMOTE_ADDR is a loopback address.
+ */
+  : driver(_driver)
+  , uri(page_uri ? page_uri : "")
+  , local_only(_local_only)
+{
+    page = new StatsPage(this);
+    start_us = stat_clock();
+    memset(&counters, 0, sizeof(counters));
+}
+// -------------------------------------------------------------------------------------------------
+Stats::~Stats()
+{
+    for (HandlerStat* hs : handlers)
+        delete hs;
+    delete page;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Stats::match(Request* req)
+/*! Checks if the request is for the statistics page and gives it the page handler.
+  \retval bool False if the request goes to the application.
+ */
+{
+    if (uri.empty())
+        return false;
+    const char* req_uri = req->getURI();
+    if (strncmp(req_uri, uri.c_str(), uri.size()) ||
+        (req_uri[uri.size()] && req_uri[uri.size()] != '?'))
+        return false;
+    if (local_only) {
+        const char* addr = req->params.get(HASH_REMOTE_ADDR);
+        if (*addr && strncmp(addr, "127.", 4) && strcmp(addr, "::1"))
+            return false;
+    }
+    req->handler = page;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+void
+Stats::record(const uint64_t* marks, Handler* handler)
+/*! Records the phases of a closed request. Phases whose marks are missing or out of order (e.g.
+  handler sent output before its input was complete) are left out.
+  \param marks Request's times indexed with stat_mark_t.
+  \param handler Handler that served the request, null if it was rejected.
+ */
+{
+    // Phase n is the time from mark n to mark n+1.
+    for (int sp = SP_ADMIT; sp < SP_TOTAL; sp++) {
+        if (marks[sp] && marks[sp + 1] >= marks[sp])
+            phases[sp].record(marks[sp + 1] - marks[sp]);
+    }
+    if (marks[SM_ACCEPT] && marks[SM_CLOSE] >= marks[SM_ACCEPT])
+        phases[SP_TOTAL].record(marks[SM_CLOSE] - marks[SM_ACCEPT]);
+    if (handler && marks[SM_START] && marks[SM_EOF] >= marks[SM_START])
+        findHandler(handler)->latency.record(marks[SM_EOF] - marks[SM_START]);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Stats::reset()
+{
+    memset(&counters, 0, sizeof(counters));
+    for (int sp = 0; sp < SP_COUNT; sp++)
+        phases[sp].reset();
+    for (HandlerStat* hs : handlers)
+        hs->latency.reset();
+    start_us = stat_clock();
+}
+// -------------------------------------------------------------------------------------------------
+Stats::HandlerStat*
+Stats::findHandler(Handler* handler)
+{
+    for (HandlerStat* hs : handlers) {
+        if (hs->handler == handler)
+            return hs;
+    }
+    HandlerStat* hs = new HandlerStat();
+    hs->handler = handler;
+    if (handler->getName())
+        hs->name = handler->getName();
+    else {
+        char name[24];
+        sprintf(name, "handler%lu", handlers.size() + 1);
+        hs->name = name;
+    }
+    // Label values are quoted in Prometheus output.
+    for (char& ch : hs->name) {
+        if (ch == '"' || ch == '\\' || ch < ' ')
+            ch = '_';
+    }
+    handlers.push_back(hs);
+    return hs;
+}
+// -------------------------------------------------------------------------------------------------
+static void
+textRow(std::string& out, const char* name, const Histogram& hist)
+{
+    appendf(out, "%-16s %10lu %10.0f", name, hist.getCount(), hist.getMean());
+    for (double qt : stat_quantiles)
+        appendf(out, " %10lu", hist.percentile(qt));
+    appendf(out, " %10lu\n", hist.getMax());
+}
+
+void
+Stats::printText(std::string& out)
+//! Appends the statistics as text. Times are in microseconds.
+{
+    LimitStats ls;
+    uint32_t in_use = driver->getRequestCount() - driver->getFreeRequestCount();
+    appendf(out, "libfcgi %s statistics, uptime %lu s\n\n", Driver::version(),
+            (stat_clock() - start_us) / 1000000);
+    appendf(out, "requests:  served %u, in use %u / %u, waiting %lu, rejected %u\n",
+            driver->getServedCount(), in_use, driver->getRequestCount(),
+            driver->getWaitingCount(), driver->getRejectedCount());
+    if (driver->getLimitStats(&ls)) {
+        appendf(out, "limit:     %u, inflight %u, rtt %lu us, baseline %lu us\n", ls.limit,
+                ls.inflight, ls.rtt_short, ls.rtt_long);
+    }
+    appendf(out, "bytes:     in %lu, out %lu\n", counters.bytes_in, counters.bytes_out);
+    appendf(out,
+            "events:    spool to disk %lu, flush stalls %lu, aborts %lu, out of slot %lu, "
+            "5xx %lu\n\n",
+            counters.spool_disk, counters.flush_stalls, counters.aborts, counters.out_of_slot,
+            counters.status_5xx);
+    appendf(out, "%-16s %10s %10s %10s %10s %10s %10s %10s\n", "phase (us)", "count", "mean",
+            "p50", "p90", "p99", "p99.9", "max");
+    for (int sp = 0; sp < SP_COUNT; sp++)
+        textRow(out, phase_names[sp], phases[sp]);
+    if (handlers.empty())
+        return;
+    appendf(out, "\n%-16s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "handler (us)", "count",
+            "mean", "p50", "p90", "p99", "p99.9", "max", "active", "rejects");
+    for (HandlerStat* hs : handlers) {
+        textRow(out, hs->name.c_str(), hs->latency);
+        out.pop_back();
+        appendf(out, " %10u %10u\n", hs->handler->getActive(), hs->handler->getLimitRejects());
+    }
+}
+// -------------------------------------------------------------------------------------------------
+static void
+promHeader(std::string& out, const char* name, const char* type, const char* help)
+{
+    appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+promSummary(std::string& out, const char* name, const char* label, const char* value,
+            const Histogram& hist)
+{
+    for (double qt : stat_quantiles) {
+        appendf(out, "%s{%s=\"%s\",quantile=\"%g\"} %lu\n", name, label, value, qt / 100,
+                hist.percentile(qt));
+    }
+    appendf(out, "%s_sum{%s=\"%s\"} %.0f\n", name, label, value,
+            hist.getMean() * hist.getCount());
+    appendf(out, "%s_count{%s=\"%s\"} %lu\n", name, label, value, hist.getCount());
+}
+
+void
+Stats::printPrometheus(std::string& out)
+//! Appends the statistics in Prometheus text exposition format.
+{
+    struct
+    {
+        const char* name;
+        const char* help;
+        uint64_t value;
+    } counter_list[] = {
+        { "fcgi_requests_served_total", "Requests started.", driver->getServedCount() },
+        { "fcgi_requests_rejected_total", "Connections rejected by admission control.",
+          driver->getRejectedCount() },
+        { "fcgi_bytes_in_total", "Bytes read from web server.", counters.bytes_in },
+        { "fcgi_bytes_out_total", "Bytes written to web server.", counters.bytes_out },
+        { "fcgi_spool_disk_total", "Request bodies spooled to disk.", counters.spool_disk },
+        { "fcgi_flush_stalls_total", "Flushes that waited for the socket.", counters.flush_stalls },
+        { "fcgi_aborts_total", "Requests aborted by web server.", counters.aborts },
+        { "fcgi_out_of_slot_total", "Connections that found no free request.",
+          counters.out_of_slot },
+        { "fcgi_status_5xx_total", "Requests ended with 5xx status.", counters.status_5xx },
+    };
+    for (auto& cl : counter_list) {
+        promHeader(out, cl.name, "counter", cl.help);
+        appendf(out, "%s %lu\n", cl.name, cl.value);
+    }
+    promHeader(out, "fcgi_uptime_seconds", "gauge", "Time since statistics were started.");
+    appendf(out, "fcgi_uptime_seconds %lu\n", (stat_clock() - start_us) / 1000000);
+    promHeader(out, "fcgi_requests_in_use", "gauge", "Requests that are not free.");
+    appendf(out, "fcgi_requests_in_use %u\n",
+            driver->getRequestCount() - driver->getFreeRequestCount());
+    promHeader(out, "fcgi_requests_max", "gauge", "Number of requests.");
+    appendf(out, "fcgi_requests_max %u\n", driver->getRequestCount());
+    promHeader(out, "fcgi_admit_waiting", "gauge", "Connections waiting in admit queue.");
+    appendf(out, "fcgi_admit_waiting %lu\n", driver->getWaitingCount());
+    LimitStats ls;
+    if (driver->getLimitStats(&ls)) {
+        promHeader(out, "fcgi_limit", "gauge", "Adaptive concurrency limit.");
+        appendf(out, "fcgi_limit %u\n", ls.limit);
+        promHeader(out, "fcgi_limit_inflight", "gauge", "Max requests in progress last window.");
+        appendf(out, "fcgi_limit_inflight %u\n", ls.inflight);
+        promHeader(out, "fcgi_limit_rtt_us", "gauge", "Latency of the last window.");
+        appendf(out, "fcgi_limit_rtt_us %lu\n", ls.rtt_short);
+        promHeader(out, "fcgi_limit_baseline_us", "gauge", "Latency baseline.");
+        appendf(out, "fcgi_limit_baseline_us %lu\n", ls.rtt_long);
+    }
+    promHeader(out, "fcgi_phase_latency_us", "summary", "Request phase latency.");
+    for (int sp = 0; sp < SP_COUNT; sp++)
+        promSummary(out, "fcgi_phase_latency_us", "phase", phase_names[sp], phases[sp]);
+    if (handlers.empty())
+        return;
+    promHeader(out, "fcgi_handler_latency_us", "summary", "Handler response time.");
+    for (HandlerStat* hs : handlers)
+        promSummary(out, "fcgi_handler_latency_us", "handler", hs->name.c_str(), hs->latency);
+    promHeader(out, "fcgi_handler_active", "gauge", "Requests in handler.");
+    for (HandlerStat* hs : handlers) {
+        appendf(out, "fcgi_handler_active{handler=\"%s\"} %u\n", hs->name.c_str(),
+                hs->handler->getActive());
+    }
+    promHeader(out, "fcgi_handler_rejects_total", "counter", "Rejects by handler's limit.");
+    for (HandlerStat* hs : handlers) {
+        appendf(out, "fcgi_handler_rejects_total{handler=\"%s\"} %u\n", hs->name.c_str(),
+                hs->handler->getLimitRejects());
+    }
+}
+
+} // namespace fcgi_driver
@@ -0,0 +1,117 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_STATS_HPP
+#define FCGI_STATS_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "Histogram.hpp"
+
+namespace fcgi_driver {
+
+class Driver;
+class Handler;
+class Request;
+
+//! Points in the request lifecycle. Request keeps the time of each, see Request::mark.
+enum stat_mark_t
+{
+    SM_ACCEPT, // Connection accepted; start of the wait in admit queue.
+    SM_START,  // Request slot assigned to the connection.
+    SM_PARAMS, // First PARAMS record.
+    SM_EXEC,   // Parameters complete, handler's exec.
+    SM_DONE,   // Input complete, handler's done.
+    SM_STDOUT, // First STDOUT data sent.
+    SM_EOF,    // Response sent, RQS_EOF.
+    SM_CLOSE,  // Connection closed.
+    SM_COUNT
+};
+
+//! Time between two marks. SP_TOTAL is from accept to close.
+enum stat_phase_t
+{
+    SP_ADMIT,      // SM_ACCEPT - SM_START
+    SP_PARAMSWAIT, // SM_START - SM_PARAMS
+    SP_PARAMS,     // SM_PARAMS - SM_EXEC
+    SP_BODY,       // SM_EXEC - SM_DONE
+    SP_HANDLER,    // SM_DONE - SM_STDOUT
+    SP_OUTPUT,     // SM_STDOUT - SM_EOF
+    SP_CLOSE,      // SM_EOF - SM_CLOSE
+    SP_TOTAL,
+    SP_COUNT
+};
+
+struct StatCounters
+{
+    uint64_t bytes_in;     // Read from web server connections.
+    uint64_t bytes_out;    // Written to web server connections.
+    uint64_t spool_disk;   // Request bodies that outgrew the memory spool.
+    uint64_t flush_stalls; // Request::flush calls that had to wait for the socket.
+    uint64_t aborts;       // ABORT_REQUEST records.
+    uint64_t out_of_slot;  // Connections that did not get a request at once.
+    uint64_t status_5xx;   // Requests ended with status 500-599.
+};
+
+inline uint64_t
+stat_clock()
+//! Monotonic time in microseconds.
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*! Request lifecycle statistics: latency histograms per phase and per handler plus event
+  counters. Driver creates this with Driver::enableStats and serves the statistics page itself,
+  as plain text or, with query format=prometheus, in Prometheus text exposition format.
+ */
+class Stats
+{
+  public:
+    Stats(Driver* driver, const char* page_uri, bool local_only);
+    ~Stats();
+
+    bool match(Request*);
+    void record(const uint64_t* marks, Handler*);
+    void reset();
+
+    void printText(std::string& out);
+    void printPrometheus(std::string& out);
+
+    const Histogram& getPhase(stat_phase_t sp) { return phases[sp]; }
+    static const char* phase_names[SP_COUNT];
+
+    StatCounters counters;
+
+  protected:
+    struct HandlerStat
+    {
+        Handler* handler;
+        std::string name;
+        Histogram latency; // SM_START - SM_EOF
+    };
+    HandlerStat* findHandler(Handler*);
+
+    Driver* driver;
+    std::string uri;
+    bool local_only;
+    Handler* page;
+    Histogram phases[SP_COUNT];
+    std::vector<HandlerStat*> handlers;
+    uint64_t start_us;
+
+  private:
+    Stats(const Stats&);
+    Stats& operator=(const Stats&);
+};
+
+} // namespace fcgi_driver
+
+#endif
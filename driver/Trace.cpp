@@ -0,0 +1,174 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <mutex>
+#include <vector>
+
+#include "Trace.hpp"
+
+namespace fcgi_driver {
+
+static const char TRC_MAGIC[8] = "FCGITRC";
+
+// Duration pairs have the same name.
+const char* Tracer::event_names[TE_COUNT] = {
+    "accept", "queue", "reject", "start", "begin", "read",  "record", "exec",
+    "exec",   "exec_wait",       "done",  "done",  "send",  "flush",  "end",
+    "abort",  "spool", "eof",    "close", "work",  "work",  "disk",   "disk"
+};
+
+std::atomic<bool> Tracer::on(false);
+
+/*! Ring of one thread. Only the owner writes; dump reads the published head. Rings are kept after
+  their thread exits so that its last events can still be dumped.
+ */
+struct TraceRing
+{
+    uint64_t tid;
+    uint32_t mask;
+    uint32_t gen;               // Generation of the last reset, see Tracer::enable.
+    std::atomic<uint64_t> head; // Records written since reset.
+    TraceRecord* recs;
+};
+
+static std::mutex ring_mtx; // Guards the list, not the rings.
+static std::vector<TraceRing*> rings;
+static std::atomic<uint32_t> ring_gen(0);
+static uint32_t ring_size = TRACE_RECORDS;
+static uint64_t tsc_start;
+static uint64_t ns_start;
+static thread_local TraceRing* my_ring = 0;
+
+static uint64_t
+mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+// -------------------------------------------------------------------------------------------------
+uint64_t
+Tracer::clock()
+//! Time stamp counter where available, monotonic nanoseconds elsewhere.
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return mono_ns();
+#endif
+}
+// -------------------------------------------------------------------------------------------------
+void
+Tracer::enable(uint32_t records)
+/*! Starts tracing. Rings of all threads are emptied on their next event.
+  \param records Ring size of threads that have not traced yet. Rounded up to a power of two.
+ */
+{
+    {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        uint32_t size = 64;
+        while (size < records && size < 0x4000000)
+            size <<= 1;
+        ring_size = size;
+        tsc_start = clock();
+        ns_start = mono_ns();
+    }
+    ring_gen.fetch_add(1, std::memory_order_release);
+    on.store(true, std::memory_order_relaxed);
+}
+// -------------------------------------------------------------------------------------------------
+void
+Tracer::put(trace_event_t ev, int fd, uint8_t state, uint16_t slot, uint32_t arg, uint32_t aux)
+//! Adds a record into the calling thread's ring. Use TRACE_EVENT instead of calling directly.
+{
+    TraceRing* ring = my_ring;
+    uint32_t gen = ring_gen.load(std::memory_order_acquire);
+    if (!ring) {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        ring = new TraceRing();
+        ring->tid = syscall(SYS_gettid);
+        ring->mask = ring_size - 1;
+        ring->gen = gen;
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->recs = new TraceRecord[ring_size];
+        rings.push_back(ring);
+        my_ring = ring;
+    } else if (ring->gen != gen) {
+        ring->gen = gen;
+        ring->head.store(0, std::memory_order_release);
+    }
+    uint64_t pos = ring->head.load(std::memory_order_relaxed);
+    TraceRecord& rec = ring->recs[pos & ring->mask];
+    rec.tsc = clock();
+    rec.fd = fd;
+    rec.arg = arg;
+    rec.aux = aux;
+    rec.slot = slot;
+    rec.event = ev;
+    rec.state = state;
+    ring->head.store(pos + 1, std::memory_order_release);
+}
+// -------------------------------------------------------------------------------------------------
+bool
+Tracer::dump(const char* fname)
+/*! Writes the rings of all threads into a file. Tracing may continue meanwhile; records that the
+  writers overwrite during the copy are dropped and counted as lost.
+  \param fname Output file. Existing file is overwritten.
+ */
+{
+    FILE* out = fopen(fname, "w");
+    if (!out)
+        return false;
+    std::lock_guard<std::mutex> lock(ring_mtx);
+    TraceFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRC_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.threads = rings.size();
+    uint64_t ns = mono_ns() - ns_start;
+    hdr.ticks_per_us = ns ? (clock() - tsc_start) * 1000.0 / ns : 1;
+    hdr.tsc_start = tsc_start;
+    hdr.pid = getpid();
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+
+    std::vector<TraceRecord> copy;
+    for (TraceRing* ring : rings) {
+        uint64_t size = ring->mask + 1;
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > size ? head - size : 0;
+        copy.resize(head - first);
+        for (uint64_t pos = first; pos < head; pos++)
+            copy[pos - first] = ring->recs[pos & ring->mask];
+        // Writer may have been overwriting the oldest records during the copy, including the
+        // record it is writing now.
+        uint64_t after = ring->head.load(std::memory_order_acquire);
+        uint64_t skip = 0;
+        if (after < head)
+            skip = copy.size(); // Ring was reset.
+        else if (after + 1 > first + size)
+            skip = after + 1 - size - first;
+        if (skip > copy.size())
+            skip = copy.size();
+        TraceThreadHeader th;
+        th.tid = ring->tid;
+        th.count = copy.size() - skip;
+        th.lost = first + skip;
+        ok = ok && fwrite(&th, sizeof(th), 1, out) == 1;
+        if (th.count)
+            ok = ok && fwrite(copy.data() + skip, sizeof(TraceRecord), th.count, out) == th.count;
+    }
+    return fclose(out) == 0 && ok;
+}
+
+} // namespace fcgi_driver
@@ -0,0 +1,113 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_TRACE_HPP
+#define FCGI_TRACE_HPP
+
+#include <atomic>
+#include <stdint.h>
+
+namespace fcgi_driver {
+
+const uint32_t TRACE_RECORDS = 0x10000; // Default ring size per thread (records).
+const uint32_t TRACE_VERSION = 1;
+const uint16_t TRACE_NO_SLOT = 0xFFFF;
+
+//! Traced events. Events with _END pair are durations, the rest are instants.
+enum trace_event_t
+{
+    TE_ACCEPT,    // Scheduler accepted a connection.
+    TE_QUEUE,     // Connection waits in admit queue. aux = queue length.
+    TE_REJECT,    // Connection rejected.
+    TE_START,     // Request slot assigned to the connection.
+    TE_BEGIN,     // BEGIN_REQUEST record. arg = served count.
+    TE_READ,      // arg = bytes read.
+    TE_RECORD,    // Record processed. arg = type, aux = content length.
+    TE_EXEC,      // Handler's exec.
+    TE_EXEC_END,  //
+    TE_EXEC_WAIT, // Handler at its concurrency limit.
+    TE_DONE,      // Handler's done.
+    TE_DONE_END,  //
+    TE_SEND,      // arg = bytes written.
+    TE_FLUSH,     // Request::flush had to wait for the socket. arg = send rounds.
+    TE_END,       // Request::end. arg = application status.
+    TE_ABORT,     // ABORT_REQUEST record.
+    TE_SPOOL,     // Request body moved from memory to file spool.
+    TE_EOF,       // Response sent.
+    TE_CLOSE,     // Connection closed.
+    TE_WORK,      // Driver::work. arg = ready requests.
+    TE_WORK_END,  //
+    TE_DISK,      // DiskWriter batch. arg = blocks.
+    TE_DISK_END,  //
+    TE_COUNT
+};
+
+struct TraceRecord
+{
+    uint64_t tsc;  // Tracer::clock()
+    int32_t fd;    // Connection, -1 if none.
+    uint32_t arg;  // Event specific, see trace_event_t.
+    uint32_t aux;  // Event specific.
+    uint16_t slot; // Request slot, TRACE_NO_SLOT if none.
+    uint8_t event; // trace_event_t
+    uint8_t state; // req_state_t
+};
+static_assert(sizeof(TraceRecord) == 24, "TraceRecord is written as is into trace files");
+
+struct TraceFileHeader
+{
+    char magic[8]; // "FCGITRC\0"
+    uint32_t version;
+    uint32_t threads;    // Number of TraceThreadHeader + records blocks that follow.
+    double ticks_per_us; // Tracer::clock ticks in a microsecond.
+    uint64_t tsc_start;  // Tracer::clock at enable.
+    uint64_t pid;
+};
+
+struct TraceThreadHeader
+{
+    uint64_t tid;
+    uint64_t count; // Records that follow, oldest first.
+    uint64_t lost;  // Older records overwritten in the ring.
+};
+
+/*! Per thread binary flight recorder. Each thread writes fixed size records into its own ring
+  without locks; when the ring is full the oldest records are overwritten. Tracing can be switched
+  on and off at run time and costs one predictable branch when off, so the TRACE_EVENT points stay
+  in release builds. dump() writes the rings into a file that test/fcgitrace.cxx converts into
+  Chrome / Perfetto trace JSON. The text TRACE of UNIT_TEST builds is not affected.
+ */
+class Tracer
+{
+  public:
+    static void enable(uint32_t records = TRACE_RECORDS);
+    static void disable() { on.store(false, std::memory_order_relaxed); }
+    static bool isOn() { return on.load(std::memory_order_relaxed); }
+    static bool dump(const char* fname);
+
+    static void put(trace_event_t,
+                    int fd,
+                    uint8_t state,
+                    uint16_t slot,
+                    uint32_t arg,
+                    uint32_t aux);
+    static uint64_t clock();
+
+    static const char* event_names[TE_COUNT];
+
+  protected:
+    static std::atomic<bool> on;
+};
+
+} // namespace fcgi_driver
+
+#define TRACE_EVENT(ev, fd, state, slot, arg, aux)                                                 \
+    do {                                                                                           \
+        if (__builtin_expect(fcgi_driver::Tracer::isOn(), 0))                                      \
+            fcgi_driver::Tracer::put(ev, fd, state, slot, arg, aux);                               \
+    } while (0)
+
+#endif
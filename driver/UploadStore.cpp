@@ -0,0 +1,659 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include <cpp4scripts.hpp>
+
+#include "fcgidriver.hpp"
+#include "UploadStore.hpp"
+
+extern FILE* trace;
+
+using namespace std;
+using namespace c4s;
+
+namespace fcgi_driver {
+
+// -------------------------------------------------------------------------------------------------
+UploadFile::UploadFile()
+{
+    memset(fldname, 0, sizeof(fldname));
+    memset(internal, 0, sizeof(internal));
+    memset(external, 0, sizeof(external));
+    memset(blob, 0, sizeof(blob));
+    bytes = 0;
+    fd = -1;
+    mem = 0;
+    mem_size = 0;
+    reserve = 0;
+    ticket = 0;
+    named = false;
+    claimed = false;
+    error = false;
+}
+// -------------------------------------------------------------------------------------------------
+UploadFile::UploadFile(const UploadFile& orig)
+{
+    memcpy(fldname, orig.fldname, sizeof(fldname));
+    memcpy(internal, orig.internal, sizeof(internal));
+    memcpy(external, orig.external, sizeof(external));
+    memcpy(blob, orig.blob, sizeof(blob));
+    bytes = orig.bytes;
+    fd = orig.fd >= 0 ? dup(orig.fd) : -1;
+    mem = 0;
+    mem_size = 0;
+    if (orig.mem) {
+        mem = new char[orig.mem_size];
+        mem_size = orig.mem_size;
+        memcpy(mem, orig.mem, orig.bytes);
+    }
+    reserve = orig.reserve;
+    ticket = 0;
+    named = orig.named;
+    // Copies never remove the original file.
+    claimed = true;
+    error = orig.error;
+    digest = orig.digest;
+}
+// -------------------------------------------------------------------------------------------------
+UploadFile::~UploadFile()
+{
+    if (fd >= 0)
+        close(fd);
+    if (mem)
+        delete[] mem;
+}
+
+// -------------------------------------------------------------------------------------------------
+UploadStore::UploadStore()
+{
+    writer = 0;
+    mem_limit = UPLOAD_MEM_DEFAULT;
+    digests = DIGEST_NONE;
+    cas = false;
+    tmpfile_ok = true;
+}
+// -------------------------------------------------------------------------------------------------
+void
+UploadStore::setContentAddressed(bool on)
+//! Turns content addressed storage on or off. Blobs are keyed by SHA-256 which is then enabled.
+{
+    cas = on;
+    if (cas)
+        digests |= DIGEST_SHA256;
+}
+// -------------------------------------------------------------------------------------------------
+void
+UploadStore::open(UploadFile* up, size_t reserve)
+/*! Prepares the upload for writing.
+  \param reserve Expected maximum size. When it exceeds memory limit the file is opened and the
+  space preallocated right away.
+ */
+{
+    up->reserve = reserve;
+    up->digest.begin(digests);
+    if (reserve > mem_limit)
+        spill(up);
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+UploadStore::write(UploadFile* up, const char* data, size_t len)
+/*! Appends data into upload. Write errors are recorded into upload's error flag. Digests are
+  updated while the data is still in cache.
+  \retval size_t Always len. The data is consumed even if it cannot be stored.
+ */
+{
+    up->digest.update(data, len);
+    return put(up, data, len);
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+UploadStore::put(UploadFile* up, const char* data, size_t len)
+{
+    if (up->error || !len)
+        return len;
+    if (up->fd == -1) {
+        if (up->bytes + len <= mem_limit) {
+            if (up->bytes + len > up->mem_size) {
+                size_t ns = up->mem_size ? up->mem_size * 2 : 0x400;
+                while (ns < up->bytes + len)
+                    ns *= 2;
+                if (ns > mem_limit)
+                    ns = mem_limit;
+                char* nm = new char[ns];
+                if (up->mem) {
+                    memcpy(nm, up->mem, up->bytes);
+                    delete[] up->mem;
+                }
+                up->mem = nm;
+                up->mem_size = ns;
+            }
+            memcpy(up->mem + up->bytes, data, len);
+            up->bytes += len;
+            return len;
+        }
+        if (!spill(up))
+            return len;
+    }
+    if (writer && up->ticket) {
+        // Written in the background. Errors are reported through the ticket.
+        up->bytes += writer->write(up->ticket, up->fd, up->bytes, data, len);
+        return len;
+    }
+    size_t left = len;
+    while (left) {
+        ssize_t bw = ::write(up->fd, data, left);
+        if (bw == -1) {
+            if (errno == EINTR)
+                continue;
+            TRACE("UploadStore::write - write error %d for %s\n", errno, up->fldname);
+            up->error = true;
+            break;
+        }
+        data += bw;
+        left -= bw;
+    }
+    up->bytes += len - left;
+    return len;
+}
+// -------------------------------------------------------------------------------------------------
+void
+UploadStore::finish(UploadFile* up)
+//! Completes the digests and releases the preallocated space that was not needed.
+{
+    up->digest.end();
+    if (up->fd >= 0 && up->reserve > up->bytes) {
+        if (ftruncate(up->fd, up->bytes) == -1) {
+            TRACE("UploadStore::finish - truncate failed %d\n", errno);
+        }
+        up->reserve = 0;
+    }
+}
+// -------------------------------------------------------------------------------------------------
+bool
+UploadStore::materialize(UploadFile* up, const char* target)
+/*! Gives the upload a permanent name. File data is renamed or linked into place or, for a
+  duplicate backed by a blob, reflinked or copied so that the target can be modified without
+  touching the blob. In content addressed mode the target is then recorded as a reference to its
+  blob, and the data of a new file upload is added into the store.
+  \param target Full path to target file. If null the upload's internal name is used.
+ */
+{
+    bool rv = false;
+    if (!target || !target[0])
+        target = up->internal;
+    if (up->error) {
+        CS_VAPRT_ERRO("UploadStore::materialize - upload %s is incomplete.", up->fldname);
+        return false;
+    }
+    finish(up);
+    bool in_mem = up->fd == -1 && !up->named && !up->blob[0];
+    if (up->blob[0]) {
+        rv = cloneFile(up->blob, up->bytes, target);
+    } else if (in_mem) {
+        // Memory held data is written once, directly into target.
+        int fd = ::open(target, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (fd == -1) {
+            CS_VAPRT_ERRO("UploadStore::materialize - unable to create %s; errno %d", target, errno);
+            return false;
+        }
+        size_t left = up->bytes;
+        char* ptr = up->mem;
+        while (left) {
+            ssize_t bw = ::write(fd, ptr, left);
+            if (bw == -1) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            ptr += bw;
+            left -= bw;
+        }
+        close(fd);
+        rv = left == 0;
+    } else if (up->named) {
+        if (!strcmp(up->internal, target))
+            rv = true;
+        else if (rename(up->internal, target) == 0)
+            rv = true;
+        else if (errno == EXDEV && copyFile(up, target)) {
+            unlink(up->internal);
+            rv = true;
+        }
+    } else {
+        rv = linkFile(up, target);
+        if (!rv && errno == EXDEV)
+            rv = copyFile(up, target);
+    }
+    if (!rv) {
+        CS_VAPRT_ERRO("UploadStore::materialize - unable to store %s into %s; errno %d",
+                      up->fldname, target, errno);
+        return false;
+    }
+    TRACE("UploadStore::materialize - %s => %s (%ld bytes)\n", up->fldname, target, up->bytes);
+    if (target != up->internal)
+        snprintf(up->internal, sizeof(up->internal), "%s", target);
+    if (cas && !in_mem) {
+        if (up->blob[0])
+            addRef(up->blob, up->internal);
+        else
+            addBlob(up, up->internal);
+    }
+    if (up->fd >= 0) {
+        close(up->fd);
+        up->fd = -1;
+    }
+    if (up->mem) {
+        delete[] up->mem;
+        up->mem = 0;
+        up->mem_size = 0;
+    }
+    up->blob[0] = 0;
+    up->named = true;
+    up->claimed = true;
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+UploadStore::intern(UploadFile* up)
+/*! Checks a completed file upload against the content addressed store. If the blob already exists
+  the upload's own data is dropped and the upload is backed by the blob. Otherwise the upload keeps
+  its own file, which materialize renames into place and then adds into the store. Uploads held in
+  memory are left as they are.
+  \retval bool True if upload is now backed by a blob.
+ */
+{
+    char blob[REQ_MAX_URI];
+    struct stat st;
+
+    if (!cas || up->error || up->blob[0] || (up->fd == -1 && !up->named))
+        return false;
+    finish(up);
+    if (!up->digest.has(DIGEST_SHA256) || !blobPath(up->digest, blob, sizeof(blob), true))
+        return false;
+    if (stat(blob, &st) == -1 || (size_t)st.st_size != up->bytes)
+        return false;
+    TRACE("UploadStore::intern - %s is duplicate of %s\n", up->fldname, blob);
+    // Refresh the time so that collect() does not remove the blob before it is used.
+    utimensat(AT_FDCWD, blob, NULL, 0);
+    if (up->named)
+        unlink(up->internal);
+    if (up->fd >= 0) {
+        close(up->fd);
+        up->fd = -1;
+    }
+    up->named = false;
+    strcpy(up->blob, blob);
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+UploadStore::collect(time_t min_age)
+/*! Removes the blobs that no materialized file refers to any more, see addRef. Stale references
+  are dropped on the way. Driver runs this periodically while it is idle.
+  \param min_age Blobs modified within this many seconds are kept. Running requests may still
+  materialize them.
+  \retval size_t Number of removed blobs.
+ */
+{
+    std::string casdir(path);
+    casdir += "cas/";
+    DIR* top = opendir(casdir.c_str());
+    if (!top)
+        return 0;
+    time_t limit = time(0) - min_age;
+    size_t removed = 0;
+    struct dirent* sub;
+    struct stat st;
+    while ((sub = readdir(top)) != 0) {
+        if (sub->d_name[0] == '.')
+            continue;
+        std::string subdir(casdir + sub->d_name + "/");
+        DIR* dir = opendir(subdir.c_str());
+        if (!dir)
+            continue;
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != 0) {
+            if (ent->d_name[0] == '.')
+                continue;
+            std::string blob(subdir + ent->d_name);
+            if (stat(blob.c_str(), &st) == -1 || !S_ISREG(st.st_mode) || st.st_mtime > limit)
+                continue;
+            if (!countRefs(blob, st.st_size) && unlink(blob.c_str()) == 0)
+                removed++;
+        }
+        closedir(dir);
+    }
+    closedir(top);
+    TRACE("UploadStore::collect - removed %ld blobs\n", removed);
+    return removed;
+}
+// -------------------------------------------------------------------------------------------------
+ssize_t
+UploadStore::read(UploadFile* up, size_t offset, char* buf, size_t len)
+/*! Reads upload data wherever it is held: memory, upload file, blob or materialized file. Use this
+  instead of opening 'internal', which names the data only after materialize.
+  \param offset Position in the upload data.
+  \retval ssize_t Bytes read, 0 at the end of data, -1 on error (errno is set).
+ */
+{
+    if (up->error) {
+        errno = EIO;
+        return -1;
+    }
+    if (offset >= up->bytes)
+        return 0;
+    if (len > up->bytes - offset)
+        len = up->bytes - offset;
+    if (up->fd == -1 && !up->named && !up->blob[0]) {
+        if (!up->mem) {
+            errno = EBADF;
+            return -1;
+        }
+        memcpy(buf, up->mem + offset, len);
+        return len;
+    }
+    if (up->fd >= 0)
+        return pread(up->fd, buf, len, offset);
+    int fd = ::open(up->blob[0] ? up->blob : up->internal, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t br = pread(fd, buf, len, offset);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return br;
+}
+// -------------------------------------------------------------------------------------------------
+void
+UploadStore::release(UploadFile* up)
+//! Frees the upload resources. Named files that were never materialized are removed.
+{
+    if (up->named && !up->claimed) {
+        TRACE("UploadStore::release - removing abandoned %s\n", up->internal);
+        unlink(up->internal);
+    }
+    up->named = false;
+    if (up->fd >= 0) {
+        close(up->fd);
+        up->fd = -1;
+    }
+    if (up->mem) {
+        delete[] up->mem;
+        up->mem = 0;
+        up->mem_size = 0;
+    }
+}
+// -------------------------------------------------------------------------------------------------
+bool
+UploadStore::spill(UploadFile* up)
+//! Moves the memory held data into the upload file.
+{
+    if (openFile(up) == -1) {
+        CS_VAPRT_ERRO("UploadStore::spill - Unable to create upload file for %s; errno %d",
+                      up->fldname, errno);
+        up->error = true;
+        return false;
+    }
+    if (up->reserve > up->bytes) {
+        if (fallocate(up->fd, FALLOC_FL_KEEP_SIZE, 0, up->reserve) == -1) {
+            TRACE("UploadStore::spill - fallocate %ld not available (%d)\n", up->reserve, errno);
+        }
+    }
+    if (up->mem) {
+        size_t held = up->bytes;
+        up->bytes = 0;
+        put(up, up->mem, held);
+        delete[] up->mem;
+        up->mem = 0;
+        up->mem_size = 0;
+    }
+    return !up->error;
+}
+// -------------------------------------------------------------------------------------------------
+int
+UploadStore::openFile(UploadFile* up)
+{
+#ifdef O_TMPFILE
+    if (tmpfile_ok) {
+        up->fd = ::open(path.empty() ? "." : path.c_str(), O_TMPFILE | O_RDWR,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (up->fd >= 0)
+            return up->fd;
+        // File system does not support anonymous files. Use named files from now on.
+        if (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL) {
+            CS_PRINT_WARN("UploadStore::openFile - O_TMPFILE not supported in upload dir.");
+            tmpfile_ok = false;
+        }
+    }
+#endif
+    up->fd = ::open(up->internal, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (up->fd >= 0)
+        up->named = true;
+    return up->fd;
+}
+// -------------------------------------------------------------------------------------------------
+static int
+link_fd(int fd, const char* name)
+{
+    char procpath[32];
+    if (linkat(fd, "", AT_FDCWD, name, AT_EMPTY_PATH) == 0)
+        return 0;
+    if (errno == EEXIST || errno == EXDEV)
+        return -1;
+    // AT_EMPTY_PATH requires CAP_DAC_READ_SEARCH. Go through procfs instead.
+    sprintf(procpath, "/proc/self/fd/%d", fd);
+    return linkat(AT_FDCWD, procpath, AT_FDCWD, name, AT_SYMLINK_FOLLOW);
+}
+
+bool
+UploadStore::linkFile(UploadFile* up, const char* target)
+{
+    static unsigned long tmpndx = 0;
+    char tmpname[REQ_MAX_URI + 32];
+
+    if (link_fd(up->fd, target) == 0)
+        return true;
+    if (errno != EEXIST)
+        return false;
+    // Existing target is replaced atomically: link under temporary name and rename over it.
+    snprintf(tmpname, sizeof(tmpname), "%s.%d_%lu", target, getpid(), ++tmpndx);
+    if (link_fd(up->fd, tmpname) == -1)
+        return false;
+    if (rename(tmpname, target) == -1) {
+        int err = errno;
+        unlink(tmpname);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+UploadStore::copyFile(UploadFile* up, const char* target)
+//! Copies data into another file system.
+{
+    int src = up->fd;
+    if (src == -1) {
+        src = ::open(up->internal, O_RDONLY);
+        if (src == -1)
+            return false;
+    }
+    int tgt = ::open(target, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tgt == -1) {
+        if (src != up->fd)
+            close(src);
+        return false;
+    }
+    off_t offset = 0;
+    ssize_t bc = 0;
+    while ((size_t)offset < up->bytes) {
+        bc = sendfile(tgt, src, &offset, up->bytes - offset);
+        if (bc <= 0)
+            break;
+    }
+    int err = errno;
+    close(tgt);
+    if (src != up->fd)
+        close(src);
+    if ((size_t)offset < up->bytes) {
+        unlink(target);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+UploadStore::blobPath(const Digest& dg, char* blob, size_t size, bool create)
+//! Forms the blob name <path>cas/ab/cdef... and optionally creates the directories for it.
+{
+    std::string hex = dg.sha256Hex();
+    int len = snprintf(blob, size, "%scas/%.2s/%s", path.c_str(), hex.c_str(), hex.c_str() + 2);
+    if (len < 0 || (size_t)len >= size)
+        return false;
+    if (create) {
+        std::string dir(path);
+        dir += "cas";
+        if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG) == -1 && errno != EEXIST)
+            return false;
+        dir += '/';
+        dir.append(hex, 0, 2);
+        if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG) == -1 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+UploadStore::cloneFile(const char* source, size_t bytes, const char* target)
+/*! Makes target a copy of source. Reflink shares the data blocks copy-on-write; where the file
+  system does not support it the data is copied. Hard links are not used: the target would share
+  the inode with the blob and writes to it would change the content of every later duplicate.
+  Target is replaced atomically so that an existing file is never seen truncated.
+ */
+{
+    static unsigned long tmpndx = 0;
+    char tmpname[REQ_MAX_URI + 32];
+    bool rv = false;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.%d_%lu", target, getpid(), ++tmpndx);
+    int src = ::open(source, O_RDONLY);
+    if (src == -1)
+        return false;
+    int tgt = ::open(tmpname, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tgt == -1) {
+        close(src);
+        return false;
+    }
+#ifdef FICLONE
+    rv = ioctl(tgt, FICLONE, src) == 0;
+#endif
+    if (!rv) {
+        off_t offset = 0;
+        while ((size_t)offset < bytes && sendfile(tgt, src, &offset, bytes - offset) > 0)
+            ;
+        rv = (size_t)offset == bytes;
+    }
+    int err = errno;
+    close(tgt);
+    close(src);
+    if (rv && rename(tmpname, target) == 0)
+        return true;
+    err = rv ? errno : err;
+    unlink(tmpname);
+    errno = err;
+    return false;
+}
+// -------------------------------------------------------------------------------------------------
+bool
+UploadStore::addBlob(UploadFile* up, const char* target)
+/*! Stores the data of a materialized upload into the content addressed store so that later
+  uploads of the same content can be deduplicated against it. Target itself stays as it is.
+ */
+{
+    char blob[REQ_MAX_URI];
+    struct stat st;
+
+    if (!up->digest.has(DIGEST_SHA256) || !blobPath(up->digest, blob, sizeof(blob), true))
+        return false;
+    if (stat(blob, &st) == -1 || (size_t)st.st_size != up->bytes) {
+        if (!cloneFile(target, up->bytes, blob)) {
+            CS_VAPRT_WARN("UploadStore::addBlob - unable to store %s as %s; errno %d", target,
+                          blob, errno);
+            return false;
+        }
+        TRACE("UploadStore::addBlob - %s stored as %s\n", target, blob);
+    }
+    return addRef(blob, target);
+}
+// -------------------------------------------------------------------------------------------------
+bool
+UploadStore::addRef(const char* blob, const char* target)
+/*! Records target as a reference to blob: <blob>.refs/<hash of target path> is a symbolic link to
+  target. The link does not keep the target alive; collect() drops references whose target has
+  been removed or replaced with other data.
+ */
+{
+    char real[PATH_MAX];
+    char ref[REQ_MAX_URI + 32];
+
+    if (!realpath(target, real))
+        return false;
+    int len = snprintf(ref, sizeof(ref), "%s.refs", blob);
+    if (len < 0 || (size_t)len >= sizeof(ref))
+        return false;
+    if (mkdir(ref, S_IRWXU | S_IRWXG) == -1 && errno != EEXIST)
+        return false;
+    snprintf(ref + len, sizeof(ref) - len, "/%016lx", fnv_64bit_hash(real, strlen(real)));
+    if (symlink(real, ref) == -1 && errno != EEXIST) {
+        CS_VAPRT_WARN("UploadStore::addRef - unable to create %s; errno %d", ref, errno);
+        return false;
+    }
+    return true;
+}
+// -------------------------------------------------------------------------------------------------
+size_t
+UploadStore::countRefs(const std::string& blob, size_t bytes)
+//! Counts the valid references of a blob. Stale references are removed.
+{
+    std::string refdir(blob + ".refs/");
+    DIR* dir = opendir(refdir.c_str());
+    if (!dir)
+        return 0;
+    size_t count = 0;
+    struct dirent* ent;
+    struct stat st;
+    while ((ent = readdir(dir)) != 0) {
+        if (ent->d_name[0] == '.')
+            continue;
+        std::string ref(refdir + ent->d_name);
+        // stat follows the link to the materialized file.
+        int rc = stat(ref.c_str(), &st);
+        if (rc == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == bytes)
+            count++;
+        else if (rc == 0 || errno == ENOENT || errno == ENOTDIR)
+            unlink(ref.c_str());
+    }
+    closedir(dir);
+    if (!count)
+        rmdir(refdir.c_str());
+    return count;
+}
+} // namespace fcgi_driver
@@ -0,0 +1,114 @@
+/* This file is part of Fast CGI C++ library (libfcgi)
+ * https://github.com/jaaskelainen-aj/libfcgi/wiki
+ *
+ * Copyright (c) 2021: Antti Jääskeläinen
+ * License: http://www.gnu.org/licenses/lgpl-2.1.html
+ */
+#ifndef FCGI_UPLOADSTORE_HPP
+#define FCGI_UPLOADSTORE_HPP
+
+#include <string>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "../fcgisettings.h"
+#include "DiskWriter.hpp"
+#include "Digest.hpp"
+
+namespace fcgi_driver {
+
+const uint16_t REQ_MAX_FILENAME = 96;
+const uint16_t REQ_MAX_URI = 255;
+const size_t UPLOAD_MEM_DEFAULT = 0x4000;
+
+/*! Single uploaded file. Data is kept in memory until it exceeds the store's memory limit. After
+  that it is written into an anonymous (O_TMPFILE) file in upload directory. The file gets a name
+  only when it is materialized with UploadStore::materialize. Unclaimed uploads disappear when the
+  request is cleared. Before materialize the data is read with UploadStore::read
+  (Request::readUpload); 'internal' is only a reserved name and the file may not exist.
+ */
+struct UploadFile
+{
+    UploadFile();
+    UploadFile(const UploadFile&);
+    ~UploadFile();
+
+    bool isAnonymous() const { return fd >= 0 && !named; }
+    bool isInterned() const { return blob[0] != 0; }
+    bool inMemory() const { return fd == -1 && mem; }
+    bool isMaterialized() const { return named && claimed; }
+
+    char fldname[DRIVER_MPFIELD];
+    char internal[REQ_MAX_URI]; // Path of the data only after materialize, see isMaterialized.
+    char external[REQ_MAX_FILENAME];
+    char blob[REQ_MAX_URI]; // Blob holding the data of a duplicate. Empty if not interned.
+    size_t bytes;
+
+    int fd;           // Open upload file, -1 while data is in memory.
+    char* mem;        // Memory held data.
+    size_t mem_size;  // Allocated size of mem.
+    size_t reserve;   // Expected maximum size of upload (from CONTENT_LENGTH), 0 = unknown.
+    DWTicket* ticket; // Request's asynchronous writes, if writer is in use.
+    bool named;       // File in 'internal' exists in the file system.
+    bool claimed;     // Named file has been materialized and it must not be removed.
+    bool error;       // Write failed, content is not complete.
+    Digest digest;    // Digests calculated while the data was written. Final after finish().
+
+  private:
+    UploadFile& operator=(const UploadFile&);
+};
+
+/*! Stores the uploads of all requests. In content addressed mode materialized file uploads are
+  also kept in <path>cas/xx/<sha256>, so that a later upload of the same content is not stored
+  again but reflinked (or copied) from the blob. Each materialized file is recorded as a reference
+  under <blob>.refs/ and collect() removes the blobs that have no valid references left.
+ */
+class UploadStore
+{
+  public:
+    UploadStore();
+
+    void setPath(const std::string& dir) { path = dir; }
+    const std::string& getPath() const { return path; }
+    void setMemLimit(size_t ml) { mem_limit = ml; }
+    size_t getMemLimit() const { return mem_limit; }
+    void setWriter(DiskWriter* dw) { writer = dw; }
+    void setDigests(int algos) { digests = algos; }
+    int getDigests() const { return digests; }
+    void setContentAddressed(bool on);
+    bool isContentAddressed() const { return cas; }
+
+    void open(UploadFile*, size_t reserve);
+    size_t write(UploadFile*, const char* data, size_t len);
+    void finish(UploadFile*);
+    bool materialize(UploadFile*, const char* target);
+    ssize_t read(UploadFile*, size_t offset, char* buf, size_t len);
+    void release(UploadFile*);
+    bool intern(UploadFile*);
+    size_t collect(time_t min_age);
+
+  protected:
+    size_t put(UploadFile*, const char* data, size_t len);
+    bool spill(UploadFile*);
+    int openFile(UploadFile*);
+    bool linkFile(UploadFile*, const char* target);
+    bool copyFile(UploadFile*, const char* target);
+    bool blobPath(const Digest&, char* blob, size_t size, bool create);
+    bool cloneFile(const char* source, size_t bytes, const char* target);
+    bool addBlob(UploadFile*, const char* target);
+    bool addRef(const char* blob, const char* target);
+    size_t countRefs(const std::string& blob, size_t bytes);
+
+    std::string path;
+    DiskWriter* writer;
+    size_t mem_limit;
+    int digests; // digest_t values calculated for uploads.
+    bool cas;    // Content addressed storage under <path>cas/
+    bool tmpfile_ok;
+};
+
+} // namespace fcgi_driver
+
+#endif
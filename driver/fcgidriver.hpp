@@ -59,7 +59,8 @@ enum html_type_t
     HTML_POST = 2,
     HTML_PUT = 3,
     HTML_DELETE = 4,
-    HTML_PATCH = 5
+    HTML_PATCH = 5,
+    HTML_HEAD = 6
 };
 enum req_state_t
 {
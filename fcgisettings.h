@@ -7,13 +7,15 @@
 #ifndef FCGI_SETTINGS_H
 #define FCGI_SETTINGS_H
 
-// Max values for driver
+// Max values for driver. DRIVER_PARAMKEYS and DRIVER_POLL_FD are defaults of DriverLimits that
+// can be changed in LibFCGI configuration (ParamKeys, MaxRequests).
 #define DRIVER_PARAMKEYS 75
 #define DRIVER_PARAMNAME 100
 #define DRIVER_MPFIELD 50
 #define DRIVER_POLL_FD 30
 
-// Max values for framework
+// Max values for framework. FRAME_POSTKEYS and FRAME_POSTDATA are defaults for PostKeys and
+// PostData configuration values.
 #define FRAME_LOCALES 4
 #define FRAME_POSTKEYS 40
 #define FRAME_POSTDATA 0x8000
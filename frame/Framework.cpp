@@ -5,6 +5,7 @@
  * License: http://www.gnu.org/licenses/lgpl-2.1.html
  */
 #include <signal.h>
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <syslog.h>
@@ -17,6 +18,7 @@
 #include "../fcgisettings.h"
 #include "../driver/fcgidriver.hpp"
 #include "Framework.hpp"
+#include "PostData.hpp"
 
 //- extern c4s::configuration conf;
 //- extern int WEB_VERNUM;
@@ -98,6 +100,21 @@ Framework::Framework(const std::string& home_dir, SessionFactoryIF* sf, c4s::con
         SessionBase::login_cookie[sizeof(SessionBase::login_cookie) - 1] = 0;
     } else
         strcpy(SessionBase::login_cookie, "webapp_login");
+    uint64_t limit;
+    if (conf->get_value("LibFCGI", "PostKeys", limit)) {
+        if (limit >= 8 && limit <= 4096)
+            PostData::max_keys = limit;
+        else
+            syslog(LOG_WARNING, "Framework::Framework - PostKeys %lu out of bounds [8, 4096].",
+                   limit);
+    }
+    if (conf->get_value("LibFCGI", "PostData", limit)) {
+        if (limit >= 0x400 && limit <= 0x1000000)
+            PostData::max_data = limit;
+        else
+            syslog(LOG_WARNING, "Framework::Framework - PostData %lu out of bounds [1k, 16M].",
+                   limit);
+    }
     // ..................................................
     // Start initializations
     try {
@@ -302,6 +319,8 @@ Framework::escapeHtml(const std::string& orig)
 #endif
     if (orig.size() == 0)
         return "";
+    if (!esc_buffer)
+        esc_buffer = new char[esc_len];
     escapeHtml(esc_buffer, orig.c_str());
     return esc_buffer;
 }
@@ -332,6 +351,8 @@ Framework::escapeHtml(char* target, const char* orig)
 const char*
 Framework::escapeJson(const std::string& orig)
 {
+    if (!esc_buffer)
+        esc_buffer = new char[esc_len];
     char* target = esc_buffer;
     for (string::const_iterator si = orig.begin(); si != orig.end(); si++) {
         if (*si == '"') {
@@ -352,12 +373,19 @@ Framework::escapeJson(const std::string& orig)
 // -------------------------------------------------------------------------------------------------
 bool
 Framework::moveUploadedFile(fcgi_driver::Request* req, const char* label, const char* target)
+/*! Moves uploaded file into its permanent location. The file is linked or renamed into place and
+  copied only when target resides in another file system.
+  \param label Upload form field name or name of the parameter that holds "file|..." value.
+ */
 {
     char* pipe = 0;
     if (!label || !target) {
         return false;
     }
     CS_VAPRT_DEBU("Framework::moveUploadedFile - %s", target);
+    fcgi_driver::UploadFile* up = req->findUpload(label);
+    if (up)
+        return req->moveUpload(up, target);
     const char* field = req->params.get(label, strlen(label));
     if (!field[0]) {
         CS_VAPRT_DEBU("Framework::moveUploadedFile - label %s not found.", label);
@@ -368,7 +396,15 @@ Framework::moveUploadedFile(fcgi_driver::Request* req, const char* label, const
         if (pipe) {
             *pipe = 0;
             c4s::path source(upload_dir, field);
-            source.cp(c4s::path(target), c4s::PCF_FORCE | c4s::PCF_MOVE);
+            // Rename within the file system, copy only across file systems.
+            if (rename(source.get_pp(), target) == -1) {
+                if (errno != EXDEV) {
+                    CS_VAPRT_ERRO("Framework::moveUploadedFile - rename %s failed; errno %d",
+                                  field, errno);
+                    return false;
+                }
+                source.cp(c4s::path(target), c4s::PCF_FORCE | c4s::PCF_MOVE);
+            }
         } else {
             CS_VAPRT_DEBU("Framework::moveUploadedFile - unable to find pipe from: %s", field);
             return false;
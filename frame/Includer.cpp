@@ -127,7 +127,7 @@ Includer::toHtml(const char* fname, ostringstream& html)
         }
         return false;
     }
-    max = fcgi_driver::REQ_MAX_OUT - html.tellp();
+    max = fcgi_driver::Request::getOutCapacity() - html.tellp();
     // original_max = max;
     total = 0;
     do {
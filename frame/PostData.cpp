@@ -15,21 +15,63 @@ using namespace fcgi_driver;
 
 namespace fcgi_frame {
 
+size_t PostData::max_keys = FRAME_POSTKEYS;
+size_t PostData::max_data = FRAME_POSTDATA;
+
 // -------------------------------------------------------------------------------------------------
 PostData::PostData()
+  : arena(0)
+{
+    init();
+}
+PostData::PostData(fcgi_driver::Arena* _arena)
+/*! \param _arena Take buffers from request's arena, e.g. &req->getArena(). Object must not
+  outlive the request.
+ */
+  : arena(_arena)
+{
+    init();
+}
+// -------------------------------------------------------------------------------------------------
+PostData::~PostData()
+{
+    freeBuffer(value_buffer);
+    if (!arena) {
+        delete[] key_array;
+        delete[] value_array;
+    }
+}
+// -------------------------------------------------------------------------------------------------
+void
+PostData::init()
 {
     value_buffer = 0;
     vb_len = 0;
     count = 0;
     dummy = 0;
-    memset(key_array, 0, sizeof(key_array));
-    memset(value_array, 0, sizeof(value_array));
+    key_cap = max_keys;
+    if (arena) {
+        key_array = (uint64_t*)arena->alloc(key_cap * sizeof(uint64_t), alignof(uint64_t));
+        value_array = (const char**)arena->alloc(key_cap * sizeof(const char*), alignof(char*));
+    } else {
+        key_array = new uint64_t[key_cap];
+        value_array = new const char*[key_cap];
+    }
+    memset(key_array, 0, key_cap * sizeof(uint64_t));
+    memset(value_array, 0, key_cap * sizeof(const char*));
 }
 // -------------------------------------------------------------------------------------------------
-PostData::~PostData()
+char*
+PostData::allocBuffer(size_t len)
 {
-    if (value_buffer)
-        delete[] value_buffer;
+    return arena ? (char*)arena->alloc(len, 1) : new char[len];
+}
+// -------------------------------------------------------------------------------------------------
+void
+PostData::freeBuffer(char* buffer)
+{
+    if (buffer && !arena)
+        delete[] buffer;
 }
 // -------------------------------------------------------------------------------------------------
 void
@@ -41,22 +83,21 @@ PostData::set(const char* data)
     size_t dlen;
     if (data) {
         dlen = strlen(data);
-        if (dlen > FRAME_POSTDATA)
+        if (dlen > max_data)
             throw std::runtime_error("PostData::set - Max data size exceeded.");
         // Reserve memory if needed.
         // \TODO: some memory would be saved if we take into account that keys are removed.
         if (dlen > vb_len) {
-            if (value_buffer)
-                delete[] value_buffer;
-            value_buffer = new char[dlen];
+            freeBuffer(value_buffer);
+            value_buffer = allocBuffer(dlen);
             vb_len = dlen;
         }
     }
 
     // Initialize buffers and pointers
     memset(value_buffer, 0, vb_len);
-    memset(key_array, 0, sizeof(key_array));
-    memset(value_array, 0, sizeof(value_array));
+    memset(key_array, 0, key_cap * sizeof(uint64_t));
+    memset(value_array, 0, key_cap * sizeof(const char*));
     count = 0;
     if (!data)
         return;
@@ -87,7 +128,7 @@ PostData::set(const char* data)
                 count++;
                 state = KEY;
                 ch_ndx = 0;
-                if (count == FRAME_POSTKEYS)
+                if (count == key_cap)
                     throw std::runtime_error("PostData::set - Max key count exceeded.");
             } else if (*ptr == '%') {
                 *valptr = (char)hex2byte(ptr + 1);
@@ -126,7 +167,7 @@ PostData::get(const char* key)
 const char*
 PostData::get(int ndx)
 {
-    if (ndx < 0 || ndx >= FRAME_POSTKEYS)
+    if (ndx < 0 || (size_t)ndx >= key_cap)
         return &dummy;
     return value_array[ndx];
 }
@@ -137,19 +178,23 @@ PostData::add(const char* key, const char* value)
     size_t ndx;
     PACK64 pack;
     // Check if we have room for this new value
-    if (count + 1 == FRAME_POSTKEYS)
+    if (count + 1 == key_cap)
         throw std::runtime_error("PostData::add - Max key count exceeded.");
     size_t vlen = strlen(value);
     size_t cursize = strlen(value_array[count - 1]) + (value_array[count - 1] - value_buffer);
-    if (vlen + cursize > FRAME_POSTDATA)
+    if (vlen + cursize > max_data)
         throw std::runtime_error("PostData::add - Max data size exceeded.");
     // If not, reserve more and swap buffers.
     if (vlen + cursize > vb_len) {
         vb_len = vlen + cursize + 20;
-        char* newbuffer = new char[vb_len];
+        char* newbuffer = allocBuffer(vb_len);
         memset(newbuffer, 0, vb_len);
         memcpy(newbuffer, value_buffer, cursize);
-        delete[] value_buffer;
+        for (ndx = 0; ndx < count; ndx++) {
+            if (value_array[ndx])
+                value_array[ndx] = newbuffer + (value_array[ndx] - value_buffer);
+        }
+        freeBuffer(value_buffer);
         value_buffer = newbuffer;
     }
     // Copy value
@@ -8,6 +8,7 @@
 #define FCGI_POSTDATA_HPP
 
 #include "../fcgisettings.h"
+#include "../driver/Arena.hpp"
 
 namespace fcgi_frame {
 
@@ -15,6 +16,7 @@ class PostData
 {
   public:
     PostData();
+    explicit PostData(fcgi_driver::Arena* arena);
     ~PostData();
     void set(const char* data);
     const char* get(const char* key);
@@ -29,12 +31,22 @@ class PostData
         KEY,
         VALUE
     };
+    void init();
+    char* allocBuffer(size_t len);
+    void freeBuffer(char* buffer);
+
+    fcgi_driver::Arena* arena; // If set, buffers live until the request ends.
     char* value_buffer;
     size_t vb_len;
-    uint64_t key_array[FRAME_POSTKEYS];
-    const char* value_array[FRAME_POSTKEYS];
+    uint64_t* key_array;
+    const char** value_array;
+    size_t key_cap; // Size of key and value arrays.
     size_t count;
     char dummy;
+
+  public:
+    static size_t max_keys; // FRAME_POSTKEYS or PostKeys from configuration.
+    static size_t max_data; // FRAME_POSTDATA or PostData from configuration.
 };
 
 } // namespace fcgi_frame
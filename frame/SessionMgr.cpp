@@ -26,6 +26,13 @@ using namespace c4s;
 
 namespace fcgi_frame {
 
+// -------------------------------------------------------------------------------------------------
+void
+SessionFactoryIF::destroySession(SessionBase* b)
+//! Default for sessions created with new. Defined here where SessionBase is complete.
+{
+    delete b;
+}
 // -------------------------------------------------------------------------------------------------
 SessionMgr::SessionMgr(const string& exe_dir,
                        const c4s::path& keyfile,
@@ -167,7 +174,7 @@ SessionMgr::initializeSession(fcgi_driver::Request* req)
                    "SessionMgr::initializeSession - Header sid:%s\n", sid);
     }
     if (!sid || !sid[0]) {
-        base = sesfactory->createSession(0);
+        base = sesfactory->createSession(0, req->getArena());
         base->setSID();
         if (CONF_facility) {
             syslog(LOG_MAKEPRI(CONF_facility, LOG_NOTICE),
@@ -182,7 +189,7 @@ SessionMgr::initializeSession(fcgi_driver::Request* req)
         CONF_session_dir.set_ext(".ses");
         FILE* sfile = fopen(CONF_session_dir.get_path().c_str(), "rb");
         if (sfile) {
-            base = sesfactory->createSession(sfile);
+            base = sesfactory->createSession(sfile, req->getArena());
             strncpy(base->sid, sid, FRAME_SID);
             base->sid[FRAME_SID] = 0;
             req->app_data = base;
@@ -205,7 +212,7 @@ SessionMgr::initializeSession(fcgi_driver::Request* req)
             }
             base->start = now;
         } else {
-            base = sesfactory->createSession(0);
+            base = sesfactory->createSession(0, req->getArena());
             base->setSID();
             if (CONF_facility)
                 syslog(LOG_MAKEPRI(CONF_facility, LOG_NOTICE),
@@ -263,7 +270,7 @@ SessionMgr::closeSession(fcgi_driver::Request* req)
     if (CONF_facility)
         syslog(LOG_MAKEPRI(CONF_facility, LOG_NOTICE), "SessionMgr::closeSession - time %ld\n",
                base->start);
-    delete base;
+    sesfactory->destroySession(base);
     req->app_data = 0;
 }
 // -------------------------------------------------------------------------------------------------
@@ -21,6 +21,14 @@ class SessionFactoryIF
   public:
     virtual ~SessionFactoryIF() {}
     virtual SessionBase* createSession(FILE* session_file) = 0;
+    /*! Override both of these to place sessions into request's arena, e.g.
+      return arena.make<MySession>(session_file); and b->~SessionBase(); respectively.
+     */
+    virtual SessionBase* createSession(FILE* session_file, fcgi_driver::Arena&)
+    {
+        return createSession(session_file);
+    }
+    virtual void destroySession(SessionBase* b);
     virtual int loginSession(fcgi_driver::Request* req) = 0;
     virtual int loginClientCert(SessionBase* , CC cert_dn) = 0;
     virtual void logoutSession(fcgi_driver::Request* req) = 0;
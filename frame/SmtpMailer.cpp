@@ -152,9 +152,10 @@ SmtpMsg::initializeSend(SmtpMailer* _m)
         CS_PRINT_ERRO("SmtpMsg::initializeSend - body too large to encode.");
         return false;
     }
-    char* base64 = mailer->getScratchBuffer(encoded_size);
-    size_t rv = base64_encode(base64, encoded_size, (const unsigned char*)body_buffer, body.tellp(),
-                              Base64Type::URL);
+    // Encoder terminates the output with zero.
+    char* base64 = mailer->getScratchBuffer(encoded_size + 1);
+    size_t rv = base64_encode(base64, encoded_size + 1, (const unsigned char*)body_buffer,
+                              body.tellp(), Base64Type::URL);
     if (rv == 0) {
         CS_PRINT_ERRO("SmtpMsg::initializeSend - encoding failed.");
         return false;
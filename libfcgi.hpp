@@ -11,7 +11,18 @@
 
 #include "driver/fcgidriver.hpp"
 #include "driver/RingBuffer.hpp"
+#include "driver/SpscRing.hpp"
+#include "driver/Arena.hpp"
 #include "driver/ParamData.hpp"
+#include "driver/DiskWriter.hpp"
+#include "driver/AdaptiveLimit.hpp"
+#include "driver/Capture.hpp"
+#include "driver/Digest.hpp"
+#include "driver/Histogram.hpp"
+#include "driver/Stats.hpp"
+#include "driver/ShmStats.hpp"
+#include "driver/Trace.hpp"
+#include "driver/UploadStore.hpp"
 #include "driver/Request.hpp"
 #include "driver/Driver.hpp"
 #include "driver/Scheduler.hpp"
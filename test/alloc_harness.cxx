@@ -0,0 +1,413 @@
+/***
+Compile:
+g++ -o alloc_harness alloc_harness.cxx -O2 -fno-rtti -Wno-reorder -Wnon-virtual-dtor -DC4S_LOG_LEVEL=1 -I/usr/local/include/cpp4scripts -L/usr/local/lib -L../release -lfcgi -lc4s -ldl
+
+./alloc_harness [-n requests] [-w warmup] [-max allocs]
+
+Runs canned FastCGI requests through Driver::read / work / write over a socketpair and counts
+heap allocations, allocated bytes and system calls made by the library per request. Counting is
+off while the harness itself talks to the socket. Exit status is 1 if any scenario allocates more
+than -max times per request after warm up (default 0) on top of the data buffers it needs.
+
+Scope is the driver only: Driver, Request, ParamData and UploadStore. The Framework layer
+(PostData, Includer, SessionMgr) is not built or run; the include file scenario sends the file
+with Request::writeFd directly, which is what Includer::toRequest does after opening it.
+ */
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <new>
+
+#include "../driver/Driver.hpp"
+
+using namespace fcgi_driver;
+
+// -------------------------------------------------------------------------------------------------
+// Interposed allocation functions and system calls.
+
+static bool counting = false;
+static uint64_t n_alloc = 0, n_bytes = 0, n_free = 0, n_sys = 0;
+
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void __libc_free(void*);
+
+extern "C" void*
+malloc(size_t size)
+{
+    if (counting) {
+        n_alloc++;
+        n_bytes += size;
+    }
+    return __libc_malloc(size);
+}
+extern "C" void*
+calloc(size_t num, size_t size)
+{
+    if (counting) {
+        n_alloc++;
+        n_bytes += num * size;
+    }
+    return __libc_calloc(num, size);
+}
+extern "C" void*
+realloc(void* ptr, size_t size)
+{
+    if (counting) {
+        n_alloc++;
+        n_bytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+extern "C" void
+free(void* ptr)
+{
+    if (counting && ptr)
+        n_free++;
+    __libc_free(ptr);
+}
+
+void*
+operator new(size_t size)
+{
+    void* ptr = malloc(size);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+void*
+operator new[](size_t size)
+{
+    return operator new(size);
+}
+void
+operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+void
+operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+void
+operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+void
+operator delete[](void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+#define SYSCALL(ret, name, params, args)                                                           \
+    extern "C" ret name params                                                                     \
+    {                                                                                              \
+        static ret(*real) params = 0;                                                              \
+        if (!real)                                                                                 \
+            real = (ret(*) params)dlsym(RTLD_NEXT, #name);                                         \
+        if (counting)                                                                              \
+            n_sys++;                                                                               \
+        return real args;                                                                          \
+    }
+
+SYSCALL(ssize_t, read, (int fd, void* buf, size_t len), (fd, buf, len))
+SYSCALL(ssize_t, write, (int fd, const void* buf, size_t len), (fd, buf, len))
+SYSCALL(ssize_t, writev, (int fd, const struct iovec* iov, int cnt), (fd, iov, cnt))
+SYSCALL(ssize_t, send, (int fd, const void* buf, size_t len, int fl), (fd, buf, len, fl))
+SYSCALL(ssize_t, recv, (int fd, void* buf, size_t len, int fl), (fd, buf, len, fl))
+SYSCALL(int, poll, (struct pollfd * fds, nfds_t cnt, int tmo), (fds, cnt, tmo))
+SYSCALL(int, close, (int fd), (fd))
+SYSCALL(int, shutdown, (int fd, int how), (fd, how))
+SYSCALL(int, fsync, (int fd), (fd))
+SYSCALL(int, fdatasync, (int fd), (fd))
+SYSCALL(off_t, lseek, (int fd, off_t off, int wh), (fd, off, wh))
+
+extern "C" int
+open(const char* path, int flags, ...)
+{
+    static int (*real)(const char*, int, ...) = 0;
+    if (!real)
+        real = (int (*)(const char*, int, ...))dlsym(RTLD_NEXT, "open");
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list vl;
+        va_start(vl, flags);
+        mode = va_arg(vl, int);
+        va_end(vl);
+    }
+    if (counting)
+        n_sys++;
+    return real(path, flags, mode);
+}
+
+// -------------------------------------------------------------------------------------------------
+// Canned traffic.
+
+struct Record
+{
+    char data[0x20000];
+    size_t len;
+
+    Record() { len = 0; }
+    void add(message_type_t type, const void* content, size_t clen)
+    {
+        Header hdr(type, 1, clen);
+        memcpy(data + len, &hdr, sizeof(hdr));
+        memcpy(data + len + sizeof(hdr), content, clen);
+        len += sizeof(hdr) + clen;
+    }
+    void begin()
+    {
+        BeginRequestMsg brm;
+        brm.role.set(RESPONDER);
+        add(TYPE_BEGIN_REQUEST, &brm, sizeof(brm));
+    }
+    void params(const char** nv)
+    {
+        char buffer[0x2000];
+        size_t pos = 0;
+        for (; *nv; nv += 2) {
+            size_t nl = strlen(nv[0]), vl = strlen(nv[1]);
+            buffer[pos++] = nl;
+            buffer[pos++] = vl;
+            memcpy(buffer + pos, nv[0], nl);
+            memcpy(buffer + pos + nl, nv[1], vl);
+            pos += nl + vl;
+        }
+        add(TYPE_PARAMS, buffer, pos);
+        add(TYPE_PARAMS, 0, 0);
+    }
+    void body(const char* content, size_t blen)
+    {
+        for (size_t pos = 0; pos < blen; pos += 0x8000)
+            add(TYPE_STDIN, content + pos, blen - pos > 0x8000 ? 0x8000 : blen - pos);
+        add(TYPE_STDIN, 0, 0);
+    }
+};
+
+enum scenario_t
+{
+    SC_GET,
+    SC_POST,
+    SC_MULTIPART,
+    SC_INCLUDE
+};
+
+static const char* include_file = "/tmp/alloc_harness.html";
+static char mp_body[0x4000];
+
+static void
+buildRequest(scenario_t sc, Record& rec)
+{
+    const char* get[] = { "REQUEST_METHOD", "GET", "REQUEST_URI", "/app/page?fn=list&id=42",
+                          "QUERY_STRING", "fn=list&id=42&lang=en", "HTTP_COOKIE", "sid=abcdef",
+                          "REMOTE_ADDR", "127.0.0.1", "SCRIPT_NAME", "/app", 0 };
+    const char* post[] = { "REQUEST_METHOD", "POST", "REQUEST_URI", "/app/save",
+                           "CONTENT_TYPE", "application/x-www-form-urlencoded",
+                           "CONTENT_LENGTH", "44", 0 };
+    const char* body = "name=Jane+Doe&email=jane%40example.com&age=3";
+    char clen[16];
+    const char* mp[] = { "REQUEST_METHOD", "POST", "REQUEST_URI", "/app/upload",
+                         "CONTENT_TYPE", "multipart/form-data; boundary=----harness42",
+                         "CONTENT_LENGTH", clen, 0 };
+    const char* inc[] = { "REQUEST_METHOD", "GET", "REQUEST_URI", "/app/include", 0 };
+    size_t mp_len = 0;
+
+    rec.len = 0;
+    rec.begin();
+    switch (sc) {
+    case SC_GET:
+        rec.params(get);
+        rec.body(0, 0);
+        break;
+    case SC_POST:
+        rec.params(post);
+        rec.body(body, strlen(body));
+        break;
+    case SC_MULTIPART:
+        mp_len = sprintf(mp_body, "------harness42\r\n"
+                                  "Content-Disposition: form-data; name=\"title\"\r\n\r\n"
+                                  "Report\r\n"
+                                  "------harness42\r\n"
+                                  "Content-Disposition: form-data; name=\"file\"; "
+                                  "filename=\"data.txt\"\r\n"
+                                  "Content-Type: text/plain\r\n\r\n");
+        memset(mp_body + mp_len, 'x', 0x2000);
+        mp_len += 0x2000;
+        mp_len += sprintf(mp_body + mp_len, "\r\n------harness42--\r\n");
+        sprintf(clen, "%lu", mp_len);
+        rec.params(mp);
+        rec.body(mp_body, mp_len);
+        break;
+    case SC_INCLUDE:
+        rec.params(inc);
+        rec.body(0, 0);
+        break;
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+// Application side.
+
+class HarnessHandler : public Handler
+{
+  public:
+    void exec(Request*) override {}
+    void done(Request* req) override
+    {
+        req->write("Content-Type: text/html\r\n\r\n");
+        if (!strcmp(req->getURI(), "/app/include")) {
+            // Driver half of Includer::toRequest; the Framework itself is not exercised.
+            int fd = ::open(include_file, O_RDONLY);
+            if (fd >= 0) {
+                req->writeFd(fd);
+                ::close(fd);
+            }
+        } else {
+            const char* fn = req->params.get(HASH_QUERY_STRING);
+            req->write("<html><body>");
+            req->write(fn ? fn : "-");
+            req->write("</body></html>");
+        }
+        req->end();
+    }
+};
+
+struct HarnessArbiter : public PageArbiter
+{
+    bool matchPage(Request* req) override
+    {
+        req->handler = &handler;
+        return true;
+    }
+    HarnessHandler handler;
+};
+
+// -------------------------------------------------------------------------------------------------
+
+static bool
+runRequest(Driver& drv, Record& rec)
+{
+    int sp[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1)
+        return false;
+    fcntl(sp[0], F_SETFL, O_NONBLOCK);
+    fcntl(sp[1], F_SETFL, O_NONBLOCK);
+    pollfd pfds[8];
+    char reply[0x10000];
+    size_t sent = 0;
+    bool ended = false;
+    pollfd newfd = { sp[0], POLLIN, 0 };
+
+    counting = true;
+    drv.createRequest(&newfd);
+    counting = false;
+    for (int round = 0; round < 10000 && !ended; round++) {
+        if (sent < rec.len) {
+            ssize_t wr = ::write(sp[1], rec.data + sent, rec.len - sent);
+            if (wr > 0)
+                sent += wr;
+        }
+        counting = true;
+        size_t count = drv.fillPollFd(pfds, 8);
+        ::poll(pfds, count, 0);
+        for (size_t ndx = 0; ndx < count; ndx++) {
+            Request* rq = (pfds[ndx].revents & POLLIN) ? drv.findRequest(pfds[ndx].fd) : 0;
+            if (rq)
+                drv.read(rq);
+        }
+        drv.work();
+        for (size_t ndx = 0; ndx < count; ndx++) {
+            Request* rq = (pfds[ndx].revents & POLLOUT) ? drv.findRequest(pfds[ndx].fd) : 0;
+            if (rq)
+                drv.write(rq);
+        }
+        drv.freeDormantRequests();
+        counting = false;
+        // Look for END_REQUEST in the reply stream.
+        ssize_t rd;
+        while ((rd = ::read(sp[1], reply, sizeof(reply))) > 0) {
+            for (ssize_t pos = 0; pos + 8 <= rd;) {
+                Header* hdr = (Header*)(reply + pos);
+                if (hdr->type == TYPE_END_REQUEST)
+                    ended = true;
+                pos += 8 + hdr->content_length.get() + hdr->padding_length;
+            }
+        }
+        if (rd == 0)
+            break;
+    }
+    // Let the driver close its end.
+    counting = true;
+    drv.freeDormantRequests();
+    counting = false;
+    ::close(sp[1]);
+    return ended;
+}
+
+int
+main(int argc, char** argv)
+{
+    uint32_t reqs = 1000, warmup = 100;
+    double max_allocs = 0;
+    for (int ndx = 1; ndx + 1 < argc; ndx += 2) {
+        if (!strcmp(argv[ndx], "-n"))
+            reqs = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-w"))
+            warmup = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-max"))
+            max_allocs = atof(argv[ndx + 1]);
+    }
+    FILE* inc = fopen(include_file, "w");
+    if (inc) {
+        for (int ndx = 0; ndx < 200; ndx++)
+            fprintf(inc, "<p>Included line %d of the harness page.</p>\n", ndx);
+        fclose(inc);
+    }
+    HarnessArbiter arb;
+    DriverLimits limits;
+    limits.requests = 4;
+    Driver drv(&arb, limits);
+    drv.setFileDir("/tmp");
+
+    // Uploads small enough for UploadStore's memory limit get one buffer for their content.
+    const char* names[] = { "GET query", "POST urlencoded", "multipart upload", "include file" };
+    const double allowed[] = { 0, 0, 1, 0 };
+    Record* rec = new Record;
+    int fails = 0;
+    printf("%-18s %10s %10s %10s %10s\n", "scenario", "allocs/rq", "bytes/rq", "frees/rq",
+           "syscall/rq");
+    for (int sc = SC_GET; sc <= SC_INCLUDE; sc++) {
+        buildRequest((scenario_t)sc, *rec);
+        for (uint32_t ndx = 0; ndx < warmup; ndx++)
+            runRequest(drv, *rec);
+        n_alloc = n_bytes = n_free = n_sys = 0;
+        uint32_t ok = 0;
+        for (uint32_t ndx = 0; ndx < reqs; ndx++) {
+            if (runRequest(drv, *rec))
+                ok++;
+        }
+        double allocs = (double)n_alloc / reqs;
+        bool pass = ok == reqs && allocs <= max_allocs + allowed[sc];
+        printf("%-18s %10.2f %10.1f %10.2f %10.2f %s\n", names[sc], allocs, (double)n_bytes / reqs,
+               (double)n_free / reqs, (double)n_sys / reqs, pass ? "OK" : "FAIL");
+        if (ok != reqs)
+            printf("  %u of %u requests did not complete\n", reqs - ok, reqs);
+        if (!pass)
+            fails++;
+    }
+    delete rec;
+    unlink(include_file);
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+/***
+Compile:
+g++ -o arenatest arenatest.cxx ../driver/Arena.cpp -ggdb -Wall
+
+./arenatest
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include "../driver/Arena.hpp"
+
+using namespace fcgi_driver;
+
+struct Item
+{
+    Item(int v)
+      : value(v)
+    {}
+    double pad;
+    int value;
+};
+
+int
+main()
+{
+    int fails = 0;
+    Arena arena(0x1000, 2);
+    uint64_t after_first = 0;
+    for (int round = 0; round < 100; round++) {
+        // Typical request: small objects, strings, a vector and one oversize block.
+        for (int ndx = 0; ndx < 200; ndx++) {
+            Item* it = arena.make<Item>(ndx);
+            if ((uintptr_t)it % alignof(Item) || it->value != ndx)
+                fails++;
+        }
+        char* str = arena.strdup("hello arena", 5);
+        if (strcmp(str, "hello"))
+            fails++;
+        std::vector<int, ArenaAllocator<int>> vec{ ArenaAllocator<int>(arena) };
+        for (int ndx = 0; ndx < 300; ndx++)
+            vec.push_back(ndx);
+        ArenaString as("string in arena that is longer than small buffer",
+                       ArenaAllocator<char>(arena));
+        if (as.size() != 48)
+            fails++;
+        memset(arena.alloc(0x3000), 1, 0x3000);
+        if (round == 0)
+            after_first = arena.getChunkAllocs();
+        arena.reset();
+        if (arena.used())
+            fails++;
+    }
+    // Regular chunks are recycled. Only the oversize block is taken from heap on each round.
+    uint64_t per_round = (arena.getChunkAllocs() - after_first) / 99;
+    printf("chunk allocs: first round %lu, later rounds %lu each, reserved %lu\n", after_first,
+           per_round, arena.reserved());
+    if (per_round > 1)
+        fails++;
+    printf("%s\n", fails ? "FAIL" : "OK");
+    return fails;
+}
@@ -0,0 +1,64 @@
+/***
+Compile:
+g++ -o digest digest.cxx ../driver/Digest.cpp -ggdb -Wall
+
+./digest
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "../driver/Digest.hpp"
+
+using namespace fcgi_driver;
+
+struct Vector
+{
+    const char* data;
+    const char* sha256;
+    uint32_t crc32c;
+};
+
+static const Vector vectors[] = {
+    { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", 0x00000000 },
+    { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", 0x364b3fb7 },
+    { "123456789", "15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8c3312448eb225", 0xe3069283 },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", 0x00000000 },
+};
+
+int
+main()
+{
+    int fails = 0;
+    printf("SHA-256 hardware: %s; CRC32C hardware: %s\n", Sha256::hasHardware() ? "yes" : "no",
+           crc32c_hardware() ? "yes" : "no");
+    for (const Vector& vec : vectors) {
+        // Feed byte at a time to exercise the partial block handling.
+        Digest dg;
+        dg.begin(DIGEST_SHA256 | DIGEST_CRC32C);
+        for (size_t ndx = 0; ndx < strlen(vec.data); ndx++)
+            dg.update(vec.data + ndx, 1);
+        dg.end();
+        bool ok = dg.sha256Hex() == vec.sha256 && (!vec.crc32c || dg.crc32c == vec.crc32c);
+        printf("%-10.10s %s %08x %s\n", vec.data, dg.sha256Hex().c_str(), dg.crc32c,
+               ok ? "OK" : "FAIL");
+        if (!ok)
+            fails++;
+    }
+    // One million 'a' in uneven chunks.
+    char chunk[1000];
+    memset(chunk, 'a', sizeof(chunk));
+    Digest big;
+    big.begin(DIGEST_SHA256);
+    for (size_t done = 0, len = 1; done < 1000000; done += len, len = (len * 7) % 997 + 1) {
+        if (done + len > 1000000)
+            len = 1000000 - done;
+        big.update(chunk, len);
+    }
+    big.end();
+    bool ok = big.sha256Hex() == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0";
+    printf("1M x 'a'   %s %s\n", big.sha256Hex().c_str(), ok ? "OK" : "FAIL");
+    if (!ok)
+        fails++;
+    return fails;
+}
@@ -0,0 +1,170 @@
+/***
+Compile:
+g++ -o echo_app echo_app.cxx -O2 -fno-rtti -Wno-reorder -Wnon-virtual-dtor -DC4S_LOG_LEVEL=3 -I/usr/local/include/cpp4scripts -L/usr/local/lib -L../release -lfcgi -lc4s
+
+./echo_app [-s socket] [-r requests] [-f include-file] [-cap capture-file] [-sample n]
+           [-stats page-uri] [-shm prefix] [-trace file]
+
+Sample application for benchmarks with fcgiload. Listens on the given unix socket (default
+/tmp/fcgibench.sock) that the web server or fcgiload connects to.
+  /large?size=N  Responds with N bytes (default 256k).
+  /include       Sends the include file the same way as Includer::toRequest.
+  anything else  Echoes method, parameter count, content length and upload count.
+With -cap the inbound traffic of every n:th connection is captured for fcgireplay. With -stats
+the driver collects request statistics and serves them at the given URI, e.g. /fcgi-stats.
+With -shm the counters are published in /dev/shm/<prefix>.<pid> for fcgistat. With -trace the
+event tracing is on and the trace is written into the file at SIGUSR1 and at exit; convert it with
+fcgitrace.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../driver/Scheduler.hpp"
+
+using namespace fcgi_driver;
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dump_trace = 0;
+static const char* include_file = 0;
+
+static void
+onSignal(int)
+{
+    running = 0;
+}
+
+static void
+onDump(int)
+{
+    dump_trace = 1;
+}
+
+class EchoHandler : public Handler
+{
+  public:
+    EchoHandler() { setName("echo"); }
+    void exec(Request*) override {}
+    void done(Request* req) override
+    {
+        const char* uri = req->getURI();
+        if (!strncmp(uri, "/large", 6)) {
+            // Query string is parsed into parameters.
+            const char* sz = req->params.get("size", 4);
+            size_t left = *sz ? atol(sz) : 0x40000;
+            char chunk[0x1000];
+            memset(chunk, 'x', sizeof(chunk));
+            req->write("Content-Type: application/octet-stream\r\n\r\n");
+            while (left) {
+                uint16_t len = left > sizeof(chunk) ? sizeof(chunk) : left;
+                req->write(chunk, len);
+                left -= len;
+            }
+        } else if (!strncmp(uri, "/include", 8) && include_file) {
+            req->write("Content-Type: text/html\r\n\r\n");
+            int fd = open(include_file, O_RDONLY);
+            if (fd >= 0) {
+                req->writeFd(fd);
+                close(fd);
+            }
+        } else {
+            char reply[512];
+            int len = snprintf(reply, sizeof(reply),
+                               "Content-Type: text/plain\r\n\r\n"
+                               "method=%s\nparams=%lu\ncontent-length=%lu\nuploads=%d\n",
+                               req->getType() == HTML_POST ? "POST" : "GET", req->params.size(),
+                               req->getContentLength(), req->getUploadCount());
+            req->write(reply, len < (int)sizeof(reply) ? len : sizeof(reply) - 1);
+        }
+        req->end();
+    }
+};
+
+struct EchoArbiter : public PageArbiter
+{
+    bool matchPage(Request* req) override
+    {
+        req->handler = &handler;
+        return true;
+    }
+    EchoHandler handler;
+};
+
+int
+main(int argc, char** argv)
+{
+    const char* socket_path = "/tmp/fcgibench.sock";
+    const char* capture_file = 0;
+    const char* stats_uri = 0;
+    const char* shm_prefix = 0;
+    const char* trace_file = 0;
+    uint32_t sample = 1;
+    DriverLimits limits;
+    for (int ndx = 1; ndx + 1 < argc; ndx += 2) {
+        if (!strcmp(argv[ndx], "-s"))
+            socket_path = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-r"))
+            limits.requests = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-f"))
+            include_file = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-cap"))
+            capture_file = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-sample"))
+            sample = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-stats"))
+            stats_uri = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-shm"))
+            shm_prefix = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-trace"))
+            trace_file = argv[ndx + 1];
+        else {
+            printf("Usage: echo_app [-s socket] [-r requests] [-f include-file] "
+                   "[-cap capture-file] [-sample n] [-stats page-uri] [-shm prefix] "
+                   "[-trace file]\n");
+            return 1;
+        }
+    }
+    if (!limits.validate())
+        printf("echo_app: request count adjusted to %u\n", limits.requests);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, onDump);
+    try {
+        EchoArbiter arb;
+        Driver driver(&arb, limits);
+        driver.setFileDir("/tmp");
+        if (capture_file && !driver.enableCapture(capture_file, sample)) {
+            printf("echo_app: unable to capture into %s\n", capture_file);
+            return 2;
+        }
+        if (stats_uri)
+            driver.enableStats(stats_uri);
+        if (shm_prefix && !driver.enableShmStats(shm_prefix)) {
+            printf("echo_app: unable to create shared memory segment\n");
+            return 2;
+        }
+        Scheduler sched(&driver, socket_path);
+        printf("echo_app: listening %s with %u requests\n", socket_path, limits.requests);
+        if (trace_file)
+            Tracer::enable();
+        while (running) {
+            sched.run();
+            if (dump_trace && trace_file) {
+                dump_trace = 0;
+                Tracer::dump(trace_file);
+            }
+        }
+        if (trace_file && !Tracer::dump(trace_file))
+            printf("echo_app: unable to write trace into %s\n", trace_file);
+        printf("echo_app: served %u requests\n", driver.getServedCount());
+    } catch (const std::exception& ex) {
+        printf("echo_app: %s\n", ex.what());
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,551 @@
+/***
+Compile:
+g++ -o fcgiload fcgiload.cxx ../driver/Histogram.cpp -O2 -Wall
+
+./fcgiload [-s socket] [-c connections] [-d seconds | -n requests] [-r rate] [-w warmup] [-k]
+           [-m get=70,post=20,multipart=5,large=5] [-l large-size] [-seed N]
+
+FastCGI load generator that talks directly to the Scheduler's unix socket, e.g. one of echo_app.
+Without -r the client is closed loop: each connection sends the next request as soon as the
+previous one is done. With -r requests are scheduled at fixed intervals regardless of how fast the
+server answers (open loop) and latency is measured from the intended send time so that a stalled
+server does not hide its own queueing delay (coordinated omission). Request mix is drawn from a
+seeded generator, so the same options produce the same sequence of requests.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <deque>
+#include <vector>
+
+#include "../driver/Histogram.hpp"
+
+using namespace fcgi_driver;
+
+enum
+{
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_RESPONDER = 1,
+    FCGI_KEEP_CONN = 1
+};
+
+enum scenario_t
+{
+    SC_GET,
+    SC_POST,
+    SC_MULTIPART,
+    SC_LARGE,
+    SC_COUNT
+};
+static const char* sc_names[] = { "get", "post", "multipart", "large" };
+
+// -------------------------------------------------------------------------------------------------
+// Encoded requests.
+
+struct Encoded
+{
+    std::vector<char> data;
+
+    void add(int type, const char* content, size_t len)
+    {
+        unsigned char hdr[8] = { 1, (unsigned char)type, 0, 1, (unsigned char)(len >> 8),
+                                 (unsigned char)(len & 0xff), 0, 0 };
+        data.insert(data.end(), (char*)hdr, (char*)hdr + 8);
+        data.insert(data.end(), content, content + len);
+    }
+    void begin(bool keep)
+    {
+        char body[8] = { 0, FCGI_RESPONDER, keep ? (char)FCGI_KEEP_CONN : (char)0, 0, 0, 0, 0, 0 };
+        add(FCGI_BEGIN_REQUEST, body, sizeof(body));
+    }
+    void params(const char** nv)
+    {
+        std::vector<char> buf;
+        for (; *nv; nv += 2) {
+            size_t nl = strlen(nv[0]), vl = strlen(nv[1]);
+            buf.push_back(nl);
+            buf.push_back(vl);
+            buf.insert(buf.end(), nv[0], nv[0] + nl);
+            buf.insert(buf.end(), nv[1], nv[1] + vl);
+        }
+        add(FCGI_PARAMS, buf.data(), buf.size());
+        add(FCGI_PARAMS, 0, 0);
+    }
+    void body(const char* content, size_t len)
+    {
+        for (size_t pos = 0; pos < len; pos += 0x8000)
+            add(FCGI_STDIN, content + pos, len - pos > 0x8000 ? 0x8000 : len - pos);
+        add(FCGI_STDIN, 0, 0);
+    }
+};
+
+static void
+encode(scenario_t sc, bool keep, size_t large_size, Encoded& enc)
+{
+    char clen[24], query[64];
+    std::vector<char> mp;
+    enc.begin(keep);
+    if (sc == SC_GET) {
+        const char* nv[] = { "REQUEST_METHOD", "GET", "REQUEST_URI", "/echo?fn=list&id=42",
+                             "QUERY_STRING", "fn=list&id=42", "HTTP_COOKIE", "sid=bench",
+                             "REMOTE_ADDR", "127.0.0.1", 0 };
+        enc.params(nv);
+        enc.body(0, 0);
+    } else if (sc == SC_POST) {
+        const char* form = "name=Jane+Doe&email=jane%40example.com&comment=benchmark+run";
+        sprintf(clen, "%lu", strlen(form));
+        const char* nv[] = { "REQUEST_METHOD", "POST", "REQUEST_URI", "/echo", "CONTENT_TYPE",
+                             "application/x-www-form-urlencoded", "CONTENT_LENGTH", clen, 0 };
+        enc.params(nv);
+        enc.body(form, strlen(form));
+    } else if (sc == SC_MULTIPART) {
+        const char* head = "------fcgiload\r\n"
+                           "Content-Disposition: form-data; name=\"title\"\r\n\r\n"
+                           "Benchmark\r\n"
+                           "------fcgiload\r\n"
+                           "Content-Disposition: form-data; name=\"file\"; filename=\"f.bin\"\r\n"
+                           "Content-Type: application/octet-stream\r\n\r\n";
+        const char* tail = "\r\n------fcgiload--\r\n";
+        mp.insert(mp.end(), head, head + strlen(head));
+        mp.insert(mp.end(), 0x4000, 'u');
+        mp.insert(mp.end(), tail, tail + strlen(tail));
+        sprintf(clen, "%lu", mp.size());
+        const char* nv[] = { "REQUEST_METHOD", "POST", "REQUEST_URI", "/upload", "CONTENT_TYPE",
+                             "multipart/form-data; boundary=----fcgiload", "CONTENT_LENGTH", clen,
+                             0 };
+        enc.params(nv);
+        enc.body(mp.data(), mp.size());
+    } else {
+        sprintf(query, "size=%lu", large_size);
+        const char* nv[] = { "REQUEST_METHOD", "GET", "REQUEST_URI", "/large", "QUERY_STRING", query,
+                             0 };
+        enc.params(nv);
+        enc.body(0, 0);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+// Connections.
+
+struct Conn
+{
+    int fd;
+    bool busy;
+    bool reused;       // Request went to a kept connection.
+    scenario_t sc;
+    size_t sent;
+    size_t got;        // Response bytes received.
+    uint64_t intended; // Time the request should have been sent (ns).
+    int status;
+    char in[0x10000 + 0x108];
+    size_t in_len;
+};
+
+struct Result
+{
+    Result()
+      : hist(HIST_MAX)
+      , done(0)
+      , errors(0)
+    {}
+    Histogram hist;
+    uint64_t done, errors;
+};
+
+static Encoded requests[SC_COUNT];
+static Result results[SC_COUNT];
+static Histogram total_hist(HIST_MAX);
+static uint64_t status_2xx = 0, status_4xx = 0, status_5xx = 0, overloaded = 0, errors = 0;
+static uint64_t bytes_in = 0, retries = 0;
+static const char* socket_path = "/tmp/fcgibench.sock";
+static uint64_t measure_from = 0;
+static volatile sig_atomic_t interrupted = 0;
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+onSignal(int)
+{
+    interrupted = 1;
+}
+
+static bool
+connectConn(Conn& cn)
+//! Returns false only if the listen backlog is full. Other errors end the program.
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    cn.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (cn.fd == -1) {
+        printf("fcgiload: unable to create socket: %s\n", strerror(errno));
+        exit(2);
+    }
+    if (connect(cn.fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        int err = errno;
+        close(cn.fd);
+        cn.fd = -1;
+        if (err == EAGAIN)
+            return false;
+        printf("fcgiload: unable to connect %s: %s\n", socket_path, strerror(err));
+        exit(2);
+    }
+    return true;
+}
+
+static void
+closeConn(Conn& cn)
+{
+    if (cn.fd >= 0)
+        close(cn.fd);
+    cn.fd = -1;
+}
+
+static void
+finish(Conn& cn, bool ok, bool keep)
+{
+    uint64_t end = now_ns();
+    if (!ok)
+        errors++;
+    if (cn.intended >= measure_from) {
+        uint64_t us = (end - cn.intended) / 1000;
+        Result& res = results[cn.sc];
+        res.done++;
+        if (!ok)
+            res.errors++;
+        res.hist.record(us);
+        total_hist.record(us);
+        if (ok) {
+            if (cn.status >= 500)
+                status_5xx++;
+            else if (cn.status >= 400)
+                status_4xx++;
+            else
+                status_2xx++;
+        }
+    }
+    cn.busy = false;
+    if (!ok || !keep)
+        closeConn(cn);
+}
+
+static bool
+startRequest(Conn& cn, uint64_t intended)
+{
+    cn.reused = cn.fd >= 0;
+    if (!cn.reused && !connectConn(cn))
+        return false; // Listen backlog is full. Try again on next round.
+    cn.busy = true;
+    cn.sent = 0;
+    cn.got = 0;
+    cn.in_len = 0;
+    cn.status = 0;
+    cn.intended = intended;
+    return true;
+}
+
+static void
+reconnect(Conn& cn)
+//! Server had closed the kept connection before it saw the request. Send it again on a new one.
+{
+    closeConn(cn);
+    retries++;
+    cn.reused = false;
+    cn.sent = 0;
+    connectConn(cn); // If the backlog is full the main loop tries again.
+}
+
+static void
+sendMore(Conn& cn, bool keep)
+{
+    const std::vector<char>& data = requests[cn.sc].data;
+    while (cn.sent < data.size()) {
+        ssize_t wr = send(cn.fd, data.data() + cn.sent, data.size() - cn.sent, MSG_NOSIGNAL);
+        if (wr > 0) {
+            cn.sent += wr;
+            continue;
+        }
+        if (wr == -1 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (cn.reused && !cn.got) {
+            reconnect(cn);
+            if (cn.fd >= 0)
+                continue;
+            return;
+        }
+        finish(cn, false, keep);
+        return;
+    }
+}
+
+static void
+receive(Conn& cn, bool keep)
+{
+    for (;;) {
+        ssize_t rd = recv(cn.fd, cn.in + cn.in_len, sizeof(cn.in) - cn.in_len, 0);
+        if (rd == -1 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (rd <= 0) {
+            if (cn.reused && !cn.got && (rd == 0 || errno == ECONNRESET)) {
+                reconnect(cn);
+                if (cn.fd >= 0)
+                    sendMore(cn, keep);
+                return;
+            }
+            finish(cn, false, keep);
+            return;
+        }
+        cn.got += rd;
+        bytes_in += rd;
+        cn.in_len += rd;
+        // Process complete records.
+        size_t pos = 0;
+        while (cn.in_len - pos >= 8) {
+            unsigned char* hdr = (unsigned char*)cn.in + pos;
+            size_t clen = (hdr[4] << 8) + hdr[5];
+            size_t rlen = 8 + clen + hdr[6];
+            if (cn.in_len - pos < rlen)
+                break;
+            if (hdr[1] == FCGI_STDOUT && !cn.status) {
+                cn.status = 200;
+                if (clen > 12 && !strncmp((char*)hdr + 8, "Status: ", 8))
+                    cn.status = atoi((char*)hdr + 16);
+            } else if (hdr[1] == FCGI_END_REQUEST) {
+                unsigned char* body = hdr + 8;
+                bool ok = body[4] == 0; // protocol status
+                if (!ok)
+                    overloaded++;
+                if (!cn.status)
+                    cn.status = 200;
+                finish(cn, ok, keep);
+                return;
+            }
+            pos += rlen;
+        }
+        memmove(cn.in, cn.in + pos, cn.in_len - pos);
+        cn.in_len -= pos;
+    }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool
+parseMix(const char* spec, uint32_t* weights)
+{
+    memset(weights, 0, SC_COUNT * sizeof(uint32_t));
+    char buf[256];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    for (char* tok = strtok(buf, ","); tok; tok = strtok(0, ",")) {
+        char* eq = strchr(tok, '=');
+        if (!eq)
+            return false;
+        *eq = 0;
+        int sc;
+        for (sc = 0; sc < SC_COUNT && strcmp(tok, sc_names[sc]); sc++)
+            ;
+        if (sc == SC_COUNT)
+            return false;
+        weights[sc] = atoi(eq + 1);
+    }
+    return true;
+}
+
+int
+main(int argc, char** argv)
+{
+    uint32_t conns = 8, weights[SC_COUNT] = { 100, 0, 0, 0 };
+    double duration = 10, rate = 0, warmup = 0;
+    uint64_t max_requests = 0;
+    size_t large_size = 0x40000;
+    bool keep = false;
+    unsigned int seed = 1;
+    const char* mix = "get=100";
+
+    for (int ndx = 1; ndx < argc; ndx++) {
+        const char* arg = argv[ndx];
+        const char* val = ndx + 1 < argc ? argv[ndx + 1] : 0;
+        if (!strcmp(arg, "-k")) {
+            keep = true;
+            continue;
+        }
+        if (!val) {
+            printf("Missing value for %s\n", arg);
+            return 1;
+        }
+        ndx++;
+        if (!strcmp(arg, "-s"))
+            socket_path = val;
+        else if (!strcmp(arg, "-c"))
+            conns = atoi(val);
+        else if (!strcmp(arg, "-d"))
+            duration = atof(val);
+        else if (!strcmp(arg, "-n"))
+            max_requests = atol(val);
+        else if (!strcmp(arg, "-r"))
+            rate = atof(val);
+        else if (!strcmp(arg, "-w"))
+            warmup = atof(val);
+        else if (!strcmp(arg, "-l"))
+            large_size = atol(val);
+        else if (!strcmp(arg, "-seed"))
+            seed = atoi(val);
+        else if (!strcmp(arg, "-m"))
+            mix = val;
+        else {
+            printf("Unknown option %s\n", arg);
+            return 1;
+        }
+    }
+    if (!parseMix(mix, weights) || !conns) {
+        printf("Invalid mix or connection count.\n");
+        return 1;
+    }
+    uint32_t weight_sum = 0;
+    for (int sc = 0; sc < SC_COUNT; sc++) {
+        weight_sum += weights[sc];
+        encode((scenario_t)sc, keep, large_size, requests[sc]);
+    }
+    if (!weight_sum)
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onSignal);
+
+    std::vector<Conn> pool(conns);
+    for (Conn& cn : pool) {
+        cn.fd = -1;
+        cn.busy = false;
+    }
+    std::vector<pollfd> pfds(conns);
+    std::deque<uint64_t> backlog; // Intended send times of requests not yet sent.
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t start = now_ns();
+    uint64_t stop_issue = max_requests ? UINT64_MAX : start + (uint64_t)((warmup + duration) * 1e9);
+    uint64_t next_due = start;
+    uint64_t issued = 0, limit = max_requests ? max_requests : UINT64_MAX;
+    measure_from = start + (uint64_t)(warmup * 1e9);
+
+    printf("fcgiload: %s, %u connections, %s, keep-conn %s, mix %s\n", socket_path, conns,
+           rate > 0 ? "open loop" : "closed loop", keep ? "on" : "off", mix);
+    if (rate > 0)
+        printf("  rate %.0f req/s\n", rate);
+
+    for (;;) {
+        uint64_t now = now_ns();
+        bool issuing = !interrupted && now < stop_issue && issued < limit;
+        if (issuing && interval) {
+            while (next_due <= now && issued < limit) {
+                backlog.push_back(next_due);
+                next_due += interval;
+                issued++;
+            }
+        }
+        // Hand out work to idle connections.
+        for (Conn& cn : pool) {
+            if (cn.busy)
+                continue;
+            if (!interval && issuing && backlog.empty() && issued < limit) {
+                backlog.push_back(now);
+                issued++;
+            }
+            if (backlog.empty())
+                break;
+            if (!startRequest(cn, backlog.front()))
+                break;
+            backlog.pop_front();
+            uint32_t pick = rand_r(&seed) % weight_sum, sc = 0;
+            while (pick >= weights[sc])
+                pick -= weights[sc++];
+            cn.sc = (scenario_t)sc;
+            sendMore(cn, keep);
+        }
+        size_t count = 0, pending = 0;
+        for (Conn& cn : pool) {
+            if (!cn.busy)
+                continue;
+            if (cn.fd < 0) {
+                if (!connectConn(cn)) {
+                    pending++;
+                    continue;
+                }
+                sendMore(cn, keep);
+                if (!cn.busy || cn.fd < 0)
+                    continue;
+            }
+            pfds[count].fd = cn.fd;
+            pfds[count].events = POLLIN | (cn.sent < requests[cn.sc].data.size() ? POLLOUT : 0);
+            pfds[count].revents = 0;
+            count++;
+        }
+        if (!count && !pending && (!issuing || (!interval && issued >= limit)) && backlog.empty())
+            break;
+        if (interrupted && !count && !pending)
+            break;
+        // Sleep until I/O or, if a connection is free, until the next request is due. Spinning
+        // here would take the CPU from the server on small machines.
+        uint64_t wait = 10000000;
+        if (interval && count < conns && issuing)
+            wait = next_due > now ? next_due - now : 0;
+        if (pending && wait > 1000000)
+            wait = 1000000; // Waiting for room in the listen backlog.
+        if (wait > 10000000)
+            wait = 10000000;
+        struct timespec tmo = { 0, (long)wait };
+        ppoll(pfds.data(), count, &tmo, 0);
+        for (size_t ndx = 0; ndx < count; ndx++) {
+            if (!pfds[ndx].revents)
+                continue;
+            for (Conn& cn : pool) {
+                if (cn.fd != pfds[ndx].fd || !cn.busy)
+                    continue;
+                if (pfds[ndx].revents & POLLOUT)
+                    sendMore(cn, keep);
+                if (cn.busy && (pfds[ndx].revents & (POLLIN | POLLHUP | POLLERR)))
+                    receive(cn, keep);
+                break;
+            }
+        }
+    }
+    double secs = (now_ns() - measure_from) / 1e9;
+    for (Conn& cn : pool)
+        closeConn(cn);
+
+    uint64_t done = total_hist.getCount();
+    printf("\n%lu requests in %.2f s, %.1f req/s, %.2f MB/s received\n", done, secs, done / secs,
+           bytes_in / secs / 0x100000);
+    printf("  2xx %lu, 4xx %lu, 5xx %lu, overloaded %lu, errors %lu, reconnects %lu\n", status_2xx,
+           status_4xx, status_5xx, overloaded, errors, retries);
+    printf("\nLatency%s:\n", rate > 0 ? " (from intended send time)" : "");
+    total_hist.print(stdout, "ms", 1000);
+    printf("\n%-10s %10s %8s %10s %10s %10s\n", "scenario", "count", "errors", "p50 ms", "p99 ms",
+           "max ms");
+    for (int sc = 0; sc < SC_COUNT; sc++) {
+        const Result& res = results[sc];
+        if (!res.done)
+            continue;
+        printf("%-10s %10lu %8lu %10.2f %10.2f %10.2f\n", sc_names[sc], res.done, res.errors,
+               res.hist.percentile(50) / 1000.0, res.hist.percentile(99) / 1000.0,
+               res.hist.getMax() / 1000.0);
+    }
+    return errors ? 2 : 0;
+}
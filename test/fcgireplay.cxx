@@ -0,0 +1,399 @@
+/***
+Compile:
+g++ -o fcgireplay fcgireplay.cxx -O2 -fno-rtti -Wno-reorder -Wnon-virtual-dtor -DC4S_LOG_LEVEL=3 -I/usr/local/include/cpp4scripts -L/usr/local/lib -L../release -lfcgi -lc4s -pthread
+
+./fcgireplay -f capture [-m fast|paced] [-speed factor] [-c connections] [-r requests] [-n passes]
+             [-t timeout-ms] [-o hash-file] [-u upload-dir]
+
+Replays a capture made with Driver::enableCapture (e.g. echo_app -cap file) through a Driver in
+this process. Each captured connection gets a socketpair whose other end is given to the driver.
+In fast mode (default) connections are replayed back to back with at most -c of them at the same
+time. Paced mode keeps the original timing of the capture, optionally sped up with -speed.
+
+The handler echoes request type, URI, every parameter and the received uploads, so a change in
+parsing shows up as a change in output hash. Latency is measured from the first byte sent to the
+END_REQUEST record. With -o the hash, output size, application status and latency of each
+connection are written into the file for diffing two builds. Connections that were truncated in
+the capture are skipped.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../driver/Scheduler.hpp"
+#include "../driver/Histogram.hpp"
+
+using namespace fcgi_driver;
+
+struct Chunk
+{
+    uint64_t time_us;
+    size_t offset;
+    size_t len;
+};
+
+struct Conn
+{
+    uint32_t id;
+    uint64_t open_us;
+    std::vector<Chunk> chunks;
+    std::string data;
+    bool truncated;
+    // Replay state
+    int fd;
+    size_t chunk; // Next chunk to send.
+    size_t sent;  // Bytes of the next chunk already sent.
+    uint64_t start_ns;
+    uint64_t latency_us;
+    uint64_t hash;
+    size_t out_bytes;
+    uint32_t app_status;
+    std::string reply; // Unparsed response bytes.
+    bool ended;
+};
+
+static const uint64_t FNV_OFFSET = 0xcbf29ce484222325UL;
+static const uint64_t FNV_PRIME = 0x100000001b3UL;
+
+static uint64_t
+fnv1a(uint64_t hash, const char* data, size_t len)
+{
+    for (size_t ndx = 0; ndx < len; ndx++) {
+        hash ^= (unsigned char)data[ndx];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+class ReplayHandler : public Handler
+{
+  public:
+    void exec(Request*) override {}
+    void done(Request* req) override
+    {
+        char line[0x400];
+        req->write("Content-Type: text/plain\r\n\r\n");
+        put(req, line, snprintf(line, sizeof(line), "type=%d uri=%s content-length=%lu\n",
+                                req->getType(), req->getURI(), req->getContentLength()));
+        for (size_t ndx = 0; ndx < req->params.size(); ndx++) {
+            put(req, line, snprintf(line, sizeof(line), "%016lx=%s\n", req->params.getKey(ndx),
+                                    req->params.getValue(ndx)));
+        }
+        for (UploadFile* uf = req->getFirstUpload(); uf; uf = req->getNextUpload())
+            put(req, line, snprintf(line, sizeof(line), "upload %s %lu\n", uf->fldname, uf->bytes));
+        req->end();
+    }
+
+  protected:
+    void put(Request* req, const char* line, int len)
+    {
+        if (len > 0)
+            req->write(line, len < 0x400 ? len : 0x3ff);
+    }
+};
+
+struct ReplayArbiter : public PageArbiter
+{
+    bool matchPage(Request* req) override
+    {
+        req->handler = &handler;
+        return true;
+    }
+    ReplayHandler handler;
+};
+
+// -------------------------------------------------------------------------------------------------
+
+static bool
+load(const char* fname, std::vector<Conn>& conns, uint32_t* sample)
+{
+    CaptureFileHeader hdr;
+    FILE* in = Capture::openRead(fname, &hdr);
+    if (!in) {
+        printf("fcgireplay: %s is not a capture file.\n", fname);
+        return false;
+    }
+    *sample = hdr.sample;
+    std::map<uint32_t, size_t> index;
+    CaptureRecord rec;
+    std::vector<char> data;
+    while (Capture::readRecord(in, &rec, data)) {
+        if (rec.type == CAP_OPEN) {
+            index[rec.conn] = conns.size();
+            conns.push_back(Conn());
+            Conn& cn = conns.back();
+            cn.id = rec.conn;
+            cn.open_us = rec.time_us;
+            cn.truncated = false;
+            continue;
+        }
+        auto ci = index.find(rec.conn);
+        if (ci == index.end())
+            continue;
+        Conn& cn = conns[ci->second];
+        if (rec.type == CAP_DATA && rec.len) {
+            cn.chunks.push_back({ rec.time_us, cn.data.size(), rec.len });
+            cn.data.append(data.data(), rec.len);
+        } else if (rec.type == CAP_TRUNC)
+            cn.truncated = true;
+    }
+    fclose(in);
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool
+startConn(Driver& drv, Conn& cn, uint64_t now)
+{
+    int sp[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1)
+        return false;
+    fcntl(sp[0], F_SETFL, O_NONBLOCK);
+    fcntl(sp[1], F_SETFL, O_NONBLOCK);
+    cn.fd = sp[1];
+    cn.chunk = 0;
+    cn.sent = 0;
+    cn.start_ns = now;
+    cn.latency_us = 0;
+    cn.hash = FNV_OFFSET;
+    cn.out_bytes = 0;
+    cn.app_status = 0;
+    cn.reply.clear();
+    cn.ended = false;
+    pollfd newfd = { sp[0], POLLIN, 0 };
+    drv.createRequest(&newfd);
+    return true;
+}
+
+static bool
+sendDue(Conn& cn, uint64_t due_us)
+//! Sends the chunks captured before due_us. Returns true if the socket is full.
+{
+    while (cn.chunk < cn.chunks.size() && cn.chunks[cn.chunk].time_us <= due_us) {
+        const Chunk& ch = cn.chunks[cn.chunk];
+        ssize_t wr = ::write(cn.fd, cn.data.data() + ch.offset + cn.sent, ch.len - cn.sent);
+        if (wr < 0)
+            return errno == EAGAIN;
+        cn.sent += wr;
+        if (cn.sent < ch.len)
+            return true;
+        cn.chunk++;
+        cn.sent = 0;
+    }
+    return false;
+}
+
+static bool
+receive(Conn& cn)
+//! Reads and hashes the response. Returns true when the response has ended.
+{
+    char buffer[0x4000];
+    ssize_t rd;
+    while ((rd = ::read(cn.fd, buffer, sizeof(buffer))) > 0)
+        cn.reply.append(buffer, rd);
+    size_t pos = 0;
+    while (cn.reply.size() - pos >= sizeof(Header)) {
+        const Header* hdr = (const Header*)(cn.reply.data() + pos);
+        size_t total = sizeof(Header) + hdr->content_length.get() + hdr->padding_length;
+        if (cn.reply.size() - pos < total)
+            break;
+        const char* content = cn.reply.data() + pos + sizeof(Header);
+        // Only the content is hashed; record boundaries depend on buffer sizes.
+        if (hdr->type == TYPE_STDOUT) {
+            cn.hash = fnv1a(cn.hash, content, hdr->content_length.get());
+            cn.out_bytes += hdr->content_length.get();
+        } else if (hdr->type == TYPE_END_REQUEST) {
+            cn.app_status = ((const EndRequestMsg*)hdr)->app_status.get();
+            cn.ended = true;
+        }
+        pos += total;
+    }
+    cn.reply.erase(0, pos);
+    return cn.ended || rd == 0;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+int
+main(int argc, char** argv)
+{
+    const char* capfile = 0;
+    const char* hashfile = 0;
+    const char* upload_dir = "/tmp";
+    bool paced = false;
+    double speed = 1;
+    uint32_t concurrency = 8, passes = 1, timeout_ms = 10000;
+    DriverLimits limits;
+    limits.requests = 32;
+    for (int ndx = 1; ndx + 1 < argc; ndx += 2) {
+        if (!strcmp(argv[ndx], "-f"))
+            capfile = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-m"))
+            paced = !strcmp(argv[ndx + 1], "paced");
+        else if (!strcmp(argv[ndx], "-speed"))
+            speed = atof(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-c"))
+            concurrency = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-r"))
+            limits.requests = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-n"))
+            passes = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-t"))
+            timeout_ms = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-o"))
+            hashfile = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-u"))
+            upload_dir = argv[ndx + 1];
+        else
+            capfile = 0, ndx = argc;
+    }
+    if (!capfile || speed <= 0) {
+        printf("Usage: fcgireplay -f capture [-m fast|paced] [-speed factor] [-c connections] "
+               "[-r requests] [-n passes] [-t timeout-ms] [-o hash-file] [-u upload-dir]\n");
+        return 1;
+    }
+    std::vector<Conn> conns;
+    uint32_t sample;
+    if (!load(capfile, conns, &sample))
+        return 2;
+    std::vector<Conn*> replay;
+    for (Conn& cn : conns) {
+        if (!cn.truncated)
+            replay.push_back(&cn);
+    }
+    printf("fcgireplay: %lu connections (sample 1/%u), %lu truncated skipped, %s mode\n",
+           conns.size(), sample, conns.size() - replay.size(), paced ? "paced" : "fast");
+    if (replay.empty())
+        return 0;
+    if (!concurrency || paced)
+        concurrency = replay.size();
+    signal(SIGPIPE, SIG_IGN);
+    limits.validate();
+
+    ReplayArbiter arb;
+    Driver drv(&arb, limits);
+    drv.setFileDir(upload_dir);
+    drv.setAdmission(replay.size(), timeout_ms);
+    Histogram latency;
+    uint32_t completed = 0, failed = 0;
+    uint64_t output_hash = FNV_OFFSET;
+    std::vector<pollfd> pfds(limits.requests + replay.size());
+    std::vector<Conn*> active;
+    uint64_t first_us = replay.front()->open_us;
+    uint64_t begin = now_ns();
+
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        size_t next = 0;
+        uint64_t base = now_ns();
+        while (next < replay.size() || !active.empty()) {
+            uint64_t now = now_ns();
+            // Capture time that has been reached; everything in fast mode.
+            uint64_t due_us = paced ? first_us + (now - base) / 1000 * speed : UINT64_MAX;
+            while (next < replay.size() && active.size() < concurrency &&
+                   replay[next]->open_us <= due_us) {
+                if (!startConn(drv, *replay[next], now)) {
+                    printf("fcgireplay: socketpair failed, errno %d\n", errno);
+                    return 2;
+                }
+                active.push_back(replay[next++]);
+            }
+            size_t count = drv.fillPollFd(pfds.data(), limits.requests);
+            size_t dcount = count;
+            for (Conn* cn : active) {
+                short events = POLLIN;
+                if (sendDue(*cn, due_us))
+                    events |= POLLOUT;
+                pfds[count++] = { cn->fd, events, 0 };
+            }
+            // Wake up for the next captured event in paced mode.
+            uint64_t wait_ns = 10000000;
+            if (paced) {
+                uint64_t next_us = next < replay.size() ? replay[next]->open_us : UINT64_MAX;
+                for (Conn* cn : active) {
+                    if (cn->chunk < cn->chunks.size() && cn->chunks[cn->chunk].time_us < next_us)
+                        next_us = cn->chunks[cn->chunk].time_us;
+                }
+                if (next_us != UINT64_MAX && next_us > due_us &&
+                    (next_us - due_us) * 1000 / speed < wait_ns)
+                    wait_ns = (next_us - due_us) * 1000 / speed;
+            }
+            struct timespec tmo = { 0, (long)wait_ns };
+            ppoll(pfds.data(), count, &tmo, 0);
+
+            for (size_t ndx = 0; ndx < dcount; ndx++) {
+                Request* rq = (pfds[ndx].revents & POLLIN) ? drv.findRequest(pfds[ndx].fd) : 0;
+                if (rq)
+                    drv.read(rq);
+            }
+            drv.work();
+            for (size_t ndx = 0; ndx < dcount; ndx++) {
+                Request* rq = (pfds[ndx].revents & POLLOUT) ? drv.findRequest(pfds[ndx].fd) : 0;
+                if (rq)
+                    drv.write(rq);
+            }
+            drv.freeDormantRequests();
+
+            now = now_ns();
+            for (size_t ndx = 0; ndx < active.size();) {
+                Conn* cn = active[ndx];
+                bool done = receive(*cn);
+                if (!done && now - cn->start_ns < timeout_ms * 1000000UL) {
+                    ndx++;
+                    continue;
+                }
+                ::close(cn->fd);
+                if (cn->ended) {
+                    completed++;
+                    cn->latency_us = (now - cn->start_ns) / 1000;
+                    latency.record(cn->latency_us);
+                } else
+                    failed++;
+                active[ndx] = active.back();
+                active.pop_back();
+            }
+        }
+    }
+    double secs = (now_ns() - begin) / 1e9;
+    drv.freeDormantRequests();
+
+    FILE* out = hashfile ? fopen(hashfile, "w") : 0;
+    if (hashfile && !out)
+        printf("fcgireplay: unable to write %s\n", hashfile);
+    for (Conn* cn : replay) {
+        // Hash of the last pass.
+        output_hash = fnv1a(output_hash, (const char*)&cn->hash, sizeof(cn->hash));
+        if (out) {
+            fprintf(out, "%u %016lx %lu %u %lu%s\n", cn->id, cn->hash, cn->out_bytes,
+                    cn->app_status, cn->latency_us, cn->ended ? "" : " failed");
+        }
+    }
+    if (out)
+        fclose(out);
+    printf("fcgireplay: %u completed, %u failed in %.3f s, %.0f req/s\n", completed, failed, secs,
+           completed / secs);
+    printf("fcgireplay: output hash %016lx\n", output_hash);
+    latency.print(stdout);
+    return failed ? 3 : 0;
+}
@@ -0,0 +1,240 @@
+/***
+Compile:
+g++ -o fcgistat fcgistat.cxx -O2 -fno-rtti -Wno-reorder -Wnon-virtual-dtor -DC4S_LOG_LEVEL=3 -I/usr/local/include/cpp4scripts -L/usr/local/lib -L../release -lfcgi -lc4s -pthread
+
+./fcgistat [-p prefix] [-i interval-ms] [-n count] [-1] [-x] [-clean]
+
+Follows the processes that publish their counters with Driver::enableShmStats (e.g. echo_app -shm
+fcgistat). Segments /dev/shm/<prefix>.<pid> are read without locks or requests, so the interval
+can be as short as the publish interval of the drivers (10ms by default).
+  default  One line per interval with the totals of all processes: slots by state, admit queue,
+           ready queue and per second rates of served and rejected requests, bytes and errors.
+  -1       Prints every counter once as name and value, totals first, and exits.
+  -x       With -1 also the counters of each process.
+  -clean   Removes segments of processes that no longer exist.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../driver/ShmStats.hpp"
+
+using namespace fcgi_driver;
+
+static volatile sig_atomic_t running = 1;
+static const char* state_names[SHM_STAT_STATES] = { "wait", "params", "stdin", "open",
+                                                    "flush", "end",    "eof" };
+
+static void
+onSignal(int)
+{
+    running = 0;
+}
+
+struct Proc
+{
+    uint64_t pid;
+    ShmStatSegment* seg;
+    ShmStatData data;
+};
+
+// -------------------------------------------------------------------------------------------------
+static void
+scan(const char* prefix, std::map<uint64_t, Proc>& procs, bool clean)
+//! Attaches to new segments and drops the ones of exited processes.
+{
+    size_t plen = strlen(prefix);
+    DIR* dir = opendir("/dev/shm");
+    if (!dir)
+        return;
+    struct dirent* de;
+    std::vector<uint64_t> seen;
+    while ((de = readdir(dir)) != 0) {
+        if (strncmp(de->d_name, prefix, plen) || de->d_name[plen] != '.')
+            continue;
+        uint64_t pid = strtoul(de->d_name + plen + 1, 0, 10);
+        if (!pid)
+            continue;
+        std::string name("/");
+        name += de->d_name;
+        if (kill(pid, 0) == -1 && errno == ESRCH) {
+            if (clean && !shm_unlink(name.c_str()))
+                printf("fcgistat: removed stale %s\n", name.c_str());
+            continue;
+        }
+        seen.push_back(pid);
+        if (procs.count(pid))
+            continue;
+        Proc pr;
+        pr.pid = pid;
+        pr.seg = ShmStats::attach(name.c_str());
+        if (!pr.seg)
+            continue;
+        memset(&pr.data, 0, sizeof(pr.data));
+        procs[pid] = pr;
+    }
+    closedir(dir);
+    for (auto it = procs.begin(); it != procs.end();) {
+        bool alive = false;
+        for (uint64_t pid : seen)
+            alive = alive || pid == it->first;
+        if (alive)
+            ++it;
+        else {
+            ShmStats::detach(it->second.seg);
+            it = procs.erase(it);
+        }
+    }
+}
+// -------------------------------------------------------------------------------------------------
+static void
+add(ShmStatData& total, const ShmStatData& data)
+{
+    uint64_t* dst = (uint64_t*)&total;
+    const uint64_t* src = (const uint64_t*)&data;
+    for (size_t ndx = 0; ndx < SHM_STAT_WORDS; ndx++)
+        dst[ndx] += src[ndx];
+}
+// -------------------------------------------------------------------------------------------------
+static void
+printAll(const char* title, const ShmStatData& d)
+{
+    printf("%s\n", title);
+    printf("  %-20s %lu\n", "served", d.served);
+    printf("  %-20s %lu\n", "rejected", d.rejected);
+    printf("  %-20s %lu\n", "requests", d.requests);
+    for (uint32_t st = 0; st < SHM_STAT_STATES; st++)
+        printf("  state.%-14s %lu\n", state_names[st], d.state[st]);
+    printf("  %-20s %lu\n", "admit_waiting", d.admit_waiting);
+    printf("  %-20s %lu\n", "ready", d.ready);
+    printf("  %-20s %lu\n", "limit", d.limit);
+    printf("  %-20s %lu\n", "bytes_in", d.counters.bytes_in);
+    printf("  %-20s %lu\n", "bytes_out", d.counters.bytes_out);
+    printf("  %-20s %lu\n", "spool_disk", d.counters.spool_disk);
+    printf("  %-20s %lu\n", "flush_stalls", d.counters.flush_stalls);
+    printf("  %-20s %lu\n", "aborts", d.counters.aborts);
+    printf("  %-20s %lu\n", "out_of_slot", d.counters.out_of_slot);
+    printf("  %-20s %lu\n", "status_5xx", d.counters.status_5xx);
+    printf("  %-20s %lu\n", "sched.loops", d.sched.loops);
+    printf("  %-20s %lu\n", "sched.accepts", d.sched.accepts);
+    printf("  %-20s %lu\n", "sched.poll_errors", d.sched.poll_errors);
+    printf("  %-20s %lu\n", "sched.signals", d.sched.signals);
+}
+// -------------------------------------------------------------------------------------------------
+static double
+rate(uint64_t now, uint64_t before, double secs)
+{
+    return now >= before ? (now - before) / secs : 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* prefix = SHM_STAT_PREFIX;
+    int interval = 1000;
+    long count = -1;
+    bool once = false, each = false, clean = false;
+    for (int ndx = 1; ndx < argc; ndx++) {
+        if (!strcmp(argv[ndx], "-p") && ndx + 1 < argc)
+            prefix = argv[++ndx];
+        else if (!strcmp(argv[ndx], "-i") && ndx + 1 < argc)
+            interval = atoi(argv[++ndx]);
+        else if (!strcmp(argv[ndx], "-n") && ndx + 1 < argc)
+            count = atol(argv[++ndx]);
+        else if (!strcmp(argv[ndx], "-1"))
+            once = true;
+        else if (!strcmp(argv[ndx], "-x"))
+            each = true;
+        else if (!strcmp(argv[ndx], "-clean"))
+            clean = true;
+        else {
+            printf("Usage: fcgistat [-p prefix] [-i interval-ms] [-n count] [-1] [-x] [-clean]\n");
+            return 1;
+        }
+    }
+    if (interval < 1)
+        interval = 1;
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    std::map<uint64_t, Proc> procs;
+    scan(prefix, procs, clean);
+    if (once) {
+        ShmStatData total;
+        memset(&total, 0, sizeof(total));
+        for (auto& pp : procs) {
+            if (ShmStats::read(pp.second.seg, &pp.second.data))
+                add(total, pp.second.data);
+        }
+        char title[64];
+        snprintf(title, sizeof(title), "total (%lu processes)", procs.size());
+        printAll(title, total);
+        for (auto& pp : procs) {
+            if (each) {
+                snprintf(title, sizeof(title), "pid %lu", pp.first);
+                printAll(title, pp.second.data);
+            }
+        }
+        return 0;
+    }
+
+    // Rates are summed from per process differences so that processes coming and going do not
+    // show up as jumps.
+    struct timespec sleep_ts = { interval / 1000, (interval % 1000) * 1000000L };
+    uint64_t last_us = stat_clock();
+    for (auto& pp : procs)
+        ShmStats::read(pp.second.seg, &pp.second.data);
+    for (long line = 0; running && count; line++) {
+        nanosleep(&sleep_ts, 0);
+        uint64_t now_us = stat_clock();
+        double secs = (now_us - last_us) / 1e6;
+        last_us = now_us;
+        scan(prefix, procs, clean);
+        ShmStatData total;
+        memset(&total, 0, sizeof(total));
+        double served = 0, rejected = 0, bytes_in = 0, bytes_out = 0, errors = 0;
+        for (auto& pp : procs) {
+            ShmStatData prev = pp.second.data;
+            if (!ShmStats::read(pp.second.seg, &pp.second.data))
+                continue;
+            const ShmStatData& cur = pp.second.data;
+            add(total, cur);
+            if (!prev.update_us)
+                continue; // New process.
+            served += rate(cur.served, prev.served, secs);
+            rejected += rate(cur.rejected, prev.rejected, secs);
+            bytes_in += rate(cur.counters.bytes_in, prev.counters.bytes_in, secs);
+            bytes_out += rate(cur.counters.bytes_out, prev.counters.bytes_out, secs);
+            errors += rate(cur.counters.status_5xx + cur.counters.aborts,
+                           prev.counters.status_5xx + prev.counters.aborts, secs);
+        }
+        if (line % 20 == 0) {
+            printf("%5s", "procs");
+            for (uint32_t st = 0; st < SHM_STAT_STATES; st++)
+                printf(" %6s", state_names[st]);
+            printf(" %6s %6s %9s %8s %10s %10s %8s\n", "queue", "ready", "req/s", "rej/s",
+                   "in kB/s", "out kB/s", "err/s");
+        }
+        printf("%5lu", procs.size());
+        for (uint32_t st = 0; st < SHM_STAT_STATES; st++)
+            printf(" %6lu", total.state[st]);
+        printf(" %6lu %6lu %9.0f %8.0f %10.1f %10.1f %8.1f\n", total.admit_waiting, total.ready,
+               served, rejected, bytes_in / 1024, bytes_out / 1024, errors);
+        fflush(stdout);
+        if (count > 0)
+            count--;
+    }
+    for (auto& pp : procs)
+        ShmStats::detach(pp.second.seg);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/***
+Compile:
+g++ -o fcgitrace fcgitrace.cxx -O2 -fno-rtti -Wno-reorder -Wnon-virtual-dtor -DC4S_LOG_LEVEL=3 -I/usr/local/include/cpp4scripts -L/usr/local/lib -L../release -lfcgi -lc4s -pthread
+
+./fcgitrace -f trace-file [-o json-file] [-s]
+
+Converts a binary trace written by Tracer::dump (e.g. echo_app -trace file) into Chrome trace
+event JSON that chrome://tracing and ui.perfetto.dev open. Each thread becomes a track: handler
+exec and done calls, driver work rounds and disk writer batches are slices, the rest instants.
+Every request also gets an async slice from the slot assignment to the close of its connection.
+Timestamps are microseconds from Tracer::enable. With -s a summary of events per thread is printed
+instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "../driver/Trace.hpp"
+
+using namespace fcgi_driver;
+
+static const char* state_names[] = { "wait", "params", "stdin", "open", "flush", "end", "eof" };
+
+struct ThreadTrace
+{
+    TraceThreadHeader hdr;
+    std::vector<TraceRecord> recs;
+};
+
+// -------------------------------------------------------------------------------------------------
+static bool
+load(const char* fname, TraceFileHeader* hdr, std::vector<ThreadTrace>& threads)
+{
+    FILE* in = fopen(fname, "r");
+    if (!in)
+        return false;
+    bool ok = fread(hdr, sizeof(TraceFileHeader), 1, in) == 1 &&
+              !memcmp(hdr->magic, "FCGITRC", 8) && hdr->version == TRACE_VERSION;
+    for (uint32_t ndx = 0; ok && ndx < hdr->threads; ndx++) {
+        ThreadTrace tt;
+        ok = fread(&tt.hdr, sizeof(TraceThreadHeader), 1, in) == 1;
+        if (!ok)
+            break;
+        tt.recs.resize(tt.hdr.count);
+        ok = !tt.hdr.count ||
+             fread(tt.recs.data(), sizeof(TraceRecord), tt.hdr.count, in) == tt.hdr.count;
+        threads.push_back(std::move(tt));
+    }
+    fclose(in);
+    return ok;
+}
+// -------------------------------------------------------------------------------------------------
+static const char*
+phase(uint8_t event)
+{
+    switch (event) {
+    case TE_EXEC:
+    case TE_DONE:
+    case TE_WORK:
+    case TE_DISK:
+        return "B";
+    case TE_EXEC_END:
+    case TE_DONE_END:
+    case TE_WORK_END:
+    case TE_DISK_END:
+        return "E";
+    default:
+        return "i";
+    }
+}
+// -------------------------------------------------------------------------------------------------
+static void
+summary(const TraceFileHeader& hdr, const std::vector<ThreadTrace>& threads)
+{
+    printf("pid %lu, %u threads, %.1f ticks/us\n", hdr.pid, hdr.threads, hdr.ticks_per_us);
+    for (const ThreadTrace& tt : threads) {
+        uint64_t counts[TE_COUNT] = { 0 };
+        double span = 0;
+        for (const TraceRecord& rec : tt.recs) {
+            if (rec.event < TE_COUNT)
+                counts[rec.event]++;
+        }
+        if (tt.recs.size() > 1)
+            span = (tt.recs.back().tsc - tt.recs.front().tsc) / hdr.ticks_per_us / 1000;
+        printf("tid %lu: %lu records (%lu lost) over %.1f ms\n", tt.hdr.tid, tt.hdr.count,
+               tt.hdr.lost, span);
+        for (int ev = 0; ev < TE_COUNT; ev++) {
+            if (counts[ev])
+                printf("  %-10s %-3s %lu\n", Tracer::event_names[ev],
+                       *phase(ev) == 'E' ? "end" : "", counts[ev]);
+        }
+    }
+}
+// -------------------------------------------------------------------------------------------------
+static void
+writeJson(FILE* out, const TraceFileHeader& hdr, const std::vector<ThreadTrace>& threads)
+{
+    const char* sep = ",\n"; // Process name is the first event.
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out,
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,"
+            "\"args\":{\"name\":\"fcgi %lu\"}}",
+            hdr.pid, hdr.pid);
+    for (const ThreadTrace& tt : threads) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%lu,"
+                     "\"args\":{\"name\":\"thread %lu\"}}",
+                sep, hdr.pid, tt.hdr.tid, tt.hdr.tid);
+        for (const TraceRecord& rec : tt.recs) {
+            if (rec.event >= TE_COUNT)
+                continue;
+            double ts = 0;
+            if (rec.tsc >= hdr.tsc_start)
+                ts = (rec.tsc - hdr.tsc_start) / hdr.ticks_per_us;
+            const char* state = "?";
+            if (rec.state < sizeof(state_names) / sizeof(char*))
+                state = state_names[rec.state];
+            fprintf(out,
+                    "%s{\"name\":\"%s\",\"cat\":\"fcgi\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%lu,"
+                    "\"tid\":%lu",
+                    sep, Tracer::event_names[rec.event], phase(rec.event), ts, hdr.pid,
+                    tt.hdr.tid);
+            if (!strcmp(phase(rec.event), "i"))
+                fprintf(out, ",\"s\":\"t\"");
+            fprintf(out,
+                    ",\"args\":{\"fd\":%d,\"slot\":%d,\"state\":\"%s\",\"arg\":%u,\"aux\":%u}}",
+                    rec.fd, rec.slot == TRACE_NO_SLOT ? -1 : rec.slot, state, rec.arg, rec.aux);
+            // Request lifetime as an async slice keyed by the slot.
+            if ((rec.event == TE_START || rec.event == TE_CLOSE) && rec.slot != TRACE_NO_SLOT)
+                fprintf(out,
+                        "%s{\"name\":\"request\",\"cat\":\"request\",\"ph\":\"%s\",\"ts\":%.3f,"
+                        "\"pid\":%lu,\"tid\":%lu,\"id\":%u,\"args\":{\"fd\":%d}}",
+                        sep, rec.event == TE_START ? "b" : "e", ts, hdr.pid, tt.hdr.tid,
+                        rec.slot, rec.fd);
+        }
+    }
+    fprintf(out, "\n]}\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* in_file = 0;
+    const char* out_file = 0;
+    bool sum = false, usage = false;
+    for (int ndx = 1; ndx < argc; ndx++) {
+        if (!strcmp(argv[ndx], "-f") && ndx + 1 < argc)
+            in_file = argv[++ndx];
+        else if (!strcmp(argv[ndx], "-o") && ndx + 1 < argc)
+            out_file = argv[++ndx];
+        else if (!strcmp(argv[ndx], "-s"))
+            sum = true;
+        else
+            usage = true;
+    }
+    if (!in_file || usage) {
+        printf("Usage: fcgitrace -f trace-file [-o json-file] [-s]\n");
+        return 1;
+    }
+    TraceFileHeader hdr;
+    std::vector<ThreadTrace> threads;
+    if (!load(in_file, &hdr, threads)) {
+        fprintf(stderr, "fcgitrace: %s is not a complete trace file\n", in_file);
+        return 2;
+    }
+    if (sum) {
+        summary(hdr, threads);
+        return 0;
+    }
+    FILE* out = out_file ? fopen(out_file, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "fcgitrace: unable to create %s\n", out_file);
+        return 2;
+    }
+    writeJson(out, hdr, threads);
+    if (out_file)
+        fclose(out);
+    return 0;
+}
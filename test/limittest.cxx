@@ -0,0 +1,64 @@
+/***
+Compile:
+g++ -o limittest limittest.cxx ../driver/AdaptiveLimit.cpp -ggdb -Wall
+
+./limittest
+ */
+
+#include <stdio.h>
+#include "../driver/AdaptiveLimit.hpp"
+
+using namespace fcgi_driver;
+
+static uint64_t now_us = 0;
+
+// Simulated service: latency stays at base until concurrency passes capacity, then grows with
+// the queue.
+uint32_t
+run(AdaptiveLimit& al, uint64_t base, uint32_t capacity, int windows)
+{
+    for (int win = 0; win < windows; win++) {
+        uint32_t inflight = al.getLimit();
+        uint64_t rtt = inflight > capacity ? base * inflight / capacity : base;
+        for (int ndx = 0; ndx < 20; ndx++) {
+            now_us += 10000;
+            al.sample(rtt, inflight, now_us);
+        }
+    }
+    return al.getLimit();
+}
+
+int
+main()
+{
+    int fails = 0;
+    LimitStats st;
+    AdaptiveLimit al(4, 256, 8);
+
+    uint32_t grown = run(al, 2000, 64, 100);
+    al.getStats(&st);
+    printf("fast backend:  limit %u rtt %lu/%lu us\n", grown, st.rtt_short, st.rtt_long);
+    if (grown < 32)
+        fails++;
+
+    // Backend slows down: capacity drops to a quarter.
+    uint32_t shrunk = run(al, 2000, 16, 100);
+    al.getStats(&st);
+    printf("slow backend:  limit %u rtt %lu/%lu us\n", shrunk, st.rtt_short, st.rtt_long);
+    if (shrunk >= grown)
+        fails++;
+
+    // Idle application does not push the limit up. First window still has the busy samples.
+    uint32_t before = 0;
+    for (int ndx = 0; ndx < 200; ndx++) {
+        now_us += 10000;
+        al.sample(2000, 1, now_us);
+        if (ndx == 20)
+            before = al.getLimit();
+    }
+    printf("idle:          limit %u\n", al.getLimit());
+    if (al.getLimit() > before)
+        fails++;
+    printf("%s\n", fails ? "FAIL" : "OK");
+    return fails;
+}
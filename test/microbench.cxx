@@ -0,0 +1,437 @@
+/***
+Compile:
+g++ -o microbench microbench.cxx -O2 -fno-rtti -Wno-reorder -Wnon-virtual-dtor -DC4S_LOG_LEVEL=3 -I/usr/local/include/cpp4scripts -L/usr/local/lib -L../release -lfcgi -lc4s -lhoedown
+
+./microbench [-t seconds] [-r rounds] [-f filter] [-json file] [-compare file]
+
+Micro-benchmarks of the driver and framework kernels. Each benchmark is run in batches until the
+time limit (default 0.2 s) is reached, in a number of rounds (default 5); the fastest round is
+reported as ns/op, MB/s for benchmarks that process bytes and cycles/op (time stamp counter on
+x86, 0 elsewhere). With -json results are written one benchmark per line so that -compare can read
+an earlier run and print the change.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../libfcgi.hpp"
+
+using namespace fcgi_driver;
+using namespace fcgi_frame;
+
+static volatile uint64_t sink; // Keeps the compiler from removing the benchmarked work.
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations;
+    double ns_op;
+    double mb_s;
+    double cycles_op;
+    size_t bytes_op;
+};
+
+static std::vector<BenchResult> results;
+static double min_time = 0.2;
+static int rounds = 5;
+static const char* filter = 0;
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static uint64_t
+cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+template <class F>
+static void
+bench(const char* name, size_t bytes_op, F fn)
+{
+    if (filter && !strstr(name, filter))
+        return;
+    // Find the batch size that takes about 1/10 of the time limit.
+    uint64_t batch = 1;
+    for (;;) {
+        uint64_t start = now_ns();
+        for (uint64_t ndx = 0; ndx < batch; ndx++)
+            fn();
+        if (now_ns() - start > min_time * 1e8 || batch >= (1UL << 40))
+            break;
+        batch *= 2;
+    }
+    BenchResult best = { name, 0, 1e30, 0, 0, bytes_op };
+    for (int round = 0; round < rounds; round++) {
+        uint64_t iters = 0, start = now_ns(), cyc = cycles(), elapsed;
+        do {
+            for (uint64_t ndx = 0; ndx < batch; ndx++)
+                fn();
+            iters += batch;
+            elapsed = now_ns() - start;
+        } while (elapsed < min_time * 1e9);
+        double ns_op = (double)elapsed / iters;
+        if (ns_op < best.ns_op) {
+            best.ns_op = ns_op;
+            best.iterations = iters;
+            best.cycles_op = (double)(cycles() - cyc) / iters;
+        }
+    }
+    best.mb_s = bytes_op ? bytes_op / best.ns_op * 1e9 / 0x100000 : 0;
+    results.push_back(best);
+    printf("%-32s %12.1f ns/op %10.1f MB/s %10.0f cyc/op %12lu\n", name, best.ns_op, best.mb_s,
+           best.cycles_op, best.iterations);
+}
+
+// -------------------------------------------------------------------------------------------------
+// Access to the multipart parser without a connection.
+
+class BenchRequest : public Request
+{
+  public:
+    void setBoundary(const char* tag)
+    {
+        strcpy(boundary, "\r\n--");
+        strcat(boundary, tag);
+        bound_len = strlen(boundary);
+    }
+    size_t parse(char* data, size_t len)
+    {
+        ParseData pd(fieldBuffer(), field_size);
+        content_length = len;
+        size_t left = len;
+        while (left) {
+            size_t used = parseMultipart(data, left, &pd);
+            if (pd.mp_state == MP_FINISH || !used)
+                break;
+            pd.spool_offset += used;
+            left -= used;
+            data += used;
+        }
+        return upload_ndx;
+    }
+};
+
+// -------------------------------------------------------------------------------------------------
+
+static void
+benchRingBuffer()
+{
+    char block[0x1000];
+    memset(block, 'r', sizeof(block));
+    for (int mode = RB_HEAP; mode <= RB_MIRROR; mode++) {
+        const char* sfx = mode == RB_HEAP ? "heap" : "mirror";
+        RingBuffer rb(0x10000, (RB_MODE)mode);
+        char name[64];
+        sprintf(name, "ringbuffer.write_read_1k.%s", sfx);
+        bench(name, 1024, [&]() {
+            rb.write(block, 1024);
+            sink += rb.read(block, 1024);
+        });
+        // Uneven size so that the data wraps around the end of the buffer.
+        sprintf(name, "ringbuffer.write_read_3001.%s", sfx);
+        bench(name, 3001, [&]() {
+            rb.write(block, 3001);
+            sink += rb.read(block, 3001);
+        });
+        rb.clear();
+        rb.write(block, 0x800);
+        sprintf(name, "ringbuffer.peek_256.%s", sfx);
+        bench(name, 256, [&]() { sink += rb.peek(block, 256); });
+        rb.clear();
+        ParamData pd(0x1000);
+        const char* query = "fn=list&id=42&lang=en&name=Jane%20Doe&email=jane%40example.com&page=3";
+        size_t qlen = strlen(query);
+        sprintf(name, "ringbuffer.push_to_params.%s", sfx);
+        bench(name, qlen, [&]() {
+            pd.clear();
+            rb.write(query, qlen);
+            sink += rb.push_to(&pd, qlen);
+        });
+    }
+}
+
+static void
+benchParams()
+{
+    char keys[32][16], values[32][24];
+    uint64_t hashes[32];
+    for (int ndx = 0; ndx < 32; ndx++) {
+        sprintf(keys[ndx], "HTTP_KEY_%02d", ndx);
+        sprintf(values[ndx], "value number %d", ndx);
+        hashes[ndx] = fnv_64bit_hash(keys[ndx], strlen(keys[ndx]));
+    }
+    ParamData pd(0x1000);
+    bench("params.add_32", 0, [&]() {
+        pd.clear();
+        for (int ndx = 0; ndx < 32; ndx++)
+            pd.add(hashes[ndx], values[ndx]);
+        sink += pd.size();
+    });
+    uint32_t ndx = 0;
+    bench("params.get_hash", 0, [&]() {
+        sink += (uintptr_t)pd.get(hashes[ndx++ & 31]);
+    });
+    bench("params.get_name", 0, [&]() {
+        const char* key = keys[ndx++ & 31];
+        sink += (uintptr_t)pd.get(key, strlen(key));
+    });
+    bench("params.get_miss", 0, [&]() { sink += (uintptr_t)pd.get(0x1234567887654321UL); });
+}
+
+static void
+benchHash()
+{
+    const char* short_key = "HTTP_USER_AGENT";
+    char long_key[256];
+    memset(long_key, 'h', sizeof(long_key));
+    bench("fnv_64bit_hash.15", 15, [&]() { sink += fnv_64bit_hash(short_key, 15); });
+    bench("fnv_64bit_hash.256", 256, [&]() { sink += fnv_64bit_hash(long_key, 256); });
+}
+
+static void
+benchTrace()
+{
+    bench("trace.off", 0, [&]() { TRACE_EVENT(TE_READ, 5, RQS_OPEN, 0, sink, 0); });
+    Tracer::enable(0x1000);
+    bench("trace.on", 0, [&]() { TRACE_EVENT(TE_READ, 5, RQS_OPEN, 0, sink, 0); });
+    Tracer::disable();
+}
+
+static void
+benchMultipart()
+{
+    std::string corpus = "\r\n--bench42\r\n"
+                         "Content-Disposition: form-data; name=\"title\"\r\n\r\n"
+                         "Quarterly report\r\n"
+                         "--bench42\r\n"
+                         "Content-Disposition: form-data; name=\"notes\"\r\n\r\n"
+                         "Some notes that are a bit longer than the title field.\r\n"
+                         "--bench42\r\n"
+                         "Content-Disposition: form-data; name=\"file\"; filename=\"data.bin\"\r\n"
+                         "Content-Type: application/octet-stream\r\n\r\n";
+    corpus.append(0x4000, 'm');
+    corpus += "\r\n--bench42--\r\n";
+    std::vector<char> work(corpus.size() + 4);
+    BenchRequest req;
+    // Make sure the corpus parses before timing it.
+    memcpy(work.data(), corpus.data(), corpus.size());
+    memset(work.data() + corpus.size(), 0, 4);
+    req.setBoundary("bench42");
+    if (req.parse(work.data(), corpus.size()) != 1)
+        printf("request.parse_multipart: corpus did not produce one upload\n");
+    req.clear();
+    bench("request.parse_multipart_16k", corpus.size(), [&]() {
+        // Parser works in place, hence the copy.
+        memcpy(work.data(), corpus.data(), corpus.size());
+        memset(work.data() + corpus.size(), 0, 4);
+        req.setBoundary("bench42");
+        sink += req.parse(work.data(), corpus.size());
+        req.clear();
+    });
+}
+
+static void
+benchBase64()
+{
+    unsigned char raw[1024], dec[1025];
+    char enc[2048];
+    for (size_t ndx = 0; ndx < sizeof(raw); ndx++)
+        raw[ndx] = ndx * 7;
+    size_t elen = base64_encode(enc, sizeof(enc), raw, sizeof(raw), Base64Type::URL);
+    if (base64_decode(dec, sizeof(dec), enc, Base64Type::URL) != sizeof(raw) ||
+        memcmp(dec, raw, sizeof(raw)))
+        printf("base64: round trip failed\n");
+    bench("base64.encode_1k", sizeof(raw), [&]() {
+        sink += base64_encode(enc, sizeof(enc), raw, sizeof(raw), Base64Type::URL);
+    });
+    bench("base64.decode_1k", elen, [&]() {
+        sink += base64_decode(dec, sizeof(dec), enc, Base64Type::URL);
+    });
+}
+
+static void
+benchFramework()
+{
+    std::string text = "<p class=\"note\">Tom's \"quoted\" text & more</p>\n\tSecond line with "
+                       "plain words only to make it a typical length for a table cell.";
+    char target[1024], url[512], work[512];
+    bench("framework.escape_html", text.size(), [&]() {
+        Framework::escapeHtml(target, text.c_str());
+        sink += target[0];
+    });
+    bench("framework.escape_html_string", text.size(),
+          [&]() { sink += (uintptr_t)Framework::escapeHtml(text); });
+    bench("framework.escape_json", text.size(),
+          [&]() { sink += (uintptr_t)Framework::escapeJson(text); });
+    const char* plain = "/app/search?q=fast cgi <library> {docs} & more|stuff^here";
+    bench("framework.encode_url", strlen(plain), [&]() {
+        Framework::encodeURL(plain, url, sizeof(url));
+        sink += url[0];
+    });
+    Framework::encodeURL(plain, url, sizeof(url));
+    size_t ulen = strlen(url);
+    bench("framework.decode_url", ulen, [&]() {
+        memcpy(work, url, ulen + 1);
+        Framework::decodeURL(work);
+        sink += work[0];
+    });
+    std::string decoded;
+    bench("framework.decode_url_string", ulen, [&]() {
+        Framework::decodeURL(url, decoded);
+        sink += decoded.size();
+    });
+}
+
+static void
+benchAppStr()
+{
+    char fname[] = "/tmp/microbench_XXXXXX";
+    int fd = mkstemp(fname);
+    if (fd == -1)
+        return;
+    FILE* fs = fdopen(fd, "w");
+    for (int grp = 0; grp < 4; grp++) {
+        for (int ndx = 0; ndx < 64; ndx++)
+            fprintf(fs, "%02X%02X \"Group %d string %d\"\n", grp, ndx, grp, ndx);
+    }
+    fclose(fs);
+    try {
+        AppStr as(fname, "en");
+        uint32_t ndx = 0;
+        bench("appstr.getsp", 0, [&]() {
+            uint32_t id = ndx++;
+            sink += (uintptr_t)as.getsp(((id & 3) << 8) + (id >> 2 & 63));
+        });
+    } catch (const std::exception& ex) {
+        printf("appstr: %s\n", ex.what());
+    }
+    unlink(fname);
+}
+
+static void
+benchTmDatetime()
+{
+    TmDatetime dt;
+    bench("tmdatetime.parse_iso", 19, [&]() { sink += dt.parseISO("2021-06-15T12:34:56"); });
+    bench("tmdatetime.parse_iso_date", 10, [&]() { sink += dt.parseISO("2021-06-15"); });
+    dt.parseISO("2021-06-15T12:34:56");
+    bench("tmdatetime.print", 0, [&]() { sink += (uintptr_t)dt.print(APPSTR_EN); });
+    bench("tmdatetime.print_iso_timestamp", 0,
+          [&]() { sink += (uintptr_t)dt.printISOTimestamp(); });
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static bool
+writeJson(const char* fname)
+{
+    FILE* out = strcmp(fname, "-") ? fopen(fname, "w") : stdout;
+    if (!out)
+        return false;
+    char host[64] = "";
+    gethostname(host, sizeof(host) - 1);
+    fprintf(out, "{\"host\": \"%s\", \"time\": %ld, \"min_time\": %.3f, \"rounds\": %d,\n", host,
+            (long)time(0), min_time, rounds);
+    fprintf(out, " \"benchmarks\": [\n");
+    for (size_t ndx = 0; ndx < results.size(); ndx++) {
+        const BenchResult& br = results[ndx];
+        fprintf(out,
+                "  {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.3f, \"mb_per_s\": "
+                "%.3f, \"cycles_per_op\": %.1f, \"bytes_per_op\": %lu}%s\n",
+                br.name.c_str(), br.iterations, br.ns_op, br.mb_s, br.cycles_op, br.bytes_op,
+                ndx + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, " ]}\n");
+    if (out != stdout)
+        fclose(out);
+    return true;
+}
+
+static void
+compare(const char* fname)
+//! Reads benchmark lines of an earlier -json output and prints the change in ns/op.
+{
+    FILE* in = fopen(fname, "r");
+    if (!in) {
+        printf("Unable to open %s\n", fname);
+        return;
+    }
+    printf("\n%-32s %12s %12s %9s\n", "compared to earlier run", "before ns", "now ns", "change");
+    char line[512], name[128];
+    double ns;
+    while (fgets(line, sizeof(line), in)) {
+        const char* nm = strstr(line, "\"name\": \"");
+        const char* nsp = strstr(line, "\"ns_per_op\": ");
+        if (!nm || !nsp || sscanf(nm + 9, "%127[^\"]", name) != 1 ||
+            sscanf(nsp + 13, "%lf", &ns) != 1)
+            continue;
+        for (const BenchResult& br : results) {
+            if (br.name == name) {
+                printf("%-32s %12.1f %12.1f %+8.1f%%\n", name, ns, br.ns_op,
+                       (br.ns_op - ns) / ns * 100);
+                break;
+            }
+        }
+    }
+    fclose(in);
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* json = 0;
+    const char* before = 0;
+    for (int ndx = 1; ndx + 1 < argc; ndx += 2) {
+        if (!strcmp(argv[ndx], "-t"))
+            min_time = atof(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-r"))
+            rounds = atoi(argv[ndx + 1]);
+        else if (!strcmp(argv[ndx], "-f"))
+            filter = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-json"))
+            json = argv[ndx + 1];
+        else if (!strcmp(argv[ndx], "-compare"))
+            before = argv[ndx + 1];
+        else {
+            printf("Usage: microbench [-t seconds] [-r rounds] [-f filter] [-json file] "
+                   "[-compare file]\n");
+            return 1;
+        }
+    }
+    if (rounds < 1)
+        rounds = 1;
+    benchRingBuffer();
+    benchParams();
+    benchHash();
+    benchTrace();
+    benchMultipart();
+    benchBase64();
+    benchFramework();
+    benchAppStr();
+    benchTmDatetime();
+    if (before)
+        compare(before);
+    if (json && !writeJson(json)) {
+        printf("Unable to write %s\n", json);
+        return 1;
+    }
+    return 0;
+}
@@ -5,6 +5,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <sstream>
+#include <deque>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 #include "../driver/RingBuffer.hpp"
@@ -77,8 +83,226 @@ int test2(const char *fname)
     return 0;
 }
 
+static double elapsed_ns(const struct timespec &start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+}
+
+// Micro-benchmark of the bulk operations. Each round writes 'size' bytes and consumes them again
+// with the measured operation. The write-only row is the cost to subtract.
+int bench()
+{
+    const int rounds = 200000;
+    const size_t sizes[] = { 8, 256, 4000 };
+    char block[4000];
+    struct timespec start;
+    fcgi_driver::RingBuffer rb(0x11000);
+    string str;
+    ostringstream os;
+    int devnull = open("/dev/null", O_WRONLY);
+
+    memset(block, 'x', sizeof(block));
+    cout << "operation          size      ns/op\n";
+    for(size_t size : sizes) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int ndx=0; ndx<rounds; ndx++) {
+            rb.write(block, size);
+            rb.clear();
+        }
+        printf("write only     %8zu %10.1f\n", size, elapsed_ns(start)/rounds);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int ndx=0; ndx<rounds; ndx++) {
+            rb.write(block, size);
+            rb.discard(size);
+        }
+        printf("discard        %8zu %10.1f\n", size, elapsed_ns(start)/rounds);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int ndx=0; ndx<rounds; ndx++) {
+            rb.write(block, size);
+            str.clear();
+            rb.read_into(str);
+        }
+        printf("read_into(str) %8zu %10.1f\n", size, elapsed_ns(start)/rounds);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int ndx=0; ndx<rounds; ndx++) {
+            rb.write(block, size);
+            rb.read_into(devnull, size);
+        }
+        printf("read_into(fd)  %8zu %10.1f\n", size, elapsed_ns(start)/rounds);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int ndx=0; ndx<rounds; ndx++) {
+            rb.write(block, size);
+            os.seekp(0);
+            rb.exp_as_text(os, size, fcgi_driver::RingBuffer::TEXT);
+        }
+        printf("exp_as_text    %8zu %10.1f\n", size, elapsed_ns(start)/rounds);
+    }
+    close(devnull);
+    return 0;
+}
+
+// Randomized check against a deque model. Every operation is applied to both and the returned
+// sizes, the data and size()/capacity() must agree. Operation lengths go up to the whole buffer so
+// that wrap-around, full (eof) and empty states are all hit.
+static bool model_check(fcgi_driver::RingBuffer &rb, deque<char> &model, unsigned int &seed,
+                        int rounds, int pfd[2])
+{
+    size_t rbmax = rb.max_size();
+    vector<char> in(rbmax), out(rbmax);
+    string str;
+    char fill = 0;
+
+    for(int round=0; round<rounds; round++) {
+        int op = rand_r(&seed) % 10;
+        size_t len = rand_r(&seed) % (rbmax + rbmax/4) + 1;
+        size_t cap = rbmax - model.size();
+        size_t avail = model.size();
+        size_t exp, got = 0;
+        const char *ptr = 0;
+        bool data_ok = true;
+
+        switch(op) {
+        case 0: // write
+        case 1:
+            for(size_t ndx=0; ndx<len && ndx<rbmax; ndx++)
+                in[ndx] = ++fill;
+            if(len > rbmax)
+                len = rbmax;
+            exp = len < cap ? len : cap;
+            got = rb.write(in.data(), len);
+            model.insert(model.end(), in.begin(), in.begin() + exp);
+            break;
+        case 2: // read_from
+            exp = len < cap ? len : cap;
+            if(exp > 0x8000)
+                exp = 0x8000; // Pipe capacity
+            for(size_t ndx=0; ndx<exp; ndx++)
+                in[ndx] = ++fill;
+            if(exp && write(pfd[1], in.data(), exp) != (ssize_t)exp)
+                return false;
+            got = exp ? rb.read_from(pfd[0], exp) : 0;
+            model.insert(model.end(), in.begin(), in.begin() + exp);
+            break;
+        case 3: // read
+            if(len > rbmax)
+                len = rbmax;
+            exp = len < avail ? len : avail;
+            got = rb.read(out.data(), len);
+            data_ok = equal(out.begin(), out.begin() + exp, model.begin());
+            model.erase(model.begin(), model.begin() + exp);
+            break;
+        case 4: // peek
+            if(len > rbmax)
+                len = rbmax;
+            exp = len < avail ? len : avail;
+            got = rb.peek(out.data(), len);
+            data_ok = equal(out.begin(), out.begin() + exp, model.begin());
+            break;
+        case 5: { // peek_span + discard
+            exp = len < avail ? len : avail;
+            got = rb.peek_span(&ptr, len);
+            if(got < exp && (rb.is_mirror() || !got)) {
+                exp = (size_t)-1; // Only heap mode may stop at the end of the buffer.
+                break;
+            }
+            exp = got;
+            data_ok = equal(ptr, ptr + got, model.begin()) && rb.discard(got) == got;
+            model.erase(model.begin(), model.begin() + got);
+            break;
+        }
+        case 6: // view + discard
+            exp = len;
+            ptr = rb.view(len);
+            if(!ptr) {
+                // Too little data or, in heap mode only, the data wraps.
+                got = len;
+                data_ok = len > avail || (!rb.is_mirror() && rb.peek_span(&ptr, len) < len);
+                break;
+            }
+            got = len;
+            data_ok = len <= avail && equal(ptr, ptr + len, model.begin()) && rb.discard(len) == len;
+            model.erase(model.begin(), model.begin() + len);
+            break;
+        case 7: { // exp_as_text
+            ostringstream os;
+            exp = len < avail ? len : avail;
+            got = rb.exp_as_text(os, len, fcgi_driver::RingBuffer::TEXT);
+            str = os.str();
+            data_ok = str.size() == exp && equal(str.begin(), str.end(), model.begin());
+            model.erase(model.begin(), model.begin() + exp);
+            break;
+        }
+        case 8: // read_into string
+            exp = avail;
+            str.assign("x");
+            got = rb.read_into(str);
+            data_ok = str.size() == exp + 1 && equal(str.begin() + 1, str.end(), model.begin());
+            model.clear();
+            break;
+        default: // discard
+            exp = len < avail ? len : avail;
+            got = rb.discard(len);
+            model.erase(model.begin(), model.begin() + exp);
+            break;
+        }
+        if(got != exp || !data_ok || rb.size() != model.size() ||
+           rb.capacity() != rbmax - model.size() || rb.is_eof() != (model.size() == rbmax)) {
+            cout << "round " << round << " op " << op << " len " << len << " expected " << exp
+                 << " got " << got << " data " << (data_ok ? "ok" : "differs") << " size "
+                 << rb.size() << '/' << model.size() << '\n';
+            rb.dump(cout);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs the model check in heap and mirror modes. Mirror sizes are rounded up to page size and
+// the odd sizes make sure that the rounded RBMAX is what the buffer actually uses.
+int random_test(unsigned int seed)
+{
+    const size_t sizes[] = { 100, 4096, 5000, 0x11000 };
+    int pfd[2];
+    int failed = 0;
+
+    if(pipe(pfd) == -1) {
+        cout << "Unable to create pipe\n";
+        return 1;
+    }
+    fcntl(pfd[1], F_SETPIPE_SZ, 0x10000);
+    for(int mode=0; mode<2; mode++) {
+        for(size_t size : sizes) {
+            fcgi_driver::RingBuffer rb(size, mode ? fcgi_driver::RB_MIRROR : fcgi_driver::RB_HEAP);
+            deque<char> model;
+            unsigned int rs = seed + size;
+            bool ok = model_check(rb, model, rs, 20000, pfd);
+            cout << (rb.is_mirror() ? "mirror " : "heap   ") << size << " -> " << rb.max_size()
+                 << (ok ? " ok\n" : " FAILED\n");
+            if(mode && !rb.is_mirror())
+                cout << "  mirror mapping not available, tested heap\n";
+            if(!ok)
+                failed++;
+        }
+    }
+    close(pfd[0]);
+    close(pfd[1]);
+    if(failed)
+        cout << "seed " << seed << ": " << failed << " failures\n";
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
+    if(argc==2 && argv[1][0]=='B')
+        return bench();
+    if(argc>=2 && argv[1][0]=='R')
+        return random_test(argc==3 ? atoi(argv[2]) : time(0));
     if(argc!=3) {
         cout << "Missing parameters\n";
         return 1;
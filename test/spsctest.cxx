@@ -0,0 +1,76 @@
+/***
+Compile:
+g++ -o spsctest spsctest.cxx ../driver/SpscRing.cpp -O2 -Wall -pthread
+
+./spsctest [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "../driver/SpscRing.hpp"
+
+using namespace fcgi_driver;
+
+static size_t total = 0;
+
+void*
+producer(void* arg)
+{
+    SpscRing* ring = (SpscRing*)arg;
+    char chunk[4096];
+    uint8_t seq = 0;
+    size_t sent = 0;
+    while (sent < total) {
+        size_t len = rand() % sizeof(chunk) + 1;
+        if (len > total - sent)
+            len = total - sent;
+        for (size_t ndx = 0; ndx < len; ndx++)
+            chunk[ndx] = seq + ndx;
+        size_t done = 0;
+        while (done < len)
+            done += ring->write(chunk + done, len - done);
+        seq += len;
+        sent += len;
+    }
+    ring->close();
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    total = (argc > 1 ? atol(argv[1]) : 256) * 0x100000;
+    SpscRing ring(0x10000, true);
+    pthread_t thread;
+    struct timespec start, stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&thread, 0, producer, &ring);
+    char buffer[8192];
+    uint8_t expect = 0;
+    size_t received = 0;
+    for (;;) {
+        size_t rd = ring.read_wait(buffer, sizeof(buffer), 100);
+        if (!rd) {
+            if (ring.is_closed() && !ring.size())
+                break;
+            continue;
+        }
+        for (size_t ndx = 0; ndx < rd; ndx++, expect++) {
+            if ((uint8_t)buffer[ndx] != expect) {
+                printf("FAIL: data mismatch at %ld\n", received + ndx);
+                return 1;
+            }
+        }
+        received += rd;
+    }
+    pthread_join(thread, 0);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %ld bytes in %.3f s, %.1f MB/s\n", received == total ? "OK" : "FAIL", received,
+           secs, received / secs / 0x100000);
+    return received == total ? 0 : 1;
+}